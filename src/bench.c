@@ -0,0 +1,803 @@
+/***********************************************************************************
+ *                                                                                 *
+ * FERNET: Fluorescence Emission Recipes and NumErical routines Toolkit            *
+ * Developed by Juan F. Angiolini and Esteban Mocskos                              *
+ * Facultad de Ciencias Exactas y Naturales, UBA                                   *
+ *                                                                                 *
+ * This program is free software; you can redistribute it and/or                   *
+ * modify it under the terms of the GNU General Public License                     *
+ * as published by the Free Software Foundation; either version 2                  *
+ * of the License, or (at your option) any later version.                          *
+ *                                                                                 *
+ * This program is distributed in the hope that it will be useful,                 *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of                  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                   *
+ * GNU General Public License for more details.                                    *
+ *                                                                                 *
+ * You should have received a copy of the GNU General Public License               *
+ * along with this program; if not, write to the Free Software                     *
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. *
+ *                                                                                 *
+ ***********************************************************************************/
+
+#include "fernet.h"
+
+/***********************************************************************************
+ * Benchmarks of the input and emission stages. Each one runs the current code
+ * path and the one it replaced on the same data, and reports their throughput.
+ ***********************************************************************************/
+
+static void benchParse(const char *, int);
+static void benchDecode(const char *);
+static void benchBinomial(struct rng *);
+static void benchChannels(struct rng *);
+static void benchKernel(struct rng *);
+static void benchGrid(struct rng *);
+static void benchAggregate(struct rng *);
+static void benchPSF(struct rng *);
+static void benchRng(struct rng *);
+static double elapsed(struct timespec *);
+
+int benchRoutine(int argc, char **argv)
+{
+	struct arg_str *name = arg_str1(NULL, NULL, "<benchmark>", "benchmark to run: parse, decode, binomial, channels, kernel, grid, aggregate, psf, rng");
+	struct arg_file *infile = arg_file0(NULL, NULL, "<input>", "input position file");
+	struct arg_int *threads = arg_int0("j", "threads", "<n>", "also measure parsing on n threads");
+	struct arg_lit *help = arg_lit0(NULL, "help", "print this help and exit");
+	struct arg_end *end = arg_end(20);
+	void *argtable[] = { name, infile, threads, help, end };
+	int nerrors;
+
+	if (arg_nullcheck(argtable) != 0) {
+		printf("%s: insufficient memory\n", argv[0]);
+		exit(1);
+	}
+
+	nerrors = arg_parse(argc, argv, argtable);
+
+	if (help->count > 0) {
+		printf("Usage: %s bench", PROGNAME);
+		arg_print_syntax(stdout, argtable, "\n");
+		printf("Measure the throughput of FERNET stages against the code they replaced.\n");
+		arg_print_glossary(stdout, argtable, "  %-35s %s\n");
+		exit(0);
+	}
+
+	if (nerrors > 0) {
+		arg_print_errors(stdout, end, "bench");
+		printf("Try 'bench --help' for more information.\n");
+		exit(1);
+	}
+
+	if (!strcmp(name->sval[0], "parse")) {
+		if (infile->count == 0) {
+			fprintf(stderr, "The parse benchmark needs an input text position file.\n");
+			exit(1);
+		}
+		benchParse(infile->filename[0], threads->count > 0 ? threads->ival[0] : 1);
+	} else if (!strcmp(name->sval[0], "decode")) {
+		if (infile->count == 0) {
+			fprintf(stderr, "The decode benchmark needs an input binary position file.\n");
+			exit(1);
+		}
+		benchDecode(infile->filename[0]);
+	} else if (!strcmp(name->sval[0], "binomial")) {
+		struct rng *r = newRng(time(NULL));
+		benchBinomial(r);
+		freeRng(r);
+	} else if (!strcmp(name->sval[0], "channels")) {
+		struct rng *r = newRng(time(NULL));
+		benchChannels(r);
+		freeRng(r);
+	} else if (!strcmp(name->sval[0], "kernel")) {
+		struct rng *r = newRng(time(NULL));
+		benchKernel(r);
+		freeRng(r);
+	} else if (!strcmp(name->sval[0], "grid")) {
+		struct rng *r = newRng(time(NULL));
+		benchGrid(r);
+		freeRng(r);
+	} else if (!strcmp(name->sval[0], "aggregate")) {
+		struct rng *r = newRng(time(NULL));
+		benchAggregate(r);
+		freeRng(r);
+	} else if (!strcmp(name->sval[0], "psf")) {
+		struct rng *r = newRng(time(NULL));
+		benchPSF(r);
+		freeRng(r);
+	} else if (!strcmp(name->sval[0], "rng")) {
+		struct rng *r = newRng(time(NULL));
+		benchRng(r);
+		freeRng(r);
+	} else {
+		fprintf(stderr, "Unknown benchmark '%s'.\n", name->sval[0]);
+		exit(1);
+	}
+
+	arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+
+	return 0;
+}
+
+/***********************************************************************************
+ * Text parsing: the fscanf loop every mode used against readFrame, on one and on
+ * nthreads threads. All sum the parsed coordinates, so a differing checksum
+ * points at a parsing difference. Molecules after the last separator belong to no
+ * time step and are left out of both.
+ ***********************************************************************************/
+
+static void benchParse(const char *filename, int nthreads)
+{
+	struct timespec start;
+	struct stat st;
+	double t_scanf, t_frame[2], sum_scanf = 0, sum_frame[2] = { 0, 0 }, sum_step = 0;
+	long n_scanf = 0, n_frame[2] = { 0, 0 }, n_step = 0;
+	char molname[256];
+	float x, y, z, simu_dt, mD;
+
+	if (stat(filename, &st) < 0) {
+		fprintf(stderr, "Error opening %s for reading.\n", filename);
+		exit(1);
+	}
+	double mbytes = st.st_size / 1e6;
+
+	/* Reference fscanf loop */
+	FILE *fileIn = fopen(filename, "r");
+	if (fileIn == NULL) {
+		fprintf(stderr, "Error opening %s for reading.\n", filename);
+		exit(1);
+	}
+	elapsed(&start);
+	if (fscanf(fileIn, "%f %f\n", &simu_dt, &mD) != 2) {
+		fprintf(stderr, "Invalid header in %s.\n", filename);
+		exit(1);
+	}
+	while (fscanf(fileIn, "%255s %f %f %f\n", molname, &x, &y, &z) == 4) {
+		if (x != 100) {
+			sum_step += x + y + z;
+			n_step++;
+		} else {
+			sum_scanf += sum_step;
+			n_scanf += n_step;
+			sum_step = 0;
+			n_step = 0;
+		}
+	}
+	t_scanf = elapsed(&start);
+	fclose(fileIn);
+
+	/* Buffered tokenizer */
+	struct inputOptions input[2] = { {1, 0, -1}, {nthreads, 0, -1} };
+	for (int k = 0; k < (nthreads > 1 ? 2 : 1); k++) {
+		struct frame *frame;
+		struct trajectory *traj = openTrajectory(filename, input[k]);
+		while ((frame = readFrame(traj)) != NULL) {
+			for (int m = 0; m < frame->nmols; m++) {
+				sum_frame[k] += frame->x[m] + frame->y[m] + frame->z[m];
+			}
+			n_frame[k] += frame->nmols;
+		}
+		closeTrajectory(traj);
+		t_frame[k] = elapsed(&start);
+	}
+
+	printf("Parsing %s (%.1f MB)\n", filename, mbytes);
+	printf("  fscanf loop:          %8.1f MB/s  %ld molecules  checksum %.6g\n", mbytes / t_scanf, n_scanf, sum_scanf);
+	for (int k = 0; k < (nthreads > 1 ? 2 : 1); k++) {
+		printf("  readFrame, %2d threads: %8.1f MB/s  %ld molecules  checksum %.6g\n",
+		       input[k].nthreads, mbytes / t_frame[k], n_frame[k], sum_frame[k]);
+		if (n_scanf != n_frame[k] || sum_scanf != sum_frame[k]) {
+			printf("  Warning: parsed positions differ from the fscanf loop.\n");
+		}
+	}
+	printf("  Speedup on one thread: %.1fx, target %d MB/s %s\n", t_scanf / t_frame[0], PARSE_TARGET,
+	       mbytes / t_frame[0] >= PARSE_TARGET ? "reached" : "not reached");
+}
+
+/***********************************************************************************
+ * Binary decoding: the positions of a float or quantized binary trajectory read
+ * with a cold page cache, when the file can be evicted, and with a warm one. Run it
+ * on both encodings of a trajectory to compare them.
+ ***********************************************************************************/
+
+static void benchDecode(const char *filename)
+{
+	struct timespec start;
+	struct inputOptions input = { 1, 0, -1 };
+	double t[2], sum[2] = { 0, 0 }, mbytes;
+	long n[2] = { 0, 0 };
+	int cold;
+
+	for (int k = 0; k < 2; k++) {
+		struct frame *frame;
+		struct trajectory *traj = openTrajectory(filename, input);
+		if (!traj->binary) {
+			fprintf(stderr, "%s is not a binary trajectory, see 'fernet convert --help'.\n", filename);
+			exit(1);
+		}
+		mbytes = traj->size / 1e6;
+
+		/* First pass from disk, if the kernel drops the cached pages */
+		if (k == 0) {
+			cold = posix_fadvise(traj->fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+		}
+		elapsed(&start);
+		while ((frame = readFrame(traj)) != NULL) {
+			for (int m = 0; m < frame->nmols; m++) {
+				sum[k] += frame->x[m] + frame->y[m] + frame->z[m];
+			}
+			n[k] += frame->nmols;
+		}
+		t[k] = elapsed(&start);
+		closeTrajectory(traj);
+	}
+
+	printf("Decoding %s (%.1f MB, %.2f bytes per position)\n", filename, mbytes, 1e6 * mbytes / (n[0] > 0 ? n[0] : 1));
+	for (int k = 0; k < 2; k++) {
+		printf("  %s page cache: %8.1f Mpositions/s  %8.1f MB/s of float32  %ld positions  checksum %.6g\n",
+		       k == 0 ? (cold ? "cold" : "as is") : "warm", n[k] / t[k] / 1e6, 12 * n[k] / t[k] / 1e6, n[k], sum[k]);
+	}
+}
+
+/***********************************************************************************
+ * Photon sampling: the per-event loop gaussPSF used against its binomial draw, for
+ * a molecule at the center of the PSF so that the emission probability is q. The
+ * counts of both are compared with a two sample chi-square test, which should give
+ * a statistic close to the degrees of freedom when both follow the same law, and
+ * by their means. The benchmark fails when the p-value of the test is below
+ * BINOMIAL_PVALUE or the means are more than BINOMIAL_SIGMA standard errors apart.
+ ***********************************************************************************/
+
+#define BINOMIAL_SAMPLES 200000
+#define BINOMIAL_PVALUE 1e-6
+#define BINOMIAL_SIGMA 5
+
+static int eventLoop(double g, int nevents, double q, struct rng *r)
+{
+	double prob_abs, prob_emit;
+	int phot = 0;
+
+	for (int i = 0; i < nevents; i++) {
+		prob_abs = rngUniform(r);
+		prob_emit = rngUniform(r);
+		if (g > prob_abs && prob_emit < q) {
+			phot++;
+		}
+	}
+	return phot;
+}
+
+/* Chi-square statistic per degree of freedom of two histograms of nsamples counts
+ * from 0 to maxcount, with its p-value and the difference of their means in
+ * standard errors */
+static double compareCounts(long *hist[2], int maxcount, long nsamples, double *pvalue, double *z)
+{
+	double mean[2] = { 0, 0 }, var[2] = { 0, 0 }, chi2 = 0;
+	int dof = -1;
+
+	for (int k = 0; k < 2; k++) {
+		for (int n = 0; n <= maxcount; n++) {
+			mean[k] += (double)n * hist[k][n];
+		}
+		mean[k] /= nsamples;
+		for (int n = 0; n <= maxcount; n++) {
+			var[k] += (n - mean[k]) * (n - mean[k]) * hist[k][n];
+		}
+		var[k] /= nsamples - 1;
+	}
+	for (int n = 0; n <= maxcount; n++) {
+		if (hist[0][n] + hist[1][n] > 0) {
+			chi2 += (double)(hist[0][n] - hist[1][n]) * (hist[0][n] - hist[1][n]) / (hist[0][n] + hist[1][n]);
+			dof++;
+		}
+	}
+	*pvalue = dof > 0 ? gsl_cdf_chisq_Q(chi2, dof) : 1;
+	*z = mean[0] != mean[1] ? (mean[0] - mean[1]) / sqrt((var[0] + var[1]) / nsamples) : 0;
+
+	return dof > 0 ? chi2 / dof : 0;
+}
+
+static void benchBinomial(struct rng *r)
+{
+	const int nevents[] = { 10, 100, 1000 };
+	const double q[] = { 0.001, 0.05, 0.5 };
+	struct timespec start;
+
+	printf("Photon counts of %d draws, per-event loop against binomial draw\n", BINOMIAL_SAMPLES);
+	printf("  %7s %6s %10s %10s %12s %12s %10s\n", "nevents", "q", "mean loop", "mean binom", "loop ns", "binom ns",
+	       "chi2/dof");
+	for (int i = 0; i < 3; i++) {
+		for (int j = 0; j < 3; j++) {
+			long *hist[2];
+			double t[2], mean[2] = { 0, 0 }, chi2, pvalue, z;
+
+			for (int k = 0; k < 2; k++) {
+				hist[k] = (long *)calloc(nevents[i] + 1, sizeof(long));
+				elapsed(&start);
+				for (int s = 0; s < BINOMIAL_SAMPLES; s++) {
+					int n = k == 0 ? eventLoop(1, nevents[i], q[j], r)
+					    : gaussPSF(0, 0, 0, 1, 1, 0, 0, 0, nevents[i], q[j], r);
+					hist[k][n]++;
+					mean[k] += n;
+				}
+				t[k] = elapsed(&start);
+				mean[k] /= BINOMIAL_SAMPLES;
+			}
+			chi2 = compareCounts(hist, nevents[i], BINOMIAL_SAMPLES, &pvalue, &z);
+			printf("  %7d %6g %10.4f %10.4f %12.1f %12.1f %10.2f\n", nevents[i], q[j], mean[0], mean[1],
+			       1e9 * t[0] / BINOMIAL_SAMPLES, 1e9 * t[1] / BINOMIAL_SAMPLES, chi2);
+			free(hist[0]);
+			free(hist[1]);
+			if (pvalue < BINOMIAL_PVALUE || fabs(z) > BINOMIAL_SIGMA) {
+				fprintf(stderr, "Photon counts differ between both draws: p-value %.2g, means %.1f standard errors apart.\n",
+					pvalue, fabs(z));
+				exit(1);
+			}
+		}
+	}
+}
+
+/***********************************************************************************
+ * Dual-colour emission: one gaussPSF call per channel, as the routines did, against
+ * gaussPSFChannels, which computes the PSF once for both. Molecules are spread over
+ * two waists around the center and emit in both channels. Both paths start from
+ * the same seed and draw in the same order, so their photon totals must be equal.
+ ***********************************************************************************/
+
+#define CHANNEL_SAMPLES 2000000
+
+static void benchChannels(struct rng *r)
+{
+	const double q[NCHANNELS] = { 0.05, 0.02 };
+	const int nevents = 100;
+	float *pos = (float *)malloc(3 * CHANNEL_SAMPLES * sizeof(float));
+	unsigned long seed = gsl_rng_get(r->gsl);
+	long total[2][NCHANNELS] = { { 0 } };
+	struct timespec start;
+	double t[2];
+
+	for (int s = 0; s < 3 * CHANNEL_SAMPLES; s++) {
+		pos[s] = 4 * rngUniform(r) - 2;
+	}
+
+	for (int k = 0; k < 2; k++) {
+		seedRng(r, seed);
+		elapsed(&start);
+		for (int s = 0; s < CHANNEL_SAMPLES; s++) {
+			float *p = pos + 3 * s;
+			int nphot[NCHANNELS] = { 0 };
+			if (k == 0) {
+				for (int c = 0; c < NCHANNELS; c++) {
+					nphot[c] += gaussPSF(p[0], p[1], 3 * p[2], 1, 3, 0, 0, 0, nevents, q[c], r);
+				}
+			} else {
+				gaussPSFChannels(p[0], p[1], 3 * p[2], 1, 3, 0, 0, 0, nevents, q, nphot, r);
+			}
+			for (int c = 0; c < NCHANNELS; c++) {
+				total[k][c] += nphot[c];
+			}
+		}
+		t[k] = elapsed(&start);
+	}
+
+	printf("Emission of %d molecules in %d channels\n", CHANNEL_SAMPLES, NCHANNELS);
+	for (int k = 0; k < 2; k++) {
+		printf("  %-16s %8.1f ns per molecule  photons %ld %ld\n", k == 0 ? "gaussPSF" : "gaussPSFChannels",
+		       1e9 * t[k] / CHANNEL_SAMPLES, total[k][0], total[k][1]);
+	}
+	if (total[0][0] != total[1][0] || total[0][1] != total[1][1]) {
+		fprintf(stderr, "Photon totals differ between both paths.\n");
+		exit(1);
+	}
+	free(pos);
+}
+
+/***********************************************************************************
+ * PSF kernels: every instruction set the CPU supports on the same frame, against
+ * the scalar kernel. The PSF stage alone and psfFrame, which adds the photon draws,
+ * are reported in molecules per second. Molecules fill a box of 4 waists around
+ * the center, so that about one in four emits, and all of them emit in both
+ * channels. The largest difference to the scalar PSF values is also reported.
+ ***********************************************************************************/
+
+#define KERNEL_MOLECULES (1 << 20)
+#define KERNEL_REPEATS 20
+
+static void benchKernel(struct rng *r)
+{
+	struct frame frame;
+	struct commonParms cParms = { 0 };
+	double *g[NISAS], t, err;
+	struct psfGeometry geo = { 0, 0, 0, 1, 3, INFINITY, NULL };
+	struct timespec start;
+	int nphot[NCHANNELS];
+
+	frame.nmols = KERNEL_MOLECULES;
+	frame.species = (uint16_t *)calloc(KERNEL_MOLECULES, sizeof(uint16_t));
+	frame.x = (float *)malloc(KERNEL_MOLECULES * sizeof(float));
+	frame.y = (float *)malloc(KERNEL_MOLECULES * sizeof(float));
+	frame.z = (float *)malloc(KERNEL_MOLECULES * sizeof(float));
+	for (int m = 0; m < KERNEL_MOLECULES; m++) {
+		frame.x[m] = 4 * rngUniform(r) - 2;
+		frame.y[m] = 4 * rngUniform(r) - 2;
+		frame.z[m] = 12 * rngUniform(r) - 6;
+	}
+	cParms.w_xy = geo.w_xy;
+	cParms.w_z = geo.w_z;
+	cParms.cutoff2 = geo.cutoff2;
+	cParms.nevents = 100;
+	cParms.qchannels = calloc(1, sizeof(*cParms.qchannels));
+	cParms.qchannels[0][0] = 0.05;
+	cParms.qchannels[0][1] = 0.02;
+
+	printf("PSF of %d molecules, %d repeats\n", KERNEL_MOLECULES, KERNEL_REPEATS);
+	printf("  %-8s %16s %16s %14s\n", "kernel", "PSF Mmol/s", "frame Mmol/s", "max error");
+	for (int isa = 0; isa < NISAS; isa++) {
+		g[isa] = (double *)malloc(KERNEL_MOLECULES * sizeof(double));
+		if (!kernelSupported(isa)) {
+			printf("  %-8s %16s\n", kernelName(isa), "not supported");
+			continue;
+		}
+		selectKernel(kernelName(isa));
+
+		elapsed(&start);
+		for (int k = 0; k < KERNEL_REPEATS; k++) {
+			for (int i = 0; i < KERNEL_MOLECULES; i += PSF_BLOCK) {
+				psfValues(frame.x + i, frame.y + i, frame.z + i, PSF_BLOCK, &geo, g[isa] + i);
+			}
+		}
+		t = elapsed(&start);
+
+		err = 0;
+		for (int m = 0; m < KERNEL_MOLECULES; m++) {
+			double d = fabs(g[isa][m] - g[ISA_SCALAR][m]);
+			err = d > err ? d : err;
+		}
+
+		printf("  %-8s %16.1f", kernelName(isa), KERNEL_REPEATS * (KERNEL_MOLECULES / t) / 1e6);
+		elapsed(&start);
+		for (int k = 0; k < KERNEL_REPEATS; k++) {
+			nphot[0] = nphot[1] = 0;
+			psfFrame(&frame, geo.sx, geo.sy, geo.sz, &cParms, nphot, r);
+		}
+		t = elapsed(&start);
+		printf(" %16.1f %14.3g\n", KERNEL_REPEATS * (KERNEL_MOLECULES / t) / 1e6, err);
+	}
+	selectKernel("auto");
+
+	for (int isa = 0; isa < NISAS; isa++) {
+		free(g[isa]);
+	}
+	free(cParms.qchannels);
+	free(frame.species);
+	free(frame.x);
+	free(frame.y);
+	free(frame.z);
+}
+
+/***********************************************************************************
+ * Multi point grid: a 32 x 32 grid of PSFs 0.1 um apart in a box of molecules ten
+ * times wider, as in a large MCell volume. psfFrame on every center, which tests
+ * every molecule against every PSF, is compared with psfGridFrame, which sorts
+ * molecules into cells and only evaluates the PSFs within the cutoff. Both must
+ * find the same number of evaluations out of the cutoff.
+ ***********************************************************************************/
+
+#define GRID_MOLECULES 50000
+#define GRID_SIDE 32
+
+static void benchGrid(struct rng *r)
+{
+	const double cutoffs[] = { 3, 2, 1 };
+	struct frame frame;
+	struct commonParms cParms = { 0 };
+	double centerx[GRID_SIDE], centery[GRID_SIDE], t[2];
+	int (*nphot)[NCHANNELS] = calloc(GRID_SIDE * GRID_SIDE, sizeof(*nphot));
+	struct timespec start;
+	long skipped[2];
+	struct psfGrid *grid;
+
+	selectKernel("auto");
+	for (int i = 0; i < GRID_SIDE; i++) {
+		centerx[i] = centery[i] = 0.1 * (i - (GRID_SIDE - 1) / 2.0);
+	}
+	grid = newPSFGrid(GRID_SIDE, centerx, GRID_SIDE, centery, 0);
+
+	frame.nmols = GRID_MOLECULES;
+	frame.species = (uint16_t *)calloc(GRID_MOLECULES, sizeof(uint16_t));
+	frame.x = (float *)malloc(GRID_MOLECULES * sizeof(float));
+	frame.y = (float *)malloc(GRID_MOLECULES * sizeof(float));
+	frame.z = (float *)malloc(GRID_MOLECULES * sizeof(float));
+	for (int m = 0; m < GRID_MOLECULES; m++) {
+		frame.x[m] = 32 * rngUniform(r) - 16;
+		frame.y[m] = 32 * rngUniform(r) - 16;
+		frame.z[m] = 8 * rngUniform(r) - 4;
+	}
+	cParms.w_xy = 0.2;
+	cParms.w_z = 0.8;
+	cParms.nevents = 1;
+	cParms.qchannels = calloc(1, sizeof(*cParms.qchannels));
+	cParms.qchannels[0][0] = 0.05;
+
+	printf("%d molecules against a %d x %d grid of PSFs, %s kernel\n", GRID_MOLECULES, GRID_SIDE, GRID_SIDE,
+	       kernelName(selectedKernel()));
+	printf("  %8s %18s %18s %14s\n", "cutoff", "all PSFs Mevals/s", "cells Mevals/s", "out of cutoff");
+	for (int k = 0; k < 3; k++) {
+		cParms.cutoff2 = cutoffs[k] * cutoffs[k];
+		elapsed(&start);
+		skipped[0] = 0;
+		for (int p = 0; p < GRID_SIDE * GRID_SIDE; p++) {
+			skipped[0] += psfFrame(&frame, centerx[p / GRID_SIDE], centery[p % GRID_SIDE], 0, &cParms, nphot[p], r);
+		}
+		t[0] = elapsed(&start);
+		skipped[1] = psfGridFrame(grid, &frame, &cParms, nphot, r);
+		t[1] = elapsed(&start);
+		printf("  %8g %18.1f %18.1f %13.2f%%\n", cutoffs[k], GRID_MOLECULES * GRID_SIDE * GRID_SIDE / t[0] / 1e6,
+		       GRID_MOLECULES * GRID_SIDE * GRID_SIDE / t[1] / 1e6,
+		       100.0 * skipped[1] / ((double)GRID_MOLECULES * GRID_SIDE * GRID_SIDE));
+		if (skipped[0] != skipped[1]) {
+			fprintf(stderr, "Evaluations out of the cutoff differ: %ld against %ld.\n", skipped[0], skipped[1]);
+			exit(1);
+		}
+	}
+
+	freePSFGrid(grid);
+	free(nphot);
+	free(cParms.qchannels);
+	free(frame.species);
+	free(frame.x);
+	free(frame.y);
+	free(frame.z);
+}
+
+/***********************************************************************************
+ * Aggregate sampling: photon counts of a point detector over many time steps of the
+ * same molecule positions, drawn per molecule and as one Poisson draw per time
+ * step. Both counts are compared with a two sample chi-square test, next to the
+ * Le Cam bound on their total variation distance. The exact variance is below the
+ * mean by the sum of nevents (g q)^2, which aggregate sampling leaves out.
+ ***********************************************************************************/
+
+#define AGGREGATE_MOLECULES 200
+#define AGGREGATE_FRAMES 20000
+
+static void benchAggregate(struct rng *r)
+{
+	const double q[] = { 0.001, 0.01, 0.1, 0.5 };
+	const int nevents = 100, maxcount = 4096;
+	struct frame frame;
+	struct commonParms cParms = { 0 };
+	struct timespec start;
+
+	frame.nmols = AGGREGATE_MOLECULES;
+	frame.species = (uint16_t *)calloc(AGGREGATE_MOLECULES, sizeof(uint16_t));
+	frame.x = (float *)malloc(AGGREGATE_MOLECULES * sizeof(float));
+	frame.y = (float *)malloc(AGGREGATE_MOLECULES * sizeof(float));
+	frame.z = (float *)malloc(AGGREGATE_MOLECULES * sizeof(float));
+	cParms.w_xy = 1;
+	cParms.w_z = 3;
+	cParms.cutoff2 = INFINITY;
+	cParms.nevents = nevents;
+	cParms.qchannels = calloc(1, sizeof(*cParms.qchannels));
+	selectKernel("auto");
+
+	printf("Photon counts of %d molecules around a point PSF over %d time steps\n", AGGREGATE_MOLECULES,
+	       AGGREGATE_FRAMES);
+	printf("  %6s %10s %10s %10s %10s %10s %10s %10s %10s\n", "q", "mean exact", "mean aggr", "var exact",
+	       "var aggr", "exact us", "aggr us", "chi2/dof", "TV bound");
+	for (int k = 0; k < 4; k++) {
+		long *hist[2];
+		double t[2] = { 0, 0 }, sum[2] = { 0, 0 }, sum2[2] = { 0, 0 }, mean = 0, sq = 0, bound, chi2 = 0;
+		int dof = -1;
+
+		cParms.qchannels[0][0] = q[k];
+		hist[0] = (long *)calloc(maxcount + 1, sizeof(long));
+		hist[1] = (long *)calloc(maxcount + 1, sizeof(long));
+		for (int m = 0; m < AGGREGATE_MOLECULES; m++) {
+			frame.x[m] = 4 * rngUniform(r) - 2;
+			frame.y[m] = 4 * rngUniform(r) - 2;
+			frame.z[m] = 12 * rngUniform(r) - 6;
+			double p = q[k] * exp(-2 * (frame.x[m] * frame.x[m] + frame.y[m] * frame.y[m])
+					      - 2 * frame.z[m] * frame.z[m] / 9);
+			mean += nevents * p;
+			sq += nevents * p * p;
+		}
+		bound = mean > 1 ? sq / mean : sq;
+
+		for (int f = 0; f < AGGREGATE_FRAMES; f++) {
+			for (int s = 0; s < 2; s++) {
+				int nphot[NCHANNELS] = { 0 };
+				cParms.sampling = s == 0 ? SAMPLING_EXACT : SAMPLING_AGGREGATE;
+				elapsed(&start);
+				psfFrame(&frame, 0, 0, 0, &cParms, nphot, r);
+				t[s] += elapsed(&start);
+				hist[s][nphot[0] < maxcount ? nphot[0] : maxcount]++;
+				sum[s] += nphot[0];
+				sum2[s] += (double)nphot[0] * nphot[0];
+			}
+		}
+		for (int n = 0; n <= maxcount; n++) {
+			if (hist[0][n] + hist[1][n] > 0) {
+				chi2 += (double)(hist[0][n] - hist[1][n]) * (hist[0][n] - hist[1][n]) / (hist[0][n] + hist[1][n]);
+				dof++;
+			}
+		}
+		for (int s = 0; s < 2; s++) {
+			sum[s] /= AGGREGATE_FRAMES;
+			sum2[s] = sum2[s] / AGGREGATE_FRAMES - sum[s] * sum[s];
+		}
+		printf("  %6g %10.3f %10.3f %10.3f %10.3f %10.2f %10.2f %10.2f %10.2g\n", q[k], sum[0], sum[1], sum2[0],
+		       sum2[1], 1e6 * t[0] / AGGREGATE_FRAMES, 1e6 * t[1] / AGGREGATE_FRAMES, dof > 0 ? chi2 / dof : 0,
+		       bound);
+		free(hist[0]);
+		free(hist[1]);
+	}
+
+	free(cParms.qchannels);
+	free(frame.species);
+	free(frame.x);
+	free(frame.y);
+	free(frame.z);
+}
+
+/***********************************************************************************
+ * Seconds since *start, which is then reset to now
+ ***********************************************************************************/
+
+/***********************************************************************************
+ * Tabulated PSFs: interpolation error against the analytic Gaussian and lookups
+ * per second against the exp() kernels
+ ***********************************************************************************/
+
+static void benchPSF(struct rng *r)
+{
+	const char *types[] = { "gauss_table", "airy", "twophoton" };
+	float *x, *y, *z;
+	double *gauss, *g, t, err;
+	struct psfTable *table;
+	struct psfGeometry geo = { 0, 0, 0, 1, 3, INFINITY, NULL };
+	struct timespec start;
+
+	x = (float *)malloc(KERNEL_MOLECULES * sizeof(float));
+	y = (float *)malloc(KERNEL_MOLECULES * sizeof(float));
+	z = (float *)malloc(KERNEL_MOLECULES * sizeof(float));
+	gauss = (double *)malloc(KERNEL_MOLECULES * sizeof(double));
+	g = (double *)malloc(KERNEL_MOLECULES * sizeof(double));
+	for (int m = 0; m < KERNEL_MOLECULES; m++) {
+		x[m] = 4 * rngUniform(r) - 2;
+		y[m] = 4 * rngUniform(r) - 2;
+		z[m] = 12 * rngUniform(r) - 6;
+	}
+
+	printf("PSF of %d molecules, %d repeats\n", KERNEL_MOLECULES, KERNEL_REPEATS);
+	printf("  %-12s %16s %18s\n", "PSF", "Mmol/s", "max diff to gauss");
+	for (int isa = 0; isa < NISAS; isa++) {
+		if (!kernelSupported(isa)) {
+			continue;
+		}
+		selectKernel(kernelName(isa));
+		elapsed(&start);
+		for (int k = 0; k < KERNEL_REPEATS; k++) {
+			for (int i = 0; i < KERNEL_MOLECULES; i += PSF_BLOCK) {
+				psfValues(x + i, y + i, z + i, PSF_BLOCK, &geo, g + i);
+			}
+		}
+		t = elapsed(&start);
+		if (isa == ISA_SCALAR) {
+			memcpy(gauss, g, KERNEL_MOLECULES * sizeof(double));
+		}
+		printf("  gauss %-6s %16.1f\n", kernelName(isa), KERNEL_REPEATS * (KERNEL_MOLECULES / t) / 1e6);
+	}
+	selectKernel("auto");
+
+	for (int i = 0; i < (int)(sizeof(types) / sizeof(types[0])); i++) {
+		table = newPSFTable(types[i], NULL, geo.w_xy, geo.w_z, PSF_TABLE_RANGE);
+		geo.table = table;
+		elapsed(&start);
+		for (int k = 0; k < KERNEL_REPEATS; k++) {
+			for (int m = 0; m < KERNEL_MOLECULES; m += PSF_BLOCK) {
+				psfValues(x + m, y + m, z + m, PSF_BLOCK, &geo, g + m);
+			}
+		}
+		t = elapsed(&start);
+
+		err = 0;
+		for (int m = 0; m < KERNEL_MOLECULES; m++) {
+			double d = fabs(g[m] - gauss[m]);
+			err = d > err ? d : err;
+		}
+		printf("  %-12s %16.1f %18.3g\n", types[i], KERNEL_REPEATS * (KERNEL_MOLECULES / t) / 1e6, err);
+		freePSFTable(table);
+	}
+	printf("The difference of gauss_table is its interpolation error, those of the models are how far they are from the Gaussian of the same waists.\n");
+
+	free(x);
+	free(y);
+	free(z);
+	free(gauss);
+	free(g);
+}
+
+/***********************************************************************************
+ * Random numbers: the GSL taus generator against the buffered Philox streams of
+ * rng.c, for uniforms and for the binomial photon counts. The binomial counts of
+ * both are compared as in the binomial benchmark, and must pass the same checks.
+ ***********************************************************************************/
+
+#define RNG_UNIFORMS 50000000
+#define RNG_SAMPLES 2000000
+
+static void benchRng(struct rng *r)
+{
+	const int n[] = { 100, 100, 100, 100, 1000 };
+	const double p[] = { 1e-4, 0.01, 0.1, 0.3, 0.001 };
+	gsl_rng *taus = gsl_rng_alloc(gsl_rng_taus);
+	struct timespec start;
+	double t[2], sum[2] = { 0, 0 };
+
+	gsl_rng_set(taus, gsl_rng_get(r->gsl));
+
+	printf("Uniform numbers, %d draws\n", RNG_UNIFORMS);
+	elapsed(&start);
+	for (int i = 0; i < RNG_UNIFORMS; i++) {
+		sum[0] += gsl_rng_uniform(taus);
+	}
+	t[0] = elapsed(&start);
+	for (int i = 0; i < RNG_UNIFORMS; i++) {
+		sum[1] += rngUniform(r);
+	}
+	t[1] = elapsed(&start);
+	printf("  %-14s %10s %10s\n", "generator", "M/s", "mean");
+	printf("  %-14s %10.1f %10.5f\n", "gsl taus", RNG_UNIFORMS / t[0] / 1e6, sum[0] / RNG_UNIFORMS);
+	printf("  %-14s %10.1f %10.5f\n", "philox", RNG_UNIFORMS / t[1] / 1e6, sum[1] / RNG_UNIFORMS);
+	sum[1] = 0;
+	elapsed(&start);
+	for (int i = 0; i < RNG_UNIFORMS; i += RNG_BUFFER) {
+		fillUniforms(r);
+		sum[1] += r->u[0];
+	}
+	t[1] = elapsed(&start);
+	printf("  %-14s %10.1f %10.5f\n", "philox refill", RNG_UNIFORMS / t[1] / 1e6, sum[1] * RNG_BUFFER / RNG_UNIFORMS);
+
+	printf("Binomial counts, %d draws, GSL against rngBinomial\n", RNG_SAMPLES);
+	printf("  %6s %8s %10s %10s %10s %10s %10s\n", "n", "p", "mean gsl", "mean rng", "gsl ns", "rng ns", "chi2/dof");
+	for (int i = 0; i < (int)(sizeof(n) / sizeof(n[0])); i++) {
+		long *hist[2];
+		double mean[2] = { 0, 0 }, chi2, pvalue, z;
+
+		for (int k = 0; k < 2; k++) {
+			hist[k] = (long *)calloc(n[i] + 1, sizeof(long));
+			elapsed(&start);
+			for (int s = 0; s < RNG_SAMPLES; s++) {
+				int c = k == 0 ? (int)gsl_ran_binomial(taus, p[i], n[i]) : rngBinomial(r, p[i], n[i]);
+				hist[k][c]++;
+				mean[k] += c;
+			}
+			t[k] = elapsed(&start);
+			mean[k] /= RNG_SAMPLES;
+		}
+		chi2 = compareCounts(hist, n[i], RNG_SAMPLES, &pvalue, &z);
+		printf("  %6d %8g %10.4f %10.4f %10.1f %10.1f %10.2f\n", n[i], p[i], mean[0], mean[1],
+		       1e9 * t[0] / RNG_SAMPLES, 1e9 * t[1] / RNG_SAMPLES, chi2);
+		free(hist[0]);
+		free(hist[1]);
+		if (pvalue < BINOMIAL_PVALUE || fabs(z) > BINOMIAL_SIGMA) {
+			fprintf(stderr, "Binomial counts differ between GSL and rngBinomial: p-value %.2g, means %.1f standard errors apart.\n",
+				pvalue, fabs(z));
+			exit(1);
+		}
+	}
+	gsl_rng_free(taus);
+}
+
+static double elapsed(struct timespec *start)
+{
+	struct timespec now;
+	double dt;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	dt = (now.tv_sec - start->tv_sec) + 1e-9 * (now.tv_nsec - start->tv_nsec);
+	*start = now;
+
+	return dt;
+}
@@ -0,0 +1,466 @@
+/***********************************************************************************
+ *                                                                                 *
+ * FERNET: Fluorescence Emission Recipes and NumErical routines Toolkit            *
+ * Developed by Juan F. Angiolini and Esteban Mocskos                              *
+ * Facultad de Ciencias Exactas y Naturales, UBA                                   *
+ *                                                                                 *
+ * This program is free software; you can redistribute it and/or                   *
+ * modify it under the terms of the GNU General Public License                     *
+ * as published by the Free Software Foundation; either version 2                  *
+ * of the License, or (at your option) any later version.                          *
+ *                                                                                 *
+ * This program is distributed in the hope that it will be useful,                 *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of                  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                   *
+ * GNU General Public License for more details.                                    *
+ *                                                                                 *
+ * You should have received a copy of the GNU General Public License               *
+ * along with this program; if not, write to the Free Software                     *
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. *
+ *                                                                                 *
+ ***********************************************************************************/
+
+#include "fernet.h"
+
+/***********************************************************************************
+ * Multithreaded parsing of text trajectories. The file is read in windows of
+ * nthreads * CHUNK_BYTES. Each window is cut after its last separator line and
+ * split into byte ranges that start right after a separator line, so every range
+ * holds whole time steps. Ranges are parsed on their own threads into per-frame
+ * molecule batches, which readChunkedFrame hands out in file order. The next
+ * window is parsed in the background while the current one is being emitted.
+ ***********************************************************************************/
+
+struct textChunk {		// Time steps parsed from one byte range
+	const char *start, *stop;
+	int nframes, maxframes;
+	int *first;		// index of the first molecule of each frame
+	float *iter, *total;
+	const char **begin, **sep;	// first line and separator line of each frame
+	int nmols, capacity;
+	uint16_t *species;	// local species IDs until the window is merged
+	float *x, *y, *z;
+	int nspecies, maxspecies;
+	const char **names;	// local species table, pointing into the window
+	size_t *lens;
+	int *slots, nslots;	// hash table of the local names, as in findSpecies
+	const struct trajectory *filter;	// species to keep, NULL for all
+};
+
+struct textRound {		// Window of the file parsed in one round
+	struct textParser *parser;
+	char *buf;
+	size_t bufsize, len;
+	off_t pos;		// file offset of buf
+	size_t consumed;	// bytes up to the end of the last separator line
+	int eof;
+	int nchunks;
+	struct textChunk *chunks;
+	pthread_t thread;
+};
+
+struct textParser {
+	int fd;
+	int nthreads;
+	size_t window;
+	struct textRound round[2];
+	int cur, chunk, frame;	// frame to hand out next
+};
+
+static void launchRound(struct textParser *, struct textRound *, off_t);
+static void *parseRound(void *);
+static void *parseChunk(void *);
+static int chunkSpecies(struct textChunk *, const char *, size_t);
+static size_t separatorAfter(const char *, size_t, size_t);
+static size_t lastSeparator(const char *, size_t);
+
+/***********************************************************************************
+ * Start parsing fd from byte pos on nthreads threads
+ ***********************************************************************************/
+
+struct textParser *startTextParser(int fd, off_t pos, int nthreads, const struct trajectory *filter)
+{
+	struct textParser *parser = (struct textParser *)calloc(1, sizeof(struct textParser));
+
+	parser->fd = fd;
+	parser->nthreads = nthreads;
+	parser->window = nthreads * CHUNK_BYTES;
+	for (int i = 0; i < 2; i++) {
+		parser->round[i].parser = parser;
+		parser->round[i].chunks = (struct textChunk *)calloc(nthreads, sizeof(struct textChunk));
+		for (int j = 0; j < nthreads; j++) {
+			parser->round[i].chunks[j].filter = filter;
+		}
+	}
+
+	/* Round 1 starts empty, so the first read switches to round 0 */
+	launchRound(parser, &parser->round[0], pos);
+	parser->cur = 1;
+
+	return parser;
+}
+
+/***********************************************************************************
+ * Hand out the next parsed time step, switching windows when one is exhausted
+ ***********************************************************************************/
+
+struct frame *readChunkedFrame(struct trajectory *traj)
+{
+	struct textParser *parser = traj->parser;
+	struct frame *frame = &traj->frame;
+
+	for (;;) {
+		struct textRound *round = &parser->round[parser->cur];
+
+		while (parser->chunk < round->nchunks) {
+			struct textChunk *chunk = &round->chunks[parser->chunk];
+			if (parser->frame < chunk->nframes) {
+				int first = chunk->first[parser->frame];
+				frame->nmols = chunk->first[parser->frame + 1] - first;
+				frame->species = chunk->species + first;
+				frame->x = chunk->x + first;
+				frame->y = chunk->y + first;
+				frame->z = chunk->z + first;
+				frame->iter = chunk->iter[parser->frame];
+				frame->total = chunk->total[parser->frame];
+				frame->start = round->pos + (chunk->begin[parser->frame] - round->buf);
+				frame->separator = round->pos + (chunk->sep[parser->frame] - round->buf);
+				parser->frame++;
+				return frame;
+			}
+			parser->chunk++;
+			parser->frame = 0;
+		}
+		if (round->eof) {
+			return NULL;
+		}
+
+		/* Wait for the next window and start parsing the one after it */
+		struct textRound *next = &parser->round[1 - parser->cur];
+		pthread_join(next->thread, NULL);
+		if (!next->eof) {
+			launchRound(parser, round, next->pos + next->consumed);
+		}
+		parser->cur = 1 - parser->cur;
+		parser->chunk = 0;
+		parser->frame = 0;
+
+		/* Translate local species IDs into trajectory species IDs */
+		for (int c = 0; c < next->nchunks; c++) {
+			struct textChunk *chunk = &next->chunks[c];
+			uint16_t ids[chunk->nspecies > 0 ? chunk->nspecies : 1];
+			for (int i = 0; i < chunk->nspecies; i++) {
+				ids[i] = internSpecies(traj, chunk->names[i], chunk->lens[i]);
+			}
+			for (int m = 0; m < chunk->nmols; m++) {
+				chunk->species[m] = ids[chunk->species[m]];
+			}
+		}
+	}
+}
+
+static void launchRound(struct textParser *parser, struct textRound *round, off_t pos)
+{
+	round->pos = pos;
+	if (pthread_create(&round->thread, NULL, parseRound, round) != 0) {
+		fprintf(stderr, "Error starting parser thread.\n");
+		exit(1);
+	}
+}
+
+/***********************************************************************************
+ * Read one window, split it at separator lines and parse the ranges in parallel
+ ***********************************************************************************/
+
+static void *parseRound(void *arg)
+{
+	struct textRound *round = (struct textRound *)arg;
+	struct textParser *parser = round->parser;
+	size_t limit;
+	ssize_t nread;
+
+	for (;;) {
+		/* Read window, keeping a spare byte for the last line terminator */
+		if (round->bufsize < parser->window + 1) {
+			round->bufsize = parser->window + 1;
+			round->buf = (char *)realloc(round->buf, round->bufsize);
+		}
+		round->len = 0;
+		round->eof = 0;
+		while (round->len < parser->window) {
+			nread = pread(parser->fd, round->buf + round->len, parser->window - round->len,
+				      round->pos + round->len);
+			if (nread < 0) {
+				fprintf(stderr, "Error reading trajectory.\n");
+				exit(1);
+			}
+			if (nread == 0) {
+				round->eof = 1;
+				break;
+			}
+			round->len += nread;
+		}
+		if (round->eof && round->len > 0 && round->buf[round->len - 1] != '\n') {
+			round->buf[round->len++] = '\n';
+		}
+
+		/* Whole time steps only; a window holding less than one is enlarged */
+		limit = lastSeparator(round->buf, round->len);
+		if (limit > 0 || round->eof) {
+			break;
+		}
+		parser->window *= 2;
+	}
+	round->consumed = round->eof ? round->len : limit;
+
+	/* Split at the first separator after each nominal boundary */
+	size_t bounds[parser->nthreads + 1];
+	bounds[0] = 0;
+	for (int i = 1; i < parser->nthreads; i++) {
+		bounds[i] = separatorAfter(round->buf, limit, (limit / parser->nthreads) * i);
+		if (bounds[i] < bounds[i - 1]) {
+			bounds[i] = bounds[i - 1];
+		}
+	}
+	bounds[parser->nthreads] = limit;
+
+	round->nchunks = parser->nthreads;
+	for (int i = 0; i < round->nchunks; i++) {
+		round->chunks[i].start = round->buf + bounds[i];
+		round->chunks[i].stop = round->buf + bounds[i + 1];
+	}
+
+	/* This thread parses the first range */
+	pthread_t threads[round->nchunks];
+	for (int i = 1; i < round->nchunks; i++) {
+		if (pthread_create(&threads[i], NULL, parseChunk, &round->chunks[i]) != 0) {
+			fprintf(stderr, "Error starting parser thread.\n");
+			exit(1);
+		}
+	}
+	parseChunk(&round->chunks[0]);
+	for (int i = 1; i < round->nchunks; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	return NULL;
+}
+
+/***********************************************************************************
+ * Parse one byte range into frames
+ ***********************************************************************************/
+
+static void *parseChunk(void *arg)
+{
+	struct textChunk *chunk = (struct textChunk *)arg;
+	const char *line, *eol, *name, *begin;
+	size_t len;
+	float x, y, z;
+	int id;
+
+	chunk->nframes = 0;
+	chunk->nmols = 0;
+	chunk->nspecies = 0;
+	if (chunk->nslots > 0) {
+		memset(chunk->slots, 0, chunk->nslots * sizeof(int));
+	}
+	if (chunk->maxframes == 0) {
+		chunk->maxframes = 1024;
+		chunk->first = (int *)malloc((chunk->maxframes + 1) * sizeof(int));
+		chunk->iter = (float *)malloc(chunk->maxframes * sizeof(float));
+		chunk->total = (float *)malloc(chunk->maxframes * sizeof(float));
+		chunk->begin = (const char **)malloc(chunk->maxframes * sizeof(char *));
+		chunk->sep = (const char **)malloc(chunk->maxframes * sizeof(char *));
+	}
+	chunk->first[0] = 0;
+
+	begin = chunk->start;
+	for (line = chunk->start; line < chunk->stop; line = eol + 1) {
+		eol = (const char *)memchr(line, '\n', chunk->stop - line);
+		switch (parseTextLine(chunk->filter, line, &name, &len, &x, &y, &z)) {
+		case TEXT_SEPARATOR:
+			if (chunk->nframes == chunk->maxframes) {
+				chunk->maxframes *= 2;
+				chunk->first = (int *)realloc(chunk->first, (chunk->maxframes + 1) * sizeof(int));
+				chunk->iter = (float *)realloc(chunk->iter, chunk->maxframes * sizeof(float));
+				chunk->total = (float *)realloc(chunk->total, chunk->maxframes * sizeof(float));
+				chunk->begin = (const char **)realloc(chunk->begin, chunk->maxframes * sizeof(char *));
+				chunk->sep = (const char **)realloc(chunk->sep, chunk->maxframes * sizeof(char *));
+			}
+			chunk->iter[chunk->nframes] = y;
+			chunk->total[chunk->nframes] = z;
+			chunk->begin[chunk->nframes] = begin;
+			chunk->sep[chunk->nframes] = line;
+			begin = eol + 1;
+			chunk->nframes++;
+			chunk->first[chunk->nframes] = chunk->nmols;
+			break;
+
+		case TEXT_MOLECULE:
+			id = chunkSpecies(chunk, name, len);
+
+			if (chunk->nmols == chunk->capacity) {
+				chunk->capacity = chunk->capacity ? 2 * chunk->capacity : 65536;
+				chunk->species = (uint16_t *)realloc(chunk->species, chunk->capacity * sizeof(uint16_t));
+				chunk->x = (float *)realloc(chunk->x, chunk->capacity * sizeof(float));
+				chunk->y = (float *)realloc(chunk->y, chunk->capacity * sizeof(float));
+				chunk->z = (float *)realloc(chunk->z, chunk->capacity * sizeof(float));
+			}
+			chunk->species[chunk->nmols] = id;
+			chunk->x[chunk->nmols] = x;
+			chunk->y[chunk->nmols] = y;
+			chunk->z[chunk->nmols] = z;
+			chunk->nmols++;
+			break;
+
+		case TEXT_INVALID:
+			fprintf(stderr, "Malformed line in trajectory: %.*s\n", (int)(eol - line), line);
+			exit(1);
+		}
+	}
+
+	/* Molecules after the last separator of the file are discarded */
+	chunk->nmols = chunk->first[chunk->nframes];
+
+	return NULL;
+}
+
+/***********************************************************************************
+ * Local species ID of a molecule name, adding it to the chunk table if needed.
+ * Parser threads can not intern into the trajectory while its table is in use,
+ * so each chunk keeps its own, hashed like the trajectory table.
+ ***********************************************************************************/
+
+static int chunkSpecies(struct textChunk *chunk, const char *name, size_t len)
+{
+	unsigned int h;
+	int id;
+
+	if (chunk->nslots > 0) {
+		for (h = hashName(name, len) & (chunk->nslots - 1); chunk->slots[h] != 0;
+		     h = (h + 1) & (chunk->nslots - 1)) {
+			id = chunk->slots[h] - 1;
+			if (chunk->lens[id] == len && !memcmp(chunk->names[id], name, len)) {
+				return id;
+			}
+		}
+	}
+
+	if (chunk->nspecies > UINT16_MAX) {
+		fprintf(stderr, "Too many molecule species in trajectory.\n");
+		exit(1);
+	}
+	if (chunk->nspecies == chunk->maxspecies) {
+		chunk->maxspecies = chunk->maxspecies ? 2 * chunk->maxspecies : 16;
+		chunk->names = (const char **)realloc(chunk->names, chunk->maxspecies * sizeof(char *));
+		chunk->lens = (size_t *)realloc(chunk->lens, chunk->maxspecies * sizeof(size_t));
+	}
+	id = chunk->nspecies++;
+	chunk->names[id] = name;
+	chunk->lens[id] = len;
+
+	/* Keep the table at most half full */
+	if (2 * chunk->nspecies > chunk->nslots) {
+		chunk->nslots = chunk->nslots ? 2 * chunk->nslots : 64;
+		free(chunk->slots);
+		chunk->slots = (int *)calloc(chunk->nslots, sizeof(int));
+		for (int i = 0; i < chunk->nspecies; i++) {
+			for (h = hashName(chunk->names[i], chunk->lens[i]) & (chunk->nslots - 1); chunk->slots[h] != 0;
+			     h = (h + 1) & (chunk->nslots - 1)) ;
+			chunk->slots[h] = i + 1;
+		}
+	} else {
+		for (h = hashName(name, len) & (chunk->nslots - 1); chunk->slots[h] != 0; h = (h + 1) & (chunk->nslots - 1)) ;
+		chunk->slots[h] = id + 1;
+	}
+
+	return id;
+}
+
+/***********************************************************************************
+ * Offset just past the first separator line starting at or after pos, or limit
+ ***********************************************************************************/
+
+static size_t separatorAfter(const char *buf, size_t limit, size_t pos)
+{
+	const char *line, *eol, *name;
+	size_t len;
+	float x, y, z;
+
+	/* Move to the start of a line */
+	if (pos > 0 && buf[pos - 1] != '\n') {
+		eol = (const char *)memchr(buf + pos, '\n', limit - pos);
+		if (eol == NULL) {
+			return limit;
+		}
+		pos = eol + 1 - buf;
+	}
+
+	for (line = buf + pos; line < buf + limit; line = eol + 1) {
+		eol = (const char *)memchr(line, '\n', buf + limit - line);
+		if (parseTextLine(NULL, line, &name, &len, &x, &y, &z) == TEXT_SEPARATOR) {
+			return eol + 1 - buf;
+		}
+	}
+
+	return limit;
+}
+
+/***********************************************************************************
+ * Offset just past the last separator line in buf, or 0 if there is none
+ ***********************************************************************************/
+
+static size_t lastSeparator(const char *buf, size_t len)
+{
+	const char *name;
+	size_t namelen, eol, line;
+	float x, y, z;
+
+	/* Drop the trailing partial line */
+	for (eol = len; eol > 0 && buf[eol - 1] != '\n'; eol--) ;
+
+	/* Walk back one line at a time, eol is one past the line terminator */
+	while (eol > 0) {
+		for (line = eol - 1; line > 0 && buf[line - 1] != '\n'; line--) ;
+		if (parseTextLine(NULL, buf + line, &name, &namelen, &x, &y, &z) == TEXT_SEPARATOR) {
+			return eol;
+		}
+		eol = line;
+	}
+
+	return 0;
+}
+
+/***********************************************************************************
+ * Wait for the background round and release buffers
+ ***********************************************************************************/
+
+void stopTextParser(struct textParser *parser)
+{
+	struct textRound *next = &parser->round[1 - parser->cur];
+
+	if (!parser->round[parser->cur].eof) {
+		pthread_join(next->thread, NULL);
+	}
+
+	for (int i = 0; i < 2; i++) {
+		for (int c = 0; c < parser->nthreads; c++) {
+			struct textChunk *chunk = &parser->round[i].chunks[c];
+			free(chunk->first);
+			free(chunk->iter);
+			free(chunk->total);
+			free(chunk->begin);
+			free(chunk->sep);
+			free(chunk->species);
+			free(chunk->x);
+			free(chunk->y);
+			free(chunk->z);
+			free(chunk->names);
+			free(chunk->lens);
+			free(chunk->slots);
+		}
+		free(parser->round[i].chunks);
+		free(parser->round[i].buf);
+	}
+	free(parser);
+}
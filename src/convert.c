@@ -0,0 +1,187 @@
+/***********************************************************************************
+ *                                                                                 *
+ * FERNET: Fluorescence Emission Recipes and NumErical routines Toolkit            *
+ * Developed by Juan F. Angiolini and Esteban Mocskos                              *
+ * Facultad de Ciencias Exactas y Naturales, UBA                                   *
+ *                                                                                 *
+ * This program is free software; you can redistribute it and/or                   *
+ * modify it under the terms of the GNU General Public License                     *
+ * as published by the Free Software Foundation; either version 2                  *
+ * of the License, or (at your option) any later version.                          *
+ *                                                                                 *
+ * This program is distributed in the hope that it will be useful,                 *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of                  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                   *
+ * GNU General Public License for more details.                                    *
+ *                                                                                 *
+ * You should have received a copy of the GNU General Public License               *
+ * along with this program; if not, write to the Free Software                     *
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. *
+ *                                                                                 *
+ ***********************************************************************************/
+
+#include "fernet.h"
+
+/***********************************************************************************
+ * Convert a text trajectory into the binary format. The file starts with a
+ * trajHeader, followed by one block per time step: a frameHeader, the species ID
+ * of every molecule (padded to 4 bytes) and the x, y and z columns as float32.
+ * The species table is written after the last frame, as names are only known
+ * once the whole text file has been read. With --quantize, frames hold quantized
+ * position deltas instead (see quantize.c).
+ ***********************************************************************************/
+int convertRoutine(int argc, char **argv)
+{
+	struct arg_file *infile = arg_file1(NULL, NULL, "<input>", "input text position file");
+	struct arg_file *outfile = arg_file1(NULL, NULL, "<output>", "output binary position file");
+	struct arg_int *threads = arg_int0("j", "threads", "<n>", "threads parsing text input (default 1)");
+	struct arg_lit *quantize = arg_lit0("q", "quantize", "store quantized position deltas, see README");
+	struct arg_dbl *step = arg_dbl0(NULL, "step", "<um>", "quantization step (default from simu_dt and mD)");
+	struct arg_int *keyframes = arg_int0(NULL, "keyframes", "<n>", "time steps between quantized keyframes (default 64)");
+	struct arg_lit *help = arg_lit0(NULL, "help", "print this help and exit");
+	struct arg_end *end = arg_end(20);
+	void *argtable[] = { infile, outfile, threads, quantize, step, keyframes, help, end };
+	int nerrors;
+
+	if (arg_nullcheck(argtable) != 0) {
+		printf("%s: insufficient memory\n", argv[0]);
+		exit(1);
+	}
+
+	nerrors = arg_parse(argc, argv, argtable);
+
+	if (help->count > 0) {
+		printf("Usage: %s convert", PROGNAME);
+		arg_print_syntax(stdout, argtable, "\n");
+		printf("Convert an MCell text trajectory into the FERNET binary trajectory format.\n");
+		arg_print_glossary(stdout, argtable, "  %-35s %s\n");
+		exit(0);
+	}
+
+	if (nerrors > 0) {
+		arg_print_errors(stdout, end, "convert");
+		printf("Try 'convert --help' for more information.\n");
+		exit(1);
+	}
+
+	/* Open input and output files */
+	struct inputOptions input = { threads->count > 0 ? threads->ival[0] : 1, 0, -1 };
+	struct trajectory *fileIn = openTrajectory(infile->filename[0], input);
+	if (fileIn->binary) {
+		fprintf(stderr, "%s is already a binary trajectory.\n", infile->filename[0]);
+		exit(1);
+	}
+
+	FILE *fileOut = fopen(outfile->filename[0], "wb");
+	if (fileOut == NULL) {
+		fprintf(stderr, "Error opening %s for writing.\n", outfile->filename[0]);
+		exit(1);
+	}
+
+	/* Header is rewritten once the species table offset is known */
+	struct trajHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRAJ_MAGIC, sizeof(TRAJ_MAGIC));
+	header.version = quantize->count > 0 ? TRAJ_QUANTIZED : TRAJ_VERSION;
+	header.simu_dt = fileIn->simu_dt;
+	header.mD = fileIn->mD;
+	fwrite(&header, sizeof(header), 1, fileOut);
+
+	printf("Converting %s into %s\n", infile->filename[0], outfile->filename[0]);
+
+	/* The default step splits the RMS displacement in one time step, sqrt(6 mD simu_dt) */
+	struct quantHeader qheader;
+	struct quantState *quant = NULL;
+	long nkeyframes = 0, nescapes = 0, escapes;
+	if (quantize->count > 0) {
+		double rms = sqrt(6 * fileIn->mD * 1e8 * fileIn->simu_dt);
+		memset(&qheader, 0, sizeof(qheader));
+		qheader.step = step->count > 0 ? step->dval[0] : rms / QUANT_DIVISIONS;
+		qheader.keyframes = keyframes->count > 0 ? keyframes->ival[0] : QUANT_KEYFRAMES;
+		if (!(qheader.step > 0) || qheader.keyframes < 1) {
+			fprintf(stderr, "Invalid quantization step %g um or keyframe interval %u, use --step.\n",
+				qheader.step, qheader.keyframes);
+			exit(1);
+		}
+		fwrite(&qheader, sizeof(qheader), 1, fileOut);
+		quant = newQuantState(qheader.step);
+
+		/* parseCommon rejects w_xy^2 < 40 mD simu_dt, which bounds the error relative to w_xy */
+		printf("  Quantization step %g um, positions within %g um", qheader.step, sqrt(3) / 2 * qheader.step);
+		if (rms > 0) {
+			printf(" (%.2g w_xy at most)", sqrt(3) / 2 * qheader.step / sqrt(40 * fileIn->mD * 1e8 * fileIn->simu_dt));
+		}
+		printf("\n");
+	}
+
+	/* Frame blocks */
+	struct frame *frame;
+	struct frameHeader fheader;
+	const char padding[4] = { 0, 0, 0, 0 };
+	long nmols = 0;
+	while ((frame = readFrame(fileIn)) != NULL) {
+		if (quant != NULL) {
+			escapes = writeQuantizedFrame(fileOut, quant, frame, header.nframes % qheader.keyframes == 0);
+			if (escapes < 0) {
+				nkeyframes++;
+			} else {
+				nescapes += escapes;
+			}
+			header.nframes++;
+			nmols += frame->nmols;
+			if (frame->total > 0) {
+				printf("Progress: %.1f%%\r", 100 * (frame->iter / frame->total));
+			}
+			continue;
+		}
+
+		memset(&fheader, 0, sizeof(fheader));
+		fheader.nmols = frame->nmols;
+		fheader.iter = frame->iter;
+		fheader.total = frame->total;
+		fwrite(&fheader, sizeof(fheader), 1, fileOut);
+		fwrite(frame->species, sizeof(uint16_t), frame->nmols, fileOut);
+		fwrite(padding, 1, (4 - frame->nmols * sizeof(uint16_t) % 4) % 4, fileOut);
+		fwrite(frame->x, sizeof(float), frame->nmols, fileOut);
+		fwrite(frame->y, sizeof(float), frame->nmols, fileOut);
+		fwrite(frame->z, sizeof(float), frame->nmols, fileOut);
+
+		header.nframes++;
+		nmols += frame->nmols;
+		if (frame->total > 0) {
+			printf("Progress: %.1f%%\r", 100 * (frame->iter / frame->total));
+		}
+	}
+	printf("\n");
+
+	/* Species table */
+	header.table = ftell(fileOut);
+	header.nspecies = fileIn->nspecies;
+	for (int i = 0; i < fileIn->nspecies; i++) {
+		uint16_t len = strlen(fileIn->species[i]);
+		fwrite(&len, sizeof(len), 1, fileOut);
+		fwrite(fileIn->species[i], sizeof(char), len, fileOut);
+	}
+
+	rewind(fileOut);
+	fwrite(&header, sizeof(header), 1, fileOut);
+	if (ferror(fileOut)) {
+		fprintf(stderr, "Error writing %s.\n", outfile->filename[0]);
+		exit(1);
+	}
+
+	printf("  %lu time steps, %ld molecule positions, %u species\n",
+	       (unsigned long)header.nframes, nmols, header.nspecies);
+	if (quant != NULL) {
+		printf("  %ld keyframes, %ld escaped positions, %.2f bytes per position\n", nkeyframes, nescapes,
+		       nmols > 0 ? (double)header.table / nmols : 0);
+		freeQuantState(quant);
+	}
+
+	/* Cleanup */
+	fclose(fileOut);
+	closeTrajectory(fileIn);
+	arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+
+	return 0;
+}
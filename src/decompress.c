@@ -0,0 +1,254 @@
+/***********************************************************************************
+ *                                                                                 *
+ * FERNET: Fluorescence Emission Recipes and NumErical routines Toolkit            *
+ * Developed by Juan F. Angiolini and Esteban Mocskos                              *
+ * Facultad de Ciencias Exactas y Naturales, UBA                                   *
+ *                                                                                 *
+ * This program is free software; you can redistribute it and/or                   *
+ * modify it under the terms of the GNU General Public License                     *
+ * as published by the Free Software Foundation; either version 2                  *
+ * of the License, or (at your option) any later version.                          *
+ *                                                                                 *
+ * This program is distributed in the hope that it will be useful,                 *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of                  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                   *
+ * GNU General Public License for more details.                                    *
+ *                                                                                 *
+ * You should have received a copy of the GNU General Public License               *
+ * along with this program; if not, write to the Free Software                     *
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. *
+ *                                                                                 *
+ ***********************************************************************************/
+
+
+#include "fernet.h"
+
+/***********************************************************************************
+ * Streaming decompression of gzip and zstd trajectories. Compressed files are
+ * recognised from their leading magic bytes. A background thread decompresses
+ * them into a pipe, whose read end replaces the file descriptor of the
+ * trajectory, so the text tokenizer reads plain text and decompression overlaps
+ * with parsing and emission. The pipe can not be seeked nor split in byte ranges,
+ * so compressed input is always parsed on one thread from the start.
+ ***********************************************************************************/
+
+enum compressions { GZIP, ZSTD };
+
+struct decompressor {
+	int in, out;		// compressed file and write end of the pipe
+	enum compressions format;
+	pthread_t thread;
+};
+
+static void *gzipThread(void *);
+static void *zstdThread(void *);
+static int writeAll(int, const unsigned char *, size_t);
+
+/***********************************************************************************
+ * Start decompressing *fd if it is compressed, replacing it with the pipe read
+ * end. Returns NULL and leaves *fd untouched for uncompressed input.
+ ***********************************************************************************/
+
+struct decompressor *startDecompressor(int *fd)
+{
+	static const unsigned char gzipMagic[2] = { 0x1f, 0x8b };
+	static const unsigned char zstdMagic[4] = { 0x28, 0xb5, 0x2f, 0xfd };
+	unsigned char magic[4];
+	struct decompressor *dec;
+	int pipefd[2];
+
+	/* Peek at the signature without moving the file offset */
+	if (pread(*fd, magic, sizeof(magic), 0) != sizeof(magic)) {
+		return NULL;
+	}
+
+	dec = (struct decompressor *)calloc(1, sizeof(struct decompressor));
+	if (!memcmp(magic, gzipMagic, sizeof(gzipMagic))) {
+		dec->format = GZIP;
+	} else if (!memcmp(magic, zstdMagic, sizeof(zstdMagic))) {
+		dec->format = ZSTD;
+	} else {
+		free(dec);
+		return NULL;
+	}
+
+	if (pipe(pipefd) < 0) {
+		fprintf(stderr, "Error creating decompression pipe.\n");
+		exit(1);
+	}
+	dec->in = *fd;
+	dec->out = pipefd[1];
+	*fd = pipefd[0];
+
+	if (pthread_create(&dec->thread, NULL, dec->format == GZIP ? gzipThread : zstdThread, dec) != 0) {
+		fprintf(stderr, "Error starting decompression thread.\n");
+		exit(1);
+	}
+
+	return dec;
+}
+
+/***********************************************************************************
+ * Wait for the decompression thread. The pipe read end must be closed first, so
+ * a thread still writing gets EPIPE and stops.
+ ***********************************************************************************/
+
+void stopDecompressor(struct decompressor *dec)
+{
+	pthread_join(dec->thread, NULL);
+	close(dec->in);
+	free(dec);
+}
+
+/***********************************************************************************
+ * gzip decompression, including files made of several concatenated members
+ ***********************************************************************************/
+
+static void *gzipThread(void *arg)
+{
+	struct decompressor *dec = (struct decompressor *)arg;
+	unsigned char *in = (unsigned char *)malloc(READ_BLOCK);
+	unsigned char *out = (unsigned char *)malloc(4 * READ_BLOCK);
+	sigset_t mask;
+	z_stream strm;
+	ssize_t nread;
+	int ret = Z_OK;
+
+	/* Writes to a closed pipe fail with EPIPE instead of killing the program */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	memset(&strm, 0, sizeof(strm));
+	if (inflateInit2(&strm, 15 + 32) != Z_OK) {	// 15 bit window, gzip header
+		fprintf(stderr, "Error initializing gzip decompression.\n");
+		exit(1);
+	}
+
+	while ((nread = read(dec->in, in, READ_BLOCK)) > 0) {
+		strm.next_in = in;
+		strm.avail_in = nread;
+		while (strm.avail_in > 0) {
+			/* Next member of a concatenated file */
+			if (ret == Z_STREAM_END) {
+				inflateReset(&strm);
+			}
+			strm.next_out = out;
+			strm.avail_out = 4 * READ_BLOCK;
+			ret = inflate(&strm, Z_NO_FLUSH);
+			if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+				fprintf(stderr, "Corrupted gzip trajectory: %s\n", strm.msg ? strm.msg : "unknown error");
+				exit(1);
+			}
+			if (writeAll(dec->out, out, 4 * READ_BLOCK - strm.avail_out) < 0) {
+				goto done;
+			}
+			if (ret == Z_BUF_ERROR && strm.avail_out > 0) {
+				break;
+			}
+		}
+	}
+	if (nread < 0) {
+		fprintf(stderr, "Error reading trajectory.\n");
+		exit(1);
+	}
+	if (ret != Z_STREAM_END) {
+		fprintf(stderr, "Truncated gzip trajectory.\n");
+		exit(1);
+	}
+
+ done:
+	inflateEnd(&strm);
+	close(dec->out);
+	free(in);
+	free(out);
+
+	return NULL;
+}
+
+/***********************************************************************************
+ * zstd decompression
+ ***********************************************************************************/
+
+static void *zstdThread(void *arg)
+{
+	struct decompressor *dec = (struct decompressor *)arg;
+	size_t insize = ZSTD_DStreamInSize(), outsize = ZSTD_DStreamOutSize();
+	unsigned char *in = (unsigned char *)malloc(insize);
+	unsigned char *out = (unsigned char *)malloc(outsize);
+	ZSTD_DCtx *dctx = ZSTD_createDCtx();
+	ZSTD_inBuffer input;
+	ZSTD_outBuffer output;
+	sigset_t mask;
+	ssize_t nread;
+	size_t ret = 0;
+
+	/* Writes to a closed pipe fail with EPIPE instead of killing the program */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	if (dctx == NULL) {
+		fprintf(stderr, "Error initializing zstd decompression.\n");
+		exit(1);
+	}
+
+	while ((nread = read(dec->in, in, insize)) > 0) {
+		input.src = in;
+		input.size = nread;
+		input.pos = 0;
+		while (input.pos < input.size) {
+			output.dst = out;
+			output.size = outsize;
+			output.pos = 0;
+			ret = ZSTD_decompressStream(dctx, &output, &input);
+			if (ZSTD_isError(ret)) {
+				fprintf(stderr, "Corrupted zstd trajectory: %s\n", ZSTD_getErrorName(ret));
+				exit(1);
+			}
+			if (writeAll(dec->out, out, output.pos) < 0) {
+				goto done;
+			}
+		}
+	}
+	if (nread < 0) {
+		fprintf(stderr, "Error reading trajectory.\n");
+		exit(1);
+	}
+	if (ret != 0) {
+		fprintf(stderr, "Truncated zstd trajectory.\n");
+		exit(1);
+	}
+
+ done:
+	ZSTD_freeDCtx(dctx);
+	close(dec->out);
+	free(in);
+	free(out);
+
+	return NULL;
+}
+
+/***********************************************************************************
+ * Write len bytes to fd. Returns -1 if the reader has closed the pipe.
+ ***********************************************************************************/
+
+static int writeAll(int fd, const unsigned char *buf, size_t len)
+{
+	ssize_t nwritten;
+
+	while (len > 0) {
+		nwritten = write(fd, buf, len);
+		if (nwritten < 0) {
+			if (errno == EPIPE) {
+				return -1;
+			}
+			fprintf(stderr, "Error writing decompression pipe.\n");
+			exit(1);
+		}
+		buf += nwritten;
+		len -= nwritten;
+	}
+
+	return 0;
+}
@@ -0,0 +1,373 @@
+/***********************************************************************************
+ *                                                                                 *
+ * FERNET: Fluorescence Emission Recipes and NumErical routines Toolkit            *
+ * Developed by Juan F. Angiolini and Esteban Mocskos                              *
+ * Facultad de Ciencias Exactas y Naturales, UBA                                   *
+ *                                                                                 *
+ * This program is free software; you can redistribute it and/or                   *
+ * modify it under the terms of the GNU General Public License                     *
+ * as published by the Free Software Foundation; either version 2                  *
+ * of the License, or (at your option) any later version.                          *
+ *                                                                                 *
+ * This program is distributed in the hope that it will be useful,                 *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of                  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                   *
+ * GNU General Public License for more details.                                    *
+ *                                                                                 *
+ * You should have received a copy of the GNU General Public License               *
+ * along with this program; if not, write to the Free Software                     *
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. *
+ *                                                                                 *
+ ***********************************************************************************/
+
+#include "fernet.h"
+
+/***********************************************************************************
+ * Ensemble of trajectories. Each trajectory is run by its own process in a
+ * ENSEMBLE_DIR directory, with its own seed, and the outputs of all runs are then
+ * averaged (or summed) into files of the same name in the working directory.
+ ***********************************************************************************/
+
+static void runDirectory(char *dirname, int run)
+{
+	sprintf(dirname, ENSEMBLE_DIR, run);
+}
+
+/* Start one run of the ensemble in a child process */
+static pid_t startRun(enum fluo_modes mode, struct args Args, struct rng *r, const char *filename,
+		      unsigned long seed, int run)
+{
+	pid_t pid;
+
+	fflush(NULL);
+	pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "Error starting ensemble run for %s: %s\n", filename, strerror(errno));
+		exit(1);
+	}
+	if (pid > 0) {
+		return pid;
+	}
+
+	/* Child process */
+	ensembleRun(mode, Args, r, filename, seed, run);
+	exit(0);
+}
+
+/***********************************************************************************
+ * Run one trajectory of the ensemble with its seed. Outputs of the routine and its
+ * log go to the directory of the run, which stays the working directory.
+ ***********************************************************************************/
+void ensembleRun(enum fluo_modes mode, struct args Args, struct rng *r, const char *filename,
+		 unsigned long seed, int run)
+{
+	char dirname[32];
+
+	runDirectory(dirname, run);
+	if ((mkdir(dirname, 0755) < 0 && errno != EEXIST) || chdir(dirname) < 0) {
+		fprintf(stderr, "Error creating directory %s: %s\n", dirname, strerror(errno));
+		exit(1);
+	}
+	if (freopen("log.txt", "w", stdout) == NULL) {
+		fprintf(stderr, "Error opening %s/log.txt for writing.\n", dirname);
+		exit(1);
+	}
+	seedRng(r, seed);
+	Args.seed = seed;
+	Args.filename = filename;
+	runRoutine(mode, Args, r);
+	fflush(NULL);
+}
+
+/* Average or sum a text output with one count per line, copy any other text output */
+static void aggregateText(const char *name, int nruns, int sum)
+{
+	FILE *in[nruns], *out;
+	char path[PATH_MAX], line[256], *end;
+	long value, total, nlines = 0;
+	int counts = 1, more = 1;
+
+	for (int k = 0; k < nruns; k++) {
+		runDirectory(path, k);
+		sprintf(path + strlen(path), "/%s", name);
+		in[k] = fopen(path, "r");
+		if (in[k] == NULL) {
+			fprintf(stderr, "Error opening %s for reading.\n", path);
+			exit(1);
+		}
+	}
+	out = fopen(name, "w");
+	if (out == NULL) {
+		fprintf(stderr, "Error opening %s for writing.\n", name);
+		exit(1);
+	}
+
+	/* Files with anything but one integer per line are the same in all runs */
+	while (fgets(line, sizeof(line), in[0]) != NULL) {
+		strtol(line, &end, 10);
+		if (end == line || strspn(end, " \t\r\n") != strlen(end)) {
+			counts = 0;
+			break;
+		}
+	}
+	rewind(in[0]);
+	if (!counts) {
+		size_t n;
+		while ((n = fread(line, 1, sizeof(line), in[0])) > 0) {
+			fwrite(line, 1, n, out);
+		}
+	}
+
+	while (counts && more) {
+		total = 0;
+		for (int k = 0; k < nruns; k++) {
+			if (fgets(line, sizeof(line), in[k]) == NULL) {
+				more = 0;
+				break;
+			}
+			value = strtol(line, &end, 10);
+			if (end == line) {
+				fprintf(stderr, "Invalid count in line %ld of %s in run %d.\n", nlines + 1, name, k);
+				exit(1);
+			}
+			total += value;
+		}
+		if (!more) {
+			break;
+		}
+		if (sum) {
+			fprintf(out, "%ld\n", total);
+		} else {
+			fprintf(out, "%g\n", (double)total / nruns);
+		}
+		nlines++;
+	}
+	if (counts) {
+		for (int k = 0; k < nruns; k++) {
+			if (fgets(line, sizeof(line), in[k]) != NULL) {
+				fprintf(stderr, "Warning: runs of %s have different lengths, %ld lines aggregated.\n",
+					name, nlines);
+				break;
+			}
+		}
+	}
+
+	for (int k = 0; k < nruns; k++) {
+		fclose(in[k]);
+	}
+	fclose(out);
+}
+
+/* Average an 8 bit TIFF pixel by pixel, directory by directory, into 32 bit floats,
+ * or sum it into 32 bit integers. Carpets keep the tags of a carpet. */
+static void aggregateTIFF(const char *name, int nruns, int sum, int carpet)
+{
+	TIFF *in[nruns], *out;
+	char path[PATH_MAX];
+	uint32 width, height, w, h;
+	int more = 1;
+
+	for (int k = 0; k < nruns; k++) {
+		runDirectory(path, k);
+		sprintf(path + strlen(path), "/%s", name);
+		in[k] = TIFFOpen(path, "r");
+		if (in[k] == NULL) {
+			fprintf(stderr, "Error opening %s for reading.\n", path);
+			exit(1);
+		}
+	}
+	out = TIFFOpen(name, "w");
+	if (out == NULL) {
+		fprintf(stderr, "Error opening %s for writing.\n", name);
+		exit(1);
+	}
+
+	while (more) {
+		TIFFGetField(in[0], TIFFTAG_IMAGEWIDTH, &width);
+		TIFFGetField(in[0], TIFFTAG_IMAGELENGTH, &height);
+		for (int k = 1; k < nruns; k++) {
+			TIFFGetField(in[k], TIFFTAG_IMAGEWIDTH, &w);
+			TIFFGetField(in[k], TIFFTAG_IMAGELENGTH, &h);
+			if (w != width || h < height) {
+				fprintf(stderr, "Images of %s differ in size between runs.\n", name);
+				exit(1);
+			}
+		}
+
+		unsigned char buf[width];
+		uint32 total[width];
+		float mean[width];
+		if (carpet) {
+			writeLineTIFFTags(out, width);
+		} else {
+			writeImageTIFFtags(out, width, height);
+		}
+		TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, 32);
+		TIFFSetField(out, TIFFTAG_SAMPLEFORMAT, sum ? SAMPLEFORMAT_UINT : SAMPLEFORMAT_IEEEFP);
+		for (uint32 j = 0; j < height; j++) {
+			memset(total, 0, sizeof(total));
+			for (int k = 0; k < nruns; k++) {
+				if (TIFFReadScanline(in[k], buf, j, 0) < 0) {
+					memset(buf, 0, sizeof(buf));
+				}
+				for (uint32 i = 0; i < width; i++) {
+					total[i] += buf[i];
+				}
+			}
+			if (sum) {
+				TIFFWriteScanline(out, total, j, 0);
+				continue;
+			}
+			for (uint32 i = 0; i < width; i++) {
+				mean[i] = (float)total[i] / nruns;
+			}
+			TIFFWriteScanline(out, mean, j, 0);
+		}
+
+		for (int k = 0; k < nruns; k++) {
+			if (!TIFFReadDirectory(in[k])) {
+				more = 0;
+			}
+		}
+		if (more) {
+			TIFFWriteDirectory(out);
+		}
+	}
+
+	for (int k = 0; k < nruns; k++) {
+		TIFFClose(in[k]);
+	}
+	TIFFClose(out);
+}
+
+/***********************************************************************************
+ * Absolute path and seed of every trajectory of the ensemble, all drawn from r. The
+ * list of runs is written to ensemble.txt when list is set.
+ ***********************************************************************************/
+void ensembleSetup(struct args Args, struct rng *r, char **path, unsigned long *seed, int list)
+{
+	int nruns = Args.ensemble.nfiles;
+	char dirname[32];
+	FILE *file;
+
+	/* All runs must share the time step */
+	checkEnsemble(Args);
+
+	/* Runs change directory, so they get absolute paths */
+	for (int k = 0; k < nruns; k++) {
+		path[k] = realpath(Args.ensemble.filenames[k], NULL);
+		if (path[k] == NULL) {
+			fprintf(stderr, "Error opening %s: %s\n", Args.ensemble.filenames[k], strerror(errno));
+			exit(1);
+		}
+		seed[k] = gsl_rng_get(r->gsl);
+	}
+	if (!list) {
+		return;
+	}
+
+	file = fopen("ensemble.txt", "w");
+	if (file == NULL) {
+		fprintf(stderr, "Error opening ensemble.txt for writing.\n");
+		exit(1);
+	}
+	for (int k = 0; k < nruns; k++) {
+		runDirectory(dirname, k);
+		fprintf(file, "%s %s %lu\n", dirname, path[k], seed[k]);
+	}
+	fclose(file);
+}
+
+/***********************************************************************************
+ * Aggregate every output of the first run with the same file of the others
+ ***********************************************************************************/
+void aggregateEnsemble(enum fluo_modes mode, struct args Args)
+{
+	int nruns = Args.ensemble.nfiles;
+	char dirname[32];
+
+	printf("Aggregating outputs (%s of %d runs):\n", Args.ensemble.sum ? "sum" : "mean", nruns);
+	runDirectory(dirname, 0);
+	DIR *dir = opendir(dirname);
+	struct dirent *entry;
+	if (dir == NULL) {
+		fprintf(stderr, "Error opening directory %s.\n", dirname);
+		exit(1);
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		const char *suffix = strrchr(entry->d_name, '.');
+		if (suffix == NULL || !strcmp(entry->d_name, "log.txt")) {
+			continue;
+		}
+		if (!strcmp(suffix, ".tif")) {
+			aggregateTIFF(entry->d_name, nruns, Args.ensemble.sum, mode == LINE || mode == ORBIT);
+		} else if (!strcmp(suffix, ".txt")) {
+			aggregateText(entry->d_name, nruns, Args.ensemble.sum);
+		} else {
+			continue;
+		}
+		printf("  Writing output file %s\n", entry->d_name);
+	}
+	closedir(dir);
+}
+
+/**********************************************************************************
+ * Ensemble routine
+ ***********************************************************************************/
+int ensembleRoutine(enum fluo_modes mode, struct args Args, struct rng *r)
+{
+	int nruns = Args.ensemble.nfiles;
+	int nprocs = Args.ensemble.nprocs < nruns ? Args.ensemble.nprocs : nruns;
+	int running = 0, started = 0, finished = 0, failed = 0, status;
+	char *path[nruns];
+	unsigned long seed[nruns];
+	pid_t pid[nruns], done;
+	char dirname[32];
+
+	ensembleSetup(Args, r, path, seed, 1);
+
+	printLogo();
+	printf("\n");
+	printf("%s %s starting an ensemble of %d runs in %s mode, %d at a time.\n", PROGNAME, VERSION,
+	       nruns, Args.mode, nprocs);
+
+	/* Keep nprocs runs going until all of them finish */
+	while (finished < nruns) {
+		while (running < nprocs && started < nruns) {
+			pid[started] = startRun(mode, Args, r, path[started], seed[started], started);
+			started++;
+			running++;
+		}
+		done = wait(&status);
+		if (done < 0) {
+			fprintf(stderr, "Error waiting for ensemble runs: %s\n", strerror(errno));
+			exit(1);
+		}
+		for (int k = 0; k < started; k++) {
+			if (pid[k] != done) {
+				continue;
+			}
+			runDirectory(dirname, k);
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+				fprintf(stderr, "Run of %s failed, see %s/log.txt\n", path[k], dirname);
+				failed++;
+			} else {
+				printf("  [%d/%d] %s done in %s\n", finished + 1, nruns, path[k], dirname);
+			}
+		}
+		running--;
+		finished++;
+	}
+	if (failed > 0) {
+		fprintf(stderr, "%d of %d ensemble runs failed, outputs not aggregated.\n", failed, nruns);
+		exit(1);
+	}
+
+	aggregateEnsemble(mode, Args);
+
+	for (int k = 0; k < nruns; k++) {
+		free(path[k]);
+	}
+
+	return 0;
+}
@@ -29,11 +29,36 @@
 int main(int argc, char *argv[])
 {
 	srand(time(NULL));	// randomize seed
-	gsl_rng *r = gsl_rng_alloc(gsl_rng_taus);
-	gsl_rng_set(r, rand());
+	struct rng *r = newRng(rand());
+
+	/* Trajectory tools */
+	if (argc > 1 && !strcmp(argv[1], "convert")) {
+		convertRoutine(argc - 1, argv + 1);
+		freeRng(r);
+		return 0;
+	}
+	if (argc > 1 && !strcmp(argv[1], "index")) {
+		indexRoutine(argc - 1, argv + 1);
+		freeRng(r);
+		return 0;
+	}
+	if (argc > 1 && !strcmp(argv[1], "bench")) {
+		benchRoutine(argc - 1, argv + 1);
+		freeRng(r);
+		return 0;
+	}
+
+#ifdef FERNET_MPI
+	MPI_Init(&argc, &argv);
+#endif
 
 	/* Parse arguments from command line */
 	struct args Args = parseArgs(argc, argv);
+#ifdef FERNET_MPI
+	/* Seeds from the clock differ among ranks, all take that of rank 0 */
+	MPI_Bcast(&Args.seed, 1, MPI_UNSIGNED_LONG, 0, MPI_COMM_WORLD);
+#endif
+	seedRng(r, Args.seed);
 
 	/* Get desired fluorescence mode */
 	enum fluo_modes desired_mode;
@@ -56,41 +81,67 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	/* Call fluorescence routine */
+	/* Molecules no channel emits are dropped from text input, SPIM emits all of them */
+	if (desired_mode != SPIM) {
+		parseSpecies(Args.cfg, &Args.input);
+	}
+
+	/* Call fluorescence routine, once per trajectory for an ensemble */
+#ifdef FERNET_MPI
+	mpiRoutine(desired_mode, Args, r);
+#else
+	if (Args.ensemble.nfiles > 1) {
+		ensembleRoutine(desired_mode, Args, r);
+	} else {
+		runRoutine(desired_mode, Args, r);
+	}
+#endif
+
+	/* Cleanup */
+	config_destroy(&Args.cfg);
+	freeRng(r);
+	printf("\n");
+#ifdef FERNET_MPI
+	MPI_Finalize();
+#endif
+
+	return 0;
+}
+
+/***********************************************************************************
+ * Call the emission routine of a fluorescence mode
+ ***********************************************************************************/
+int runRoutine(enum fluo_modes desired_mode, struct args Args, struct rng *r)
+{
 	switch (desired_mode) {
 	case POINT:
-		pointRoutine(Args.cfg, Args.filename, r);
+		pointRoutine(Args, r);
 		break;
 
 	case MULTI:
-		multiRoutine(Args.cfg, Args.filename, r);
+		multiRoutine(Args, r);
 		break;
 
 	case LINE:
-		lineRoutine(Args.cfg, Args.filename, r);
+		lineRoutine(Args, r);
 		break;
 
 	case RASTER:
-		rasterRoutine(Args.cfg, Args.filename, r);
+		rasterRoutine(Args, r);
 		break;
 
 	case STACK:
-		stackRoutine(Args.cfg, Args.filename, r);
+		stackRoutine(Args, r);
 		break;
 
 	case SPIM:
-		spimRoutine(Args.cfg, Args.filename, r);
+		spimRoutine(Args, r);
 		break;
 
 	case ORBIT:
-		orbitRoutine(Args.cfg, Args.filename, r);
+		orbitRoutine(Args, r);
 	}
 
-	/* Cleanup */
-	config_destroy(&Args.cfg);
-	gsl_rng_free(r);
-	printf("\n");
-
 	return 0;
 }
 
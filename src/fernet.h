@@ -32,8 +32,28 @@
 #include <math.h>
 #include <time.h>
 #include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <limits.h>
+#include <glob.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <zlib.h>
+#include <zstd.h>
 #include <gsl/gsl_rng.h>
 #include <gsl/gsl_randist.h>
+#include <gsl/gsl_cdf.h>
+#include <gsl/gsl_sf_bessel.h>
+#ifdef FERNET_MPI
+#include <mpi.h>
+#endif
 
 /***********************************************************************************
  * Program info
@@ -43,23 +63,142 @@
 #define VERSION "1.4"
 #define DATE "November 2016"
 
+/***********************************************************************************
+ * Binary trajectory format
+ ***********************************************************************************/
+
+#define TRAJ_MAGIC "FERNETB"	// File signature, including the trailing NUL
+#define TRAJ_VERSION 1
+#define TRAJ_QUANTIZED 2	// Binary trajectory version with quantized positions, see quantize.c
+#define QUANT_KEYFRAMES 64	// Default time steps between keyframes of quantized trajectories
+#define QUANT_DIVISIONS 4096	// Default quantization steps per RMS displacement in one time step
+#define READ_BLOCK (1 << 20)	// Bytes requested per read(2) call on text trajectories
+#define PARSE_TARGET 400	// Target text parsing throughput, MB/s per core
+#define CHUNK_BYTES (4 * READ_BLOCK)	// Bytes of text trajectory parsed per thread and round
+#define INDEX_MAGIC "FERNETI"	// Frame index sidecar signature, including the trailing NUL
+#define INDEX_VERSION 1
+#define INDEX_SUFFIX ".idx"	// Frame index file name is the trajectory name plus this suffix
+#define FOLLOW_INTERVAL 100	// Milliseconds between reads at the end of a followed trajectory
+
+/***********************************************************************************
+ * Reader, emission and writer pipeline
+ ***********************************************************************************/
+
+#define RING_FRAMES 16		// Time steps read ahead of the emission routine
+#define RING_JOBS 1024		// Output writes queued for the writer thread
+#define RING_SPINS 64		// Yields of a waiting stage before it starts sleeping
+#define RING_SLEEP 50		// Microseconds slept by a waiting stage
+#define IMAGE_BUFFER 2		// TIFF images held by an image writer, by default
+
+/***********************************************************************************
+ * Ensembles of trajectories
+ ***********************************************************************************/
+
+#define MAX_INPUTS 4096		// Trajectories in one ensemble
+#define ENSEMBLE_DIR "run_%03d"	// Output directory of each ensemble run
+#define MPI_DIR "rank_%03d"	// Output directory of each MPI rank running part of a trajectory
+
+/***********************************************************************************
+ * Detection channels
+ ***********************************************************************************/
+
+#define NCHANNELS 2		// Detection channels of every mode, channel0 and channel1 blocks
+#define PSF_BLOCK 1024		// Molecules whose PSF values are computed at once, see kernel.c
+
+#define PSF_TABLE_R 512		// Samples of r^2 in PSF tables
+#define PSF_TABLE_Z 256		// Samples of z in PSF tables
+#define PSF_TABLE_RANGE 4	// Waists spanned by PSF model tables without a cutoff
+#define PSF_PUPIL_NODES 256	// Quadrature nodes over the pupil of the Born-Wolf PSF
+
+#define RNG_BUFFER 512		// Uniforms generated per refill, two per Philox block
+#define RNG_NOISE 0xfffffffeU	// Stream of the detector noise of a time step, detectors use 0 on
+#define RNG_SERIAL 0xffffffffU	// Stream of draws outside time steps
+#define POOL_WINDOW 2		// Time steps in flight per emission thread
+#define POOL_CHUNK 65536	// Molecules per emission task, larger time steps are split
+#define POOL_DEQUE 256		// Tasks queued per emission thread, a power of two
+#define RNG_INVERSION 14	// Largest binomial mean drawn by inversion, larger ones by GSL
+
+enum psf_isa { ISA_SCALAR, ISA_AVX2, ISA_AVX512, NISAS };	// Instruction sets of the PSF kernels
+enum sampling_modes { SAMPLING_EXACT, SAMPLING_AGGREGATE };	// Photons drawn per molecule, or once per detector and time step
+
 /***********************************************************************************
  * Function protoypes
  ***********************************************************************************/
 
-int pointRoutine(config_t, const char *, gsl_rng *);	// Point mode emission routine
-int multiRoutine(config_t, const char *, gsl_rng *);	// Multi point mode emission routine
-int lineRoutine(config_t, const char *, gsl_rng *);	// Linescan mode emission routine
-int rasterRoutine(config_t, const char *, gsl_rng *);	// Raster mode emission routine
-int stackRoutine(config_t, const char *, gsl_rng *);	// 3D stack emission routine
-int spimRoutine(config_t, const char *, gsl_rng *);	// SPIM emission routine
-int orbitRoutine(config_t, const char *, gsl_rng *);	// Orbital scanning emission routine
-int gaussPSF(double, double, double, double, double, double, double, double, int, double, gsl_rng *);
-int spimPSF(double, double, double, int, double, gsl_rng *);
+enum fluo_modes {		// Possible emission modes 
+	POINT,
+	MULTI,
+	LINE,
+	RASTER,
+	STACK,
+	SPIM,
+	ORBIT
+};
+
+struct trajectory;
+struct frame;
+struct args;
+struct inputOptions;
+struct textParser;
+struct decompressor;
+struct vizData;
+struct reader;
+struct writer;
+struct imageWriter;
+struct commonParms;
+struct psfGeometry;
+struct psfGrid;
+struct psfTable;
+struct quantState;
+struct rng;
+struct framePool;
+struct poolJob;
+
+int pointRoutine(struct args, struct rng *);	// Point mode emission routine
+int multiRoutine(struct args, struct rng *);	// Multi point mode emission routine
+int lineRoutine(struct args, struct rng *);	// Linescan mode emission routine
+int rasterRoutine(struct args, struct rng *);	// Raster mode emission routine
+int stackRoutine(struct args, struct rng *);	// 3D stack emission routine
+int spimRoutine(struct args, struct rng *);	// SPIM emission routine
+int orbitRoutine(struct args, struct rng *);	// Orbital scanning emission routine
+int runRoutine(enum fluo_modes, struct args, struct rng *);	// Call the emission routine of a mode
+int ensembleRoutine(enum fluo_modes, struct args, struct rng *);	// Run a mode on many trajectories and aggregate outputs
+void ensembleSetup(struct args, struct rng *, char **, unsigned long *, int);	// Paths and seeds of the runs of an ensemble
+void ensembleRun(enum fluo_modes, struct args, struct rng *, const char *, unsigned long, int);	// Run one trajectory of an ensemble in its directory
+void aggregateEnsemble(enum fluo_modes, struct args);	// Aggregate the outputs of the runs of an ensemble
+int mpiRoutine(enum fluo_modes, struct args, struct rng *);	// Share a run or an ensemble among MPI ranks, fernet-mpi only
+int convertRoutine(int, char **);	// Convert a text trajectory into the binary format
+int benchRoutine(int, char **);	// Benchmarks of the input and emission stages
+int indexRoutine(int, char **);	// Write the frame index of a trajectory
+int gaussPSF(double, double, double, double, double, double, double, double, int, double, struct rng *);
+int spimPSF(double, double, double, int, double, struct rng *);
+double spimPSFMean(double, double, double, int, double);	// Expected photons of a molecule in the light sheet
+int samplePhotons(double, struct rng *);	// Poisson photon count of an expected number of photons
+void gaussPSFChannels(double, double, double, double, double, double, double, double, int, const double *, int *, struct rng *);	// One PSF value, photons for every channel
+long psfFrame(const struct frame *, double, double, double, const struct commonParms *, int *, struct rng *);	// Photons of a frame in every channel, returns molecules out of the cutoff
+struct psfGrid *newPSFGrid(int, const double *, int, const double *, double);	// Grid of Gaussian PSFs sharing their rows and columns
+void freePSFGrid(struct psfGrid *);	// Free a grid of PSFs
+long psfGridFrame(struct psfGrid *, const struct frame *, const struct commonParms *, int (*)[NCHANNELS], struct rng *);	// Photons of a frame in every PSF of a grid
+long psfGridColumns(struct psfGrid *, const struct frame *, int, int, const struct commonParms *, int (*)[NCHANNELS], struct rng *);	// Photons of a frame in the PSFs of a block of grid columns
+int psfValues(const float *, const float *, const float *, int, const struct psfGeometry *, double *);	// PSF of a block of molecules with the selected kernel
+struct psfTable *newPSFTable(const char *, const char *, double, double, double);	// Tabulate a PSF model or read a measured one
+void freePSFTable(struct psfTable *);	// Free a PSF table
+int psfTableValues(const float *, const float *, const float *, int, const struct psfGeometry *, double *);	// PSF of a block of molecules from a table
+void selectKernel(const char *);	// Select the PSF kernel by instruction set name, or auto
+int selectedKernel();		// Instruction set of the selected PSF kernel
+int kernelSupported(int);	// Check if the CPU runs a PSF kernel
+const char *kernelName(int);	// Name of the instruction set of a PSF kernel
+int outsidePSF(double, double, double, double, double, double, double, double, double);	// Check the PSF cutoff
+void printCutoff(double, long, long);	// Log molecule evaluations skipped by the PSF cutoff
+struct rng *newRng(unsigned long);	// Random number generator with a seed
+void seedRng(struct rng *, unsigned long);	// Restart a random number generator from a seed
+void streamRng(struct rng *, long, uint32_t);	// Switch to the stream of a time step and detector
+void freeRng(struct rng *);	// Free a random number generator
+void fillUniforms(struct rng *);	// Refill the buffer of uniform numbers
 void writeLineTIFFTags(TIFF *, int);
 void writeImageTIFFtags(TIFF *, int, int);	// Write TIFFs tags
 struct args parseArgs(int, char **);	// Parse arguments from console
-struct commonParms parseCommon(config_t, FILE *);	// Parse common parameters from config file
+struct commonParms parseCommon(config_t, struct trajectory *);	// Parse common parameters from config file
 struct pointParms parsePoint(config_t);	// Parse point mode parameters from config file
 struct multiParms parseMulti(config_t);	// Parse multi point mode parameters from config file
 struct lineParms parseLine(config_t);	// Parse linescan mode parameters from config file
@@ -68,22 +207,68 @@ struct channelInfo parseChannel(config_setting_t *, float);	// Parse channel con
 struct stackParms parseStack(config_t);	// Parse stack mode parameters from config file
 struct spimParms parseSpim(config_t);	// Parse SPIM mode parameters from config file
 struct orbitParms parseOrbit(config_t);	// Parse orbital scanning parameters from config file
+void checkEnsemble(struct args);	// Check that all trajectories of an ensemble share the time step
 void parseError(char *);	// Error log when parsing variables
 void printLogo();		// Print ASCII LOGO
-int noiseGenerator(int, int, gsl_rng *);
+int noiseGenerator(int, int, struct rng *);
+struct trajectory *openTrajectory(const char *, struct inputOptions);	// Open a text or binary trajectory
+struct frame *readFrame(struct trajectory *);	// Read next time step, NULL at the end of file
+struct frame *takeFrame(struct trajectory *);	// Read next time step, keeping the previous ones
+void releaseFrame(struct trajectory *);	// Release the oldest time step kept by takeFrame
+struct frame *fetchFrame(struct trajectory *);	// Read next time step on the calling thread
+void closeTrajectory(struct trajectory *);	// Close trajectory and release buffers
+void stopAtIteration(struct trajectory *, float);	// Stop reading at the first time step of an iteration
+int internSpecies(struct trajectory *, const char *, size_t);	// Get species ID for a molecule name
+int findSpecies(const struct trajectory *, const char *, size_t);	// Species ID of a molecule name, -1 if unknown
+unsigned int hashName(const char *, size_t);	// FNV-1a hash of a molecule name
+void parseSpecies(config_t, struct inputOptions *);	// Species emitted by the channels of the config file
+int parseTextLine(const struct trajectory *, const char *, const char **, size_t *, float *, float *, float *);	// Parse one text trajectory line
+struct textParser *startTextParser(int, off_t, int, const struct trajectory *);	// Start multithreaded parsing of a text trajectory
+struct frame *readChunkedFrame(struct trajectory *);	// Read next time step from the multithreaded parser
+void stopTextParser(struct textParser *);	// Stop multithreaded parsing and release buffers
+struct decompressor *startDecompressor(int *);	// Decompress gzip or zstd input on its own thread
+void stopDecompressor(struct decompressor *);	// Wait for decompression and release buffers
+void growFrame(struct trajectory *);	// Double the molecules allocated in the frame of a trajectory
+struct vizData *openVizData(const char *, long);	// Open an MCell visualization output directory
+struct frame *readVizFrame(struct trajectory *);	// Read next visualization file as a time step
+void closeVizData(struct vizData *);	// Release visualization file list and buffers
+struct reader *startReader(struct trajectory *);	// Start reading time steps on a background thread
+struct frame *readQueuedFrame(struct reader *);	// Get next time step from the reader thread
+struct frame *takeQueuedFrame(struct reader *);	// Get next time step, keeping the previous ones
+void releaseQueuedFrame(struct reader *);	// Release the oldest time step kept
+void stopReader(struct reader *);	// Stop the reader thread and release frames
+struct writer *startWriter();	// Start the output writer thread
+void queueScanline(struct writer *, TIFF *, const char *, int, int);	// Queue an 8 bit TIFF scanline
+void queueDirectory(struct writer *, TIFF *, int, int);	// Queue the end of a TIFF image
+void queueCount(struct writer *, FILE *, int);	// Queue a photon count line
+void stopWriter(struct writer *);	// Finish queued writes and stop the writer thread
+struct imageWriter *startImageWriter(TIFF *, int, int, int);	// Write the rows of TIFF images on a thread of its own
+void firstImageRow(struct imageWriter *, long, int);	// Start writing at a later row, before any row is filled
+char *imageRow(struct imageWriter *, long, int);	// Buffer of a row of an image, to fill before committing it
+void commitRow(struct imageWriter *, long, int);	// Hand a filled row, and the rows before it, to the image writer
+void stopImageWriter(struct imageWriter *);	// Write the committed rows and stop the image writer
+void ringPause(int *);		// Yield while the other stage is expected to be quick, then sleep
+struct framePool *startFramePool(struct trajectory *, const struct commonParms *, struct psfGrid *, int, int, const struct rng *);	// Emit time steps on a pool of threads
+struct poolJob *takeJob(struct framePool *);	// Next time step to submit, NULL when the pool is full or at the end
+void submitJob(struct framePool *, struct poolJob *);	// Hand a time step to the emission threads
+struct poolJob *finishedJob(struct framePool *);	// Oldest time step emitted, NULL when all are returned
+void stopFramePool(struct framePool *);	// Stop the emission threads
+struct quantState *newQuantState(float);	// Quantized trajectory reader or writer with a grid step
+void freeQuantState(struct quantState *);	// Release quantized trajectory buffers
+struct frame *readQuantizedFrame(struct trajectory *);	// Decode next quantized time step
+long quantizedKeyframe(struct trajectory *, long);	// Last keyframe at or before a time step
+long writeQuantizedFrame(FILE *, struct quantState *, struct frame *, int);	// Encode a time step
 
 /***********************************************************************************
  * Structures
  ***********************************************************************************/
 
-enum fluo_modes {		// Possible emission modes 
-	POINT,
-	MULTI,
-	LINE,
-	RASTER,
-	STACK,
-	SPIM,
-	ORBIT
+enum text_lines {		// Kinds of line in a text trajectory
+	TEXT_BLANK,
+	TEXT_MOLECULE,
+	TEXT_SEPARATOR,
+	TEXT_INVALID,
+	TEXT_DROPPED		// molecule of a species no channel emits
 };
 
 struct channelInfo {		// Channel information
@@ -102,8 +287,12 @@ struct commonParms {		// Common parameters
 	int lambda;
 	int val;
 	int nevents;
-	struct channelInfo sChannel[2];
+	struct channelInfo sChannel[NCHANNELS];
+	double (*qchannels)[NCHANNELS];	// q of each species ID in every channel, 0 where the channel does not list it
 	int noise;
+	double cutoff2;		// squared PSF cutoff radius in waists, INFINITY for no cutoff
+	int sampling;		// SAMPLING_EXACT or SAMPLING_AGGREGATE, see psfFrame
+	struct psfTable *table;	// tabulated PSF of PSFtype, NULL for the Gaussian
 };
 
 struct pointParms {		// Point mode parameters
@@ -151,8 +340,167 @@ struct orbitParms {		// Orbital scanning parameters
 	const char *tiffname;
 };
 
+struct psfGeometry {		// Gaussian PSF center, waists and squared cutoff in waists
+	double sx, sy, sz;
+	double w_xy, w_z;
+	double cutoff2;
+	const struct psfTable *table;	// tabulated PSF, NULL for the Gaussian
+};
+
+struct psfTable {		// Axially symmetric PSF tabulated in r^2 and z, see psftable.c
+	int ns, nz;
+	double smax, zmax;	// r^2 from 0 to smax and z from -zmax to zmax, in um^2 and um
+	double ds, dz;
+	float *value;		// value at r^2 = is ds, z = iz dz - zmax in value[iz ns + is], peak 1
+};
+
+struct frame {			// Molecule positions in one time step
+	int nmols;
+	uint16_t *species;	// species ID of each molecule, see trajectory species table
+	float *x, *y, *z;
+	float iter, total;	// values from the time step separator line
+	long index;		// time step number, counting from the first one in the file
+	off_t start, separator;	// file offsets of the first molecule line and of the separator line
+};
+
+struct psfGrid {		// Grid of PSFs, centers at every centerx, centery pair and sz
+	int nx, ny;
+	double *centerx, *centery;
+	double sz;
+	float *zeros;		// PSF_BLOCK zero coordinates, for the kernel to see one axis at a time
+	double *fx, *fy, *fz;	// PSF factor of each axis and center for a block of molecules
+	double *g;		// PSF values of a block of molecules in one PSF
+	int *cells;		// molecules of the frame in each cell, then where each cell ends
+	int *cell, capacity;	// cell of each molecule of the frame, -1 when out of reach
+	struct frame sorted;	// molecules of the frame sorted by cell
+	double (*mean)[NCHANNELS];	// expected photons of each PSF in the time step, for aggregate sampling
+};
+
+struct poolJob {		// Time step emitted by a frame pool, see pool.c
+	struct frame *frame;
+	double sx, sy, sz;	// PSF center, not used with a PSF grid
+	int column, row, slice;	// scan position of the time step, for the routine
+	int (*nphot)[NCHANNELS];	// photons in each PSF, without noise
+	long skipped;		// molecule evaluations out of the PSF cutoff
+	int chunk, ntasks;	// molecules per task, and tasks of the time step
+	int done;		// tasks finished by the emission threads
+};
+
+struct rng {			// Random numbers, see rng.c
+	uint32_t key[2];	// Philox key, the seed
+	uint32_t ctr[4];	// counter of the next block: block, stream and time step
+	double u[RNG_BUFFER];	// uniform numbers in [0, 1) not used yet from u[next] on
+	int next;
+	gsl_rng *gsl;		// GSL generator drawing from the same stream, for GSL samplers
+};
+
+struct trajHeader {		// Binary trajectory file header
+	char magic[8];
+	uint32_t version;
+	float simu_dt, mD;
+	uint32_t nspecies;
+	uint64_t table;		// offset of the species table, written after the last frame
+	uint64_t nframes;
+};
+
+struct frameHeader {		// Binary trajectory frame header, followed by species, x, y and z blocks
+	uint32_t nmols;
+	float iter, total;
+	uint32_t reserved;
+};
+
+struct quantHeader {		// Quantized binary trajectory header, follows the trajHeader
+	float step;		// grid spacing of positions, um
+	uint32_t keyframes;	// time steps between forced keyframes
+};
+
+struct quantFrameHeader {	// Quantized frame header, followed by species runs and positions
+	uint32_t nmols;
+	float iter, total;
+	uint32_t keyframe;	// 1 for absolute positions, 0 for deltas to the previous time step
+	uint32_t nruns;
+	uint32_t nescapes;	// molecules of a delta frame stored with absolute positions
+};
+
+struct quantRun {		// Consecutive molecules of one species in a quantized frame
+	uint32_t species;
+	uint32_t count;
+};
+
+struct indexHeader {		// Frame index file header
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t size;		// trajectory size when indexed, to detect stale indexes
+	uint64_t nframes;
+};
+
+struct indexEntry {		// Frame index entry, one per time step
+	uint64_t start;		// offset of the first molecule line (text) or of the frame block (binary)
+	uint64_t separator;	// offset of the separator line (text) or of the frame block (binary)
+	uint32_t nmols;
+	float iter;
+};
+
+struct trajectory {		// Trajectory input file
+	int binary;
+	float simu_dt, mD;
+	int nspecies, maxspecies;
+	char **species;		// molecule name of each species ID
+	int *slots, nslots;	// hash table of species names, see findSpecies
+	int filter;		// text molecules of species not interned when opening are dropped
+	struct frame frame;	// last frame read
+	int capacity;		// allocated molecules in frame (text input)
+	int fd;
+	char *buf;		// text input buffer, unparsed bytes in [bufpos, buflen)
+	size_t bufsize, buflen, bufpos;
+	off_t bufoffset;	// file offset of buf
+	int eof;
+	int follow;		// poll at the end of a growing regular file
+	int live;		// followed file or pipe, expected to end with the iter == total separator
+	unsigned char *map;	// binary input
+	size_t size, offset, end;
+	struct quantState *quant;	// quantized binary input, NULL for float positions
+	struct textParser *parser;	// multithreaded text input, NULL when reading on one thread
+	struct decompressor *decompressor;	// compressed input, NULL for plain files
+	struct vizData *viz;	// MCell visualization output directory, NULL for trajectory files
+	struct reader *reader;	// background reader thread, started by the first readFrame
+	int readahead;		// time steps the reader thread may hold, at least RING_FRAMES
+	long nindex;		// time steps in the frame index, 0 without index
+	struct indexEntry *index;
+	long next, last;	// number of the next time step and of the last one to read, -1 for all
+	float stopiter;		// iteration at which reading stops
+};
+
+struct inputOptions {		// Trajectory input options from command line
+	int nthreads;		// threads parsing text trajectories
+	long first, last;	// time steps to read, last is -1 to read until the end
+	int follow;		// keep reading a growing file until the iter == total separator
+	int nspecies;		// species to keep, all when 0
+	const char **species;
+};
+
+struct ensembleOptions {		// Ensemble options from command line
+	int nfiles;
+	char **filenames;	// trajectories of the ensemble, after expanding wildcards
+	int nprocs;		// runs in parallel
+	int sum;		// sum count traces and images instead of averaging them
+};
+
 struct args {			// Console arguments
 	const char *filename;
 	const char *mode;
 	config_t cfg;
+	int nthreads;		// threads emitting photons
+	int blockcolumns;	// PSF grid columns emitted per task in multi mode, 0 for all
+	int nimages;		// TIFF images, or carpet lines, buffered by each image writer
+	unsigned long seed;	// seed of every random stream
+	struct inputOptions input;
+	struct ensembleOptions ensemble;
 };
+
+/***********************************************************************************
+ * Inline random number draws
+ ***********************************************************************************/
+
+#include "rng.h"
@@ -0,0 +1,130 @@
+/***********************************************************************************
+ *                                                                                 *
+ * FERNET: Fluorescence Emission Recipes and NumErical routines Toolkit            *
+ * Developed by Juan F. Angiolini and Esteban Mocskos                              *
+ * Facultad de Ciencias Exactas y Naturales, UBA                                   *
+ *                                                                                 *
+ * This program is free software; you can redistribute it and/or                   *
+ * modify it under the terms of the GNU General Public License                     *
+ * as published by the Free Software Foundation; either version 2                  *
+ * of the License, or (at your option) any later version.                          *
+ *                                                                                 *
+ * This program is distributed in the hope that it will be useful,                 *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of                  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                   *
+ * GNU General Public License for more details.                                    *
+ *                                                                                 *
+ * You should have received a copy of the GNU General Public License               *
+ * along with this program; if not, write to the Free Software                     *
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. *
+ *                                                                                 *
+ ***********************************************************************************/
+
+
+#include "fernet.h"
+
+/***********************************************************************************
+ * Write the frame index of a trajectory next to it, named after the trajectory
+ * with INDEX_SUFFIX appended. The file starts with an indexHeader, followed by one
+ * indexEntry per time step with the file offsets of its first molecule line and of
+ * its separator line, its number of molecules and its iteration. The size of the
+ * trajectory is recorded so indexes of files that changed afterwards are ignored.
+ ***********************************************************************************/
+int indexRoutine(int argc, char **argv)
+{
+	struct arg_file *infile = arg_file1(NULL, NULL, "<input>", "input position file");
+	struct arg_int *threads = arg_int0("j", "threads", "<n>", "threads parsing text input (default 1)");
+	struct arg_lit *help = arg_lit0(NULL, "help", "print this help and exit");
+	struct arg_end *end = arg_end(20);
+	void *argtable[] = { infile, threads, help, end };
+	int nerrors;
+
+	if (arg_nullcheck(argtable) != 0) {
+		printf("%s: insufficient memory\n", argv[0]);
+		exit(1);
+	}
+
+	nerrors = arg_parse(argc, argv, argtable);
+
+	if (help->count > 0) {
+		printf("Usage: %s index", PROGNAME);
+		arg_print_syntax(stdout, argtable, "\n");
+		printf("Write the frame index of a trajectory, used to start runs at any time step.\n");
+		arg_print_glossary(stdout, argtable, "  %-35s %s\n");
+		exit(0);
+	}
+
+	if (nerrors > 0) {
+		arg_print_errors(stdout, end, "index");
+		printf("Try 'index --help' for more information.\n");
+		exit(1);
+	}
+
+	/* Open input and output files */
+	struct inputOptions input = { threads->count > 0 ? threads->ival[0] : 1, 0, -1 };
+	struct trajectory *fileIn = openTrajectory(infile->filename[0], input);
+	if (fileIn->viz != NULL) {
+		fprintf(stderr, "MCell visualization directories need no index.\n");
+		exit(1);
+	}
+	if (fileIn->decompressor != NULL) {
+		fprintf(stderr, "Compressed trajectories can not be indexed, as they can not be seeked.\n");
+		exit(1);
+	}
+
+	char idxname[strlen(infile->filename[0]) + sizeof(INDEX_SUFFIX)];
+	sprintf(idxname, "%s%s", infile->filename[0], INDEX_SUFFIX);
+	FILE *fileOut = fopen(idxname, "wb");
+	if (fileOut == NULL) {
+		fprintf(stderr, "Error opening %s for writing.\n", idxname);
+		exit(1);
+	}
+
+	/* Header is rewritten once the number of time steps is known */
+	struct indexHeader header;
+	struct stat st;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+	header.version = INDEX_VERSION;
+	if (fstat(fileIn->fd, &st) < 0) {
+		fprintf(stderr, "Error reading %s.\n", infile->filename[0]);
+		exit(1);
+	}
+	header.size = st.st_size;
+	fwrite(&header, sizeof(header), 1, fileOut);
+
+	printf("Indexing %s into %s\n", infile->filename[0], idxname);
+
+	struct frame *frame;
+	struct indexEntry entry;
+	while ((frame = readFrame(fileIn)) != NULL) {
+		memset(&entry, 0, sizeof(entry));
+		entry.start = frame->start;
+		entry.separator = frame->separator;
+		entry.nmols = frame->nmols;
+		entry.iter = frame->iter;
+		fwrite(&entry, sizeof(entry), 1, fileOut);
+
+		header.nframes++;
+		if (frame->total > 0) {
+			printf("Progress: %.1f%%\r", 100 * (frame->iter / frame->total));
+		}
+	}
+	printf("\n");
+
+	rewind(fileOut);
+	fwrite(&header, sizeof(header), 1, fileOut);
+	if (ferror(fileOut)) {
+		fprintf(stderr, "Error writing %s.\n", idxname);
+		exit(1);
+	}
+
+	printf("  %lu time steps\n", (unsigned long)header.nframes);
+
+	/* Cleanup */
+	fclose(fileOut);
+	closeTrajectory(fileIn);
+	arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+
+	return 0;
+}
@@ -0,0 +1,273 @@
+/***********************************************************************************
+ *                                                                                 *
+ * FERNET: Fluorescence Emission Recipes and NumErical routines Toolkit            *
+ * Developed by Juan F. Angiolini and Esteban Mocskos                              *
+ * Facultad de Ciencias Exactas y Naturales, UBA                                   *
+ *                                                                                 *
+ * This program is free software; you can redistribute it and/or                   *
+ * modify it under the terms of the GNU General Public License                     *
+ * as published by the Free Software Foundation; either version 2                  *
+ * of the License, or (at your option) any later version.                          *
+ *                                                                                 *
+ * This program is distributed in the hope that it will be useful,                 *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of                  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                   *
+ * GNU General Public License for more details.                                    *
+ *                                                                                 *
+ * You should have received a copy of the GNU General Public License               *
+ * along with this program; if not, write to the Free Software                     *
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. *
+ *                                                                                 *
+ ***********************************************************************************/
+
+#include "fernet.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KERNEL_X86
+#endif
+
+/***********************************************************************************
+ * PSF values of a block of molecules. Frames already hold the positions as separate
+ * x, y, z arrays, so the kernels stream through them and write the Gaussian PSF
+ * g = exp(-2 d2), where d2 is the squared distance to the center in waists, or 0
+ * for molecules beyond the PSF cutoff. They return the number of those molecules.
+ *
+ * The scalar kernel computes g in double precision exactly as gaussPSF does. The
+ * AVX2 and AVX-512 kernels handle 8 and 16 molecules per instruction in single
+ * precision, with a polynomial exp() of a few ulp, far below the sampling noise.
+ * The kernel is chosen once at startup among those the CPU supports.
+ ***********************************************************************************/
+
+static const char *isaNames[NISAS] = { "scalar", "avx2", "avx512" };
+static int currentISA = ISA_SCALAR;
+
+static int psfScalar(const float *x, const float *y, const float *z, int n, const struct psfGeometry *geo,
+		     double *g)
+{
+	double dx, dy, dz;
+	int skipped = 0;
+
+	for (int i = 0; i < n; i++) {
+		dx = x[i] - geo->sx;
+		dy = y[i] - geo->sy;
+		dz = z[i] - geo->sz;
+		if ((dx * dx + dy * dy) / (geo->w_xy * geo->w_xy) + (dz * dz) / (geo->w_z * geo->w_z) > geo->cutoff2) {
+			g[i] = 0;
+			skipped++;
+			continue;
+		}
+		g[i] = exp(-2 * (dx * dx + dy * dy) / (geo->w_xy * geo->w_xy) - 2 * (dz * dz) / (geo->w_z * geo->w_z));
+	}
+	return skipped;
+}
+
+#ifdef KERNEL_X86
+
+/* Cephes expf: x = n ln2 + r with |r| <= ln2 / 2, e^r by a polynomial, 2^n in the exponent */
+#define EXP_LOW -87.0f
+#define EXP_LOG2E 1.44269504088896341f
+#define EXP_C1 0.693359375f
+#define EXP_C2 -2.12194440e-4f
+#define EXP_P0 1.9875691500e-4f
+#define EXP_P1 1.3981999507e-3f
+#define EXP_P2 8.3334519073e-3f
+#define EXP_P3 4.1665795894e-2f
+#define EXP_P4 1.6666665459e-1f
+#define EXP_P5 5.0000001201e-1f
+
+__attribute__ ((target("avx2,fma")))
+static __m256 exp256(__m256 x)
+{
+	__m256 under = _mm256_cmp_ps(x, _mm256_set1_ps(EXP_LOW), _CMP_LT_OQ);
+	__m256 fx, r, p;
+	__m256i e;
+
+	x = _mm256_max_ps(x, _mm256_set1_ps(EXP_LOW));
+	fx = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(EXP_LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	r = _mm256_fnmadd_ps(fx, _mm256_set1_ps(EXP_C1), x);
+	r = _mm256_fnmadd_ps(fx, _mm256_set1_ps(EXP_C2), r);
+
+	p = _mm256_set1_ps(EXP_P0);
+	p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_P1));
+	p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_P2));
+	p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_P3));
+	p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_P4));
+	p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_P5));
+	p = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1)));
+
+	e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(fx), _mm256_set1_epi32(127)), 23);
+	return _mm256_andnot_ps(under, _mm256_mul_ps(p, _mm256_castsi256_ps(e)));
+}
+
+__attribute__ ((target("avx2,fma")))
+static int psfAVX2(const float *x, const float *y, const float *z, int n, const struct psfGeometry *geo, double *g)
+{
+	const __m256 sx = _mm256_set1_ps(geo->sx), sy = _mm256_set1_ps(geo->sy), sz = _mm256_set1_ps(geo->sz);
+	const __m256 axy = _mm256_set1_ps(1 / (geo->w_xy * geo->w_xy)), az = _mm256_set1_ps(1 / (geo->w_z * geo->w_z));
+	const __m256 cutoff2 = _mm256_set1_ps(geo->cutoff2), minus2 = _mm256_set1_ps(-2);
+	float tx[8], ty[8], tz[8];
+	double tg[8];
+	int skipped = 0;
+
+	for (int i = 0; i < n; i += 8) {
+		int len = n - i < 8 ? n - i : 8;
+		const float *px = x + i, *py = y + i, *pz = z + i;
+		double *pg = len == 8 ? g + i : tg;
+
+		/* The last molecules are copied into a full vector padded with the center */
+		if (len < 8) {
+			for (int k = 0; k < 8; k++) {
+				tx[k] = k < len ? px[k] : geo->sx;
+				ty[k] = k < len ? py[k] : geo->sy;
+				tz[k] = k < len ? pz[k] : geo->sz;
+			}
+			px = tx;
+			py = ty;
+			pz = tz;
+		}
+
+		__m256 dx = _mm256_sub_ps(_mm256_loadu_ps(px), sx);
+		__m256 dy = _mm256_sub_ps(_mm256_loadu_ps(py), sy);
+		__m256 dz = _mm256_sub_ps(_mm256_loadu_ps(pz), sz);
+		__m256 d2 = _mm256_mul_ps(_mm256_fmadd_ps(dx, dx, _mm256_mul_ps(dy, dy)), axy);
+		d2 = _mm256_fmadd_ps(_mm256_mul_ps(dz, dz), az, d2);
+		__m256 out = _mm256_cmp_ps(d2, cutoff2, _CMP_GT_OQ);
+		__m256 v = _mm256_andnot_ps(out, exp256(_mm256_mul_ps(d2, minus2)));
+
+		_mm256_storeu_pd(pg, _mm256_cvtps_pd(_mm256_castps256_ps128(v)));
+		_mm256_storeu_pd(pg + 4, _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)));
+		skipped += __builtin_popcount(_mm256_movemask_ps(out));
+		if (len < 8) {
+			memcpy(g + i, tg, len * sizeof(double));
+		}
+	}
+	return skipped;
+}
+
+__attribute__ ((target("avx512f")))
+static __m512 exp512(__m512 x)
+{
+	__mmask16 under = _mm512_cmp_ps_mask(x, _mm512_set1_ps(EXP_LOW), _CMP_LT_OQ);
+	__m512 fx, r, p;
+	__m512i e;
+
+	x = _mm512_max_ps(x, _mm512_set1_ps(EXP_LOW));
+	fx = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(EXP_LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	r = _mm512_fnmadd_ps(fx, _mm512_set1_ps(EXP_C1), x);
+	r = _mm512_fnmadd_ps(fx, _mm512_set1_ps(EXP_C2), r);
+
+	p = _mm512_set1_ps(EXP_P0);
+	p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_P1));
+	p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_P2));
+	p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_P3));
+	p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_P4));
+	p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_P5));
+	p = _mm512_fmadd_ps(p, _mm512_mul_ps(r, r), _mm512_add_ps(r, _mm512_set1_ps(1)));
+
+	e = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(fx), _mm512_set1_epi32(127)), 23);
+	return _mm512_maskz_mul_ps(~under, p, _mm512_castsi512_ps(e));
+}
+
+__attribute__ ((target("avx512f")))
+static int psfAVX512(const float *x, const float *y, const float *z, int n, const struct psfGeometry *geo,
+		     double *g)
+{
+	const __m512 sx = _mm512_set1_ps(geo->sx), sy = _mm512_set1_ps(geo->sy), sz = _mm512_set1_ps(geo->sz);
+	const __m512 axy = _mm512_set1_ps(1 / (geo->w_xy * geo->w_xy)), az = _mm512_set1_ps(1 / (geo->w_z * geo->w_z));
+	const __m512 cutoff2 = _mm512_set1_ps(geo->cutoff2), minus2 = _mm512_set1_ps(-2);
+	int skipped = 0;
+
+	for (int i = 0; i < n; i += 16) {
+		/* The last molecules are loaded and stored under a lane mask */
+		__mmask16 lanes = n - i < 16 ? (__mmask16) ((1u << (n - i)) - 1) : 0xffff;
+		__m512 dx = _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, x + i), sx);
+		__m512 dy = _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, y + i), sy);
+		__m512 dz = _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, z + i), sz);
+		__m512 d2 = _mm512_mul_ps(_mm512_fmadd_ps(dx, dx, _mm512_mul_ps(dy, dy)), axy);
+		d2 = _mm512_fmadd_ps(_mm512_mul_ps(dz, dz), az, d2);
+		__mmask16 out = _mm512_cmp_ps_mask(d2, cutoff2, _CMP_GT_OQ) & lanes;
+		__m512 v = _mm512_maskz_mov_ps(~out, exp512(_mm512_mul_ps(d2, minus2)));
+
+		_mm512_mask_storeu_pd(g + i, (__mmask8) lanes, _mm512_cvtps_pd(_mm512_castps512_ps256(v)));
+		_mm512_mask_storeu_pd(g + i + 8, (__mmask8) (lanes >> 8),
+				      _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1))));
+		skipped += __builtin_popcount(out);
+	}
+	return skipped;
+}
+
+#endif
+
+/***********************************************************************************
+ * Kernel selection
+ ***********************************************************************************/
+
+int kernelSupported(int isa)
+{
+	switch (isa) {
+	case ISA_SCALAR:
+		return 1;
+#ifdef KERNEL_X86
+	case ISA_AVX2:
+		return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	case ISA_AVX512:
+		return __builtin_cpu_supports("avx512f");
+#endif
+	default:
+		return 0;
+	}
+}
+
+const char *kernelName(int isa)
+{
+	return isaNames[isa];
+}
+
+/* Select the kernel by name, "auto" picks the widest one the CPU supports */
+void selectKernel(const char *name)
+{
+	if (!strcmp(name, "auto")) {
+		currentISA = ISA_SCALAR;
+		for (int isa = 0; isa < NISAS; isa++) {
+			if (kernelSupported(isa)) {
+				currentISA = isa;
+			}
+		}
+		return;
+	}
+	for (int isa = 0; isa < NISAS; isa++) {
+		if (!strcmp(name, isaNames[isa])) {
+			if (!kernelSupported(isa)) {
+				fprintf(stderr, "The %s PSF kernel is not supported by this CPU.\n", name);
+				exit(1);
+			}
+			currentISA = isa;
+			return;
+		}
+	}
+	fprintf(stderr, "Unknown PSF kernel '%s', use auto, scalar, avx2 or avx512.\n", name);
+	exit(1);
+}
+
+int selectedKernel()
+{
+	return currentISA;
+}
+
+int psfValues(const float *x, const float *y, const float *z, int n, const struct psfGeometry *geo, double *g)
+{
+	if (geo->table != NULL) {
+		return psfTableValues(x, y, z, n, geo, g);
+	}
+	switch (currentISA) {
+#ifdef KERNEL_X86
+	case ISA_AVX2:
+		return psfAVX2(x, y, z, n, geo, g);
+	case ISA_AVX512:
+		return psfAVX512(x, y, z, n, geo, g);
+#endif
+	default:
+		return psfScalar(x, y, z, n, geo, g);
+	}
+}
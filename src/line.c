@@ -25,31 +25,31 @@
 /***********************************************************************************
  * Linescan mode emission routine
  ***********************************************************************************/
-int lineRoutine(config_t cfg, const char *filename, gsl_rng * r)
+int lineRoutine(struct args Args, struct rng *r)
 {
 	/* Parameters for simulation */
-	float x, y, z, prog;
+	float prog;
 	int nphot[] = { 0, 0 };
 	int column = 0, row = 0;
-	FILE *fileIn;
+	struct trajectory *fileIn;
+	struct frame *frame;
+	struct imageWriter *images[2];
+	struct framePool *pool;
+	struct poolJob *job;
+	long nevals = 0, nskipped = 0;
 	TIFF *tif[2];
 	char *outname[] = { (char *)malloc(30 * sizeof(char)),
 		(char *)malloc(30 * sizeof(char))
 	};
-	char *molname = (char *)malloc(10 * sizeof(char));
 
 	/* Opening input file */
-	fileIn = fopen(filename, "r");
-	if (fileIn == NULL) {
-		fprintf(stderr, "Error opening %s for reading.\n", filename);
-		exit(1);
-	}
+	fileIn = openTrajectory(Args.filename, Args.input);
 
 	/* Get common parameters */
-	struct commonParms cParms = parseCommon(cfg, fileIn);
+	struct commonParms cParms = parseCommon(Args.cfg, fileIn);
 
 	/* Get line mode parameters */
-	struct lineParms lParms = parseLine(cfg);
+	struct lineParms lParms = parseLine(Args.cfg);
 
 	/* Open output files */
 	if (cParms.sChannel[0].status == 1) {
@@ -57,7 +57,7 @@ int lineRoutine(config_t cfg, const char *filename, gsl_rng * r)
 		tif[0] = TIFFOpen(outname[0], "w");
 		if (tif[0] == NULL) {
 			fprintf(stderr, "Error opening %s for writing.\n", outname[0]);
-			fclose(fileIn);
+			closeTrajectory(fileIn);
 			exit(1);
 		}
 	}
@@ -67,7 +67,7 @@ int lineRoutine(config_t cfg, const char *filename, gsl_rng * r)
 		tif[1] = TIFFOpen(outname[1], "w");
 		if (tif[1] == NULL) {
 			fprintf(stderr, "Error opening %s for writing.\n", outname[1]);
-			fclose(fileIn);
+			closeTrajectory(fileIn);
 			exit(1);
 		}
 	}
@@ -84,7 +84,8 @@ int lineRoutine(config_t cfg, const char *filename, gsl_rng * r)
 	printLogo();
 	printf("\n");
 	printf("%s %s starting in line mode.\n", PROGNAME, VERSION);
-	printf("  Reading input file %s\n", filename);
+	printf("  Reading input file %s\n", Args.filename);
+	printf("  Emitting photons on %d threads, random seed %lu\n", Args.nthreads, Args.seed);
 	if (cParms.sChannel[0].status == 1) {
 		printf("  Writing output file %s for channel 0\n", outname[0]);
 	}
@@ -139,88 +140,90 @@ int lineRoutine(config_t cfg, const char *filename, gsl_rng * r)
 		centros[i] = i * lParms.shift - (lParms.ncolumn - 1) * lParms.shift / 2;
 	}
 
-	/* Photon emission routine */
-	char buf_row[2][lParms.ncolumn];	// buffer for TIFF writing
+	/* Photon emission routine, time steps are emitted on a pool of threads and come back in order */
+	for (int c = 0; c < NCHANNELS; c++) {
+		if (cParms.sChannel[c].status == 1) {
+			images[c] = startImageWriter(tif[c], lParms.ncolumn, 0, Args.nimages);
+		}
+	}
+	pool = startFramePool(fileIn, &cParms, NULL, 0, Args.nthreads, r);
 
-	while (fscanf(fileIn, "%s %f %f %f\n", molname, &x, &y, &z) != EOF) {
-		if (x == 100) {
-			prog = 100 * (y / z);
-			printf("Progress: %.1f%%\r", prog);
-			if (((int)y % ndummy) < lParms.ncolumn) {
-				if (cParms.sChannel[0].status == 1) {
-					nphot[0] += noiseGenerator(nphot[0], cParms.noise, r);
-					buf_row[0][column] = nphot[0];
-					nphot[0] = 0;
-				}
-				if (cParms.sChannel[1].status == 1) {
-					nphot[1] += noiseGenerator(nphot[1], cParms.noise, r);
-					buf_row[1][column] = nphot[1];
-					nphot[1] = 0;
-				}
+	for (;;) {
+		/* The scan moves on as time steps are submitted, each keeps its column */
+		while ((job = takeJob(pool)) != NULL) {
+			frame = job->frame;
 
-				if (column == lParms.ncolumn - 1) {
-					if (cParms.sChannel[0].status == 1) {
-						TIFFWriteScanline(tif[0], buf_row[0], row, 0);
-					}
-					if (cParms.sChannel[1].status == 1) {
-						TIFFWriteScanline(tif[1], buf_row[1], row, 0);
-					}
-					column = 0;
-					row++;
-				} else {
-					column++;
-				}
-			} else {
+			/* Runs starting at a later time step resume the scan where it would be */
+			if (frame->index == Args.input.first && Args.input.first > 0) {
+				column = (int)frame->iter % ndummy < lParms.ncolumn ? (int)frame->iter % ndummy : 0;
+			}
+			job->sx = centros[column] - lParms.centerx;
+			job->sy = lParms.centery;
+			job->sz = lParms.centerz;
+			job->column = column;
+			submitJob(pool, job);
+			if (((int)frame->iter % ndummy) < lParms.ncolumn) {
+				column = column == lParms.ncolumn - 1 ? 0 : column + 1;
+			}
+		}
+		if ((job = finishedJob(pool)) == NULL) {
+			break;
+		}
+		frame = job->frame;
+
+		/* Photons of all molecules, those out of the PSF cutoff emit none */
+		nevals += frame->nmols;
+		nskipped += job->skipped;
+		nphot[0] += job->nphot[0][0];
+		nphot[1] += job->nphot[0][1];
+
+		/* Time step separator */
+		prog = 100 * (frame->iter / frame->total);
+		printf("Progress: %.1f%%\r", prog);
+		streamRng(r, frame->index, RNG_NOISE);
+		if (((int)frame->iter % ndummy) < lParms.ncolumn) {
+			if (cParms.sChannel[0].status == 1) {
+				nphot[0] += noiseGenerator(nphot[0], cParms.noise, r);
+				imageRow(images[0], 0, row)[job->column] = nphot[0];
+				nphot[0] = 0;
+			}
+			if (cParms.sChannel[1].status == 1) {
+				nphot[1] += noiseGenerator(nphot[1], cParms.noise, r);
+				imageRow(images[1], 0, row)[job->column] = nphot[1];
+				nphot[1] = 0;
+			}
+
+			if (job->column == lParms.ncolumn - 1) {
 				if (cParms.sChannel[0].status == 1) {
-					nphot[0] = 0;
+					commitRow(images[0], 0, row);
 				}
 				if (cParms.sChannel[1].status == 1) {
-					nphot[1] = 0;
+					commitRow(images[1], 0, row);
 				}
+				row++;
 			}
 		} else {
 			if (cParms.sChannel[0].status == 1) {
-				for (int i = 0; i < cParms.sChannel[0].nmols; i++) {
-					if (!strcmp(molname, cParms.sChannel[0].mols[i])) {
-						nphot[0] +=
-						    gaussPSF(x, y, z,
-							     cParms.w_xy,
-							     cParms.w_z,
-							     centros[column] -
-							     lParms.centerx,
-							     lParms.centery,
-							     lParms.centerz,
-							     cParms.nevents, cParms.sChannel[0].q[i], r);
-					}
-				}
+				nphot[0] = 0;
 			}
-
 			if (cParms.sChannel[1].status == 1) {
-				for (int i = 0; i < cParms.sChannel[1].nmols; i++) {
-					if (!strcmp(molname, cParms.sChannel[1].mols[i])) {
-						nphot[1] +=
-						    gaussPSF(x, y, z,
-							     cParms.w_xy,
-							     cParms.w_z,
-							     centros[column] -
-							     lParms.centerx,
-							     lParms.centery,
-							     lParms.centerz,
-							     cParms.nevents, cParms.sChannel[1].q[i], r);
-					}
-				}
+				nphot[1] = 0;
 			}
 		}
 	}
 	printf("\n");
+	printCutoff(cParms.cutoff2, nskipped, nevals);
 
 	/* Closing files */
-	fclose(fileIn);
+	stopFramePool(pool);
+	closeTrajectory(fileIn);
 
 	if (cParms.sChannel[0].status == 1) {
+		stopImageWriter(images[0]);
 		TIFFClose(tif[0]);
 	}
 	if (cParms.sChannel[1].status == 1) {
+		stopImageWriter(images[1]);
 		TIFFClose(tif[1]);
 	}
 
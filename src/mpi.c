@@ -0,0 +1,462 @@
+/***********************************************************************************
+ *                                                                                 *
+ * FERNET: Fluorescence Emission Recipes and NumErical routines Toolkit            *
+ * Developed by Juan F. Angiolini and Esteban Mocskos                              *
+ * Facultad de Ciencias Exactas y Naturales, UBA                                   *
+ *                                                                                 *
+ * This program is free software; you can redistribute it and/or                   *
+ * modify it under the terms of the GNU General Public License                     *
+ * as published by the Free Software Foundation; either version 2                  *
+ * of the License, or (at your option) any later version.                          *
+ *                                                                                 *
+ * This program is distributed in the hope that it will be useful,                 *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of                  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                   *
+ * GNU General Public License for more details.                                    *
+ *                                                                                 *
+ * You should have received a copy of the GNU General Public License               *
+ * along with this program; if not, write to the Free Software                     *
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. *
+ *                                                                                 *
+ ***********************************************************************************/
+
+#include "fernet.h"
+
+/***********************************************************************************
+ * MPI runs, built into fernet-mpi. A single trajectory is split into windows of
+ * consecutive time steps, one per rank, that start at the beginning of an output
+ * unit: a line in line mode, an image in raster and stack modes and an orbit in
+ * orbit mode. Each rank runs the usual routine on its window in its own MPI_DIR
+ * directory, and rank 0 joins their outputs into files of the same name in the
+ * working directory: photon count traces and carpets are concatenated, and the
+ * images of raster and stack modes appended. Random streams are set from the
+ * seed of rank 0 and the time step (see rng.c), so the joined outputs are those
+ * of a run on a single node. SPIM images span the whole trajectory and are run
+ * by rank 0 alone.
+ *
+ * An ensemble is dealt out instead, run k on rank k modulo the number of ranks,
+ * and rank 0 aggregates it as ensembleRoutine does. Outputs are exchanged through
+ * the file system, so every rank must share the working directory.
+ ***********************************************************************************/
+
+static double wallTime()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec + 1e-9 * now.tv_nsec;
+}
+
+/***********************************************************************************
+ * Time steps of the trajectory, from its index or from the total of its first
+ * separator line, and time steps in each output unit of the mode
+ ***********************************************************************************/
+
+static void frameUnits(enum fluo_modes mode, struct args Args, long *nframes, long *unit)
+{
+	struct inputOptions input = Args.input;
+	struct trajectory *traj;
+	struct frame *frame;
+
+	input.first = 0;
+	input.last = -1;
+	input.nthreads = 1;
+	traj = openTrajectory(Args.filename, input);
+	struct commonParms cParms = parseCommon(Args.cfg, traj);
+
+	if (traj->nindex > 0) {
+		*nframes = traj->nindex;
+	} else {
+		frame = fetchFrame(traj);
+		*nframes = frame != NULL && frame->total > 0 ? (long)frame->total + 1 : 0;
+	}
+	closeTrajectory(traj);
+	if (*nframes == 0) {
+		fprintf(stderr, "Number of time steps of %s unknown, index it first to split it among MPI ranks.\n",
+			Args.filename);
+		exit(1);
+	}
+
+	switch (mode) {
+	case LINE:{
+			struct lineParms lParms = parseLine(Args.cfg);
+			*unit = lParms.ncolumn + round(lParms.deadtime / cParms.simu_dt);
+			break;
+		}
+	case RASTER:{
+			struct rasterParms rParms = parseRaster(Args.cfg);
+			*unit = (rParms.width + round(rParms.deadtime / cParms.simu_dt)) * rParms.height;
+			break;
+		}
+	case STACK:{
+			/* Stacks end after their last slice */
+			struct stackParms sParms = parseStack(Args.cfg);
+			long nslices = round((sParms.top_z - sParms.bot_z) / sParms.step);
+			*unit = (sParms.width + round(sParms.deadtime / cParms.simu_dt)) * sParms.height;
+			*nframes = *nframes < *unit * nslices ? *nframes : *unit * nslices;
+			break;
+		}
+	case ORBIT:{
+			struct orbitParms orParms = parseOrbit(Args.cfg);
+			*unit = round(orParms.period / cParms.simu_dt);
+			break;
+		}
+	case SPIM:
+		*unit = *nframes;
+		break;
+	default:
+		*unit = 1;
+	}
+	*unit = *unit > 0 ? *unit : 1;
+}
+
+/* Run a routine with its outputs and log in dirname, then come back */
+static void runInDirectory(enum fluo_modes mode, struct args Args, struct rng *r, const char *dirname)
+{
+	int cwd = open(".", O_RDONLY), out;
+
+	fflush(stdout);
+	out = dup(fileno(stdout));
+	if ((mkdir(dirname, 0755) < 0 && errno != EEXIST) || chdir(dirname) < 0) {
+		fprintf(stderr, "Error creating directory %s: %s\n", dirname, strerror(errno));
+		exit(1);
+	}
+	if (freopen("log.txt", "w", stdout) == NULL) {
+		fprintf(stderr, "Error opening %s/log.txt for writing.\n", dirname);
+		exit(1);
+	}
+	runRoutine(mode, Args, r);
+
+	fflush(stdout);
+	if (fchdir(cwd) < 0 || dup2(out, fileno(stdout)) < 0) {
+		fprintf(stderr, "Error leaving directory %s: %s\n", dirname, strerror(errno));
+		exit(1);
+	}
+	close(out);
+	close(cwd);
+}
+
+/***********************************************************************************
+ * Report the work and time of every rank, and how much longer the slowest one
+ * took than the mean
+ ***********************************************************************************/
+
+static void printLoad(const double *load, int nranks, const char *units)
+{
+	double mean = 0, max = 0;
+
+	printf("Load of every MPI rank:\n");
+	for (int k = 0; k < nranks; k++) {
+		printf("  Rank %d: %.0f %s in %.2f s\n", k, load[2 * k], units, load[2 * k + 1]);
+		mean += load[2 * k + 1] / nranks;
+		max = load[2 * k + 1] > max ? load[2 * k + 1] : max;
+	}
+	if (mean > 0) {
+		printf("  Load imbalance: slowest rank %.2f s, mean %.2f s (%.1f%% above the mean)\n", max, mean,
+		       100 * (max / mean - 1));
+	}
+}
+
+/***********************************************************************************
+ * Joining outputs of the ranks that ran a window, those with no time steps are
+ * skipped
+ ***********************************************************************************/
+
+/* Concatenate a text output with one count per line, copy any other text output */
+static void joinText(const char *name, const double *load, int nranks)
+{
+	char path[PATH_MAX], line[256], *end;
+	int counts = 1, copied = 0;
+	FILE *in, *out;
+	size_t n;
+
+	out = fopen(name, "w");
+	if (out == NULL) {
+		fprintf(stderr, "Error opening %s for writing.\n", name);
+		exit(1);
+	}
+	for (int k = 0; k < nranks && (counts || !copied); k++) {
+		if (load[2 * k] == 0) {
+			continue;
+		}
+		sprintf(path, MPI_DIR "/%s", k, name);
+		in = fopen(path, "r");
+		if (in == NULL) {
+			fprintf(stderr, "Error opening %s for reading.\n", path);
+			exit(1);
+		}
+
+		/* Files with anything but one integer per line are the same in all ranks */
+		while (!copied && fgets(line, sizeof(line), in) != NULL) {
+			strtol(line, &end, 10);
+			if (end == line || strspn(end, " \t\r\n") != strlen(end)) {
+				counts = 0;
+				break;
+			}
+		}
+		rewind(in);
+		while ((n = fread(line, 1, sizeof(line), in)) > 0) {
+			fwrite(line, 1, n, out);
+		}
+		copied = 1;
+		fclose(in);
+	}
+
+	/* Only logs are left in the directories of the ranks */
+	for (int k = 0; k < nranks; k++) {
+		sprintf(path, MPI_DIR "/%s", k, name);
+		unlink(path);
+	}
+	fclose(out);
+}
+
+/* Append the images of a TIFF output, or the lines of a carpet */
+static void joinTIFF(const char *name, const double *load, int nranks, int carpet)
+{
+	TIFF *in, *out;
+	char path[PATH_MAX];
+	uint32 width, height, row = 0;
+	int tags = 0;
+
+	out = TIFFOpen(name, "w");
+	if (out == NULL) {
+		fprintf(stderr, "Error opening %s for writing.\n", name);
+		exit(1);
+	}
+	for (int k = 0; k < nranks; k++) {
+		if (load[2 * k] == 0) {
+			continue;
+		}
+		sprintf(path, MPI_DIR "/%s", k, name);
+
+		/* Carpets of ranks that ended no row are left empty */
+		struct stat st;
+		if (stat(path, &st) == 0 && st.st_size == 0) {
+			continue;
+		}
+		in = TIFFOpen(path, "r");
+		if (in == NULL) {
+			fprintf(stderr, "Error opening %s for reading.\n", path);
+			exit(1);
+		}
+
+		do {
+			if (!TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &width) || !TIFFGetField(in, TIFFTAG_IMAGELENGTH, &height)) {
+				continue;
+			}
+			unsigned char buf[width];
+			int last = 0;
+
+			/* Rows before the first time step or after the last one were never written */
+			for (uint32 j = 0; j < height; j++) {
+				if (TIFFReadScanline(in, buf, j, 0) < 0) {
+					continue;
+				}
+				if (!tags) {
+					if (carpet) {
+						writeLineTIFFTags(out, width);
+					} else {
+						writeImageTIFFtags(out, width, height);
+					}
+					tags = 1;
+				}
+				TIFFWriteScanline(out, buf, carpet ? row++ : j, 0);
+				last = j == height - 1;
+			}
+
+			/* Images end as the image writer ends them, after their last row */
+			if (!carpet && last) {
+				TIFFWriteDirectory(out);
+				writeImageTIFFtags(out, width, height);
+			}
+		} while (TIFFReadDirectory(in));
+		TIFFClose(in);
+	}
+	TIFFClose(out);
+
+	for (int k = 0; k < nranks; k++) {
+		sprintf(path, MPI_DIR "/%s", k, name);
+		unlink(path);
+	}
+}
+
+static void joinOutputs(enum fluo_modes mode, const double *load, int nranks)
+{
+	char dirname[32];
+	int first = 0;
+
+	while (first < nranks - 1 && load[2 * first] == 0) {
+		first++;
+	}
+	sprintf(dirname, MPI_DIR, first);
+	DIR *dir = opendir(dirname);
+	struct dirent *entry;
+	if (dir == NULL) {
+		fprintf(stderr, "Error opening directory %s.\n", dirname);
+		exit(1);
+	}
+
+	printf("Joining outputs of the MPI ranks:\n");
+	while ((entry = readdir(dir)) != NULL) {
+		const char *suffix = strrchr(entry->d_name, '.');
+		if (suffix == NULL || !strcmp(entry->d_name, "log.txt")) {
+			continue;
+		}
+		if (!strcmp(suffix, ".tif")) {
+			joinTIFF(entry->d_name, load, nranks, mode == LINE || mode == ORBIT);
+		} else if (!strcmp(suffix, ".txt")) {
+			joinText(entry->d_name, load, nranks);
+		} else {
+			continue;
+		}
+		printf("  Writing output file %s\n", entry->d_name);
+	}
+	closedir(dir);
+}
+
+/***********************************************************************************
+ * Window of time steps of each rank, split evenly and moved forward to the start
+ * of an output unit
+ ***********************************************************************************/
+
+static void mpiFrames(enum fluo_modes mode, struct args Args, struct rng *r, int rank, int nranks)
+{
+	long range[2], first, last, start[nranks + 1];
+	double load[2] = { 0, 0 }, t, *loads = NULL;
+	char dirname[32], *path;
+
+	if (Args.input.follow || !strcmp(Args.filename, "-")) {
+		fprintf(stderr, "Live input can not be split among MPI ranks.\n");
+		exit(1);
+	}
+
+	/* Ranks read the trajectory from their own directories */
+	path = realpath(Args.filename, NULL);
+	if (path == NULL) {
+		fprintf(stderr, "Error opening %s for reading.\n", Args.filename);
+		exit(1);
+	}
+	Args.filename = path;
+	if (rank == 0) {
+		frameUnits(mode, Args, &range[0], &range[1]);
+	}
+	MPI_Bcast(range, 2, MPI_LONG, 0, MPI_COMM_WORLD);
+
+	first = Args.input.first;
+	last = Args.input.last >= 0 && Args.input.last < range[0] - 1 ? Args.input.last : range[0] - 1;
+	for (int k = 0; k <= nranks; k++) {
+		start[k] = first + (last - first + 1) * k / nranks;
+		start[k] = (start[k] + range[1] - 1) / range[1] * range[1];
+		start[k] = k == 0 ? first : (start[k] < last + 1 ? start[k] : last + 1);
+	}
+
+	if (rank == 0) {
+		printLogo();
+		printf("\n");
+		printf("%s %s starting in %s mode on %d MPI ranks.\n", PROGNAME, VERSION, Args.mode, nranks);
+		printf("  Reading input file %s\n", Args.filename);
+		printf("  Time steps %ld to %ld, in windows of whole units of %ld time steps\n", first, last, range[1]);
+		for (int k = 0; k < nranks; k++) {
+			if (start[k] < start[k + 1]) {
+				printf("  Rank %d: time steps %ld to %ld in " MPI_DIR "\n", k, start[k], start[k + 1] - 1, k);
+			} else {
+				printf("  Rank %d: no time steps\n", k);
+			}
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+
+	if (start[rank] < start[rank + 1]) {
+		Args.input.first = start[rank];
+		Args.input.last = start[rank + 1] - 1;
+		sprintf(dirname, MPI_DIR, rank);
+		t = wallTime();
+		runInDirectory(mode, Args, r, dirname);
+		load[0] = start[rank + 1] - start[rank];
+		load[1] = wallTime() - t;
+	}
+
+	if (rank == 0) {
+		loads = (double *)malloc(2 * nranks * sizeof(double));
+	}
+	MPI_Gather(load, 2, MPI_DOUBLE, loads, 2, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+	if (rank == 0) {
+		printLoad(loads, nranks, "time steps");
+		joinOutputs(mode, loads, nranks);
+		free(loads);
+	}
+	free(path);
+}
+
+static void mpiEnsemble(enum fluo_modes mode, struct args Args, struct rng *r, int rank, int nranks)
+{
+	int nruns = Args.ensemble.nfiles;
+	char *path[nruns];
+	unsigned long seed[nruns];
+	double load[2] = { 0, 0 }, t, *loads = NULL;
+	int cwd, out;
+
+	/* Every rank draws the same seeds, rank 0 lists them */
+	ensembleSetup(Args, r, path, seed, rank == 0);
+
+	if (rank == 0) {
+		printLogo();
+		printf("\n");
+		printf("%s %s starting an ensemble of %d runs in %s mode on %d MPI ranks.\n", PROGNAME, VERSION,
+		       nruns, Args.mode, nranks);
+		fflush(stdout);
+	}
+
+	for (int k = rank; k < nruns; k += nranks) {
+		t = wallTime();
+		fflush(stdout);
+		cwd = open(".", O_RDONLY);
+		out = dup(fileno(stdout));
+		ensembleRun(mode, Args, r, path[k], seed[k], k);
+		if (fchdir(cwd) < 0 || dup2(out, fileno(stdout)) < 0) {
+			fprintf(stderr, "Error leaving the directory of run %d: %s\n", k, strerror(errno));
+			exit(1);
+		}
+		close(out);
+		close(cwd);
+		load[0]++;
+		load[1] += wallTime() - t;
+	}
+
+	if (rank == 0) {
+		loads = (double *)malloc(2 * nranks * sizeof(double));
+	}
+	MPI_Gather(load, 2, MPI_DOUBLE, loads, 2, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+	if (rank == 0) {
+		printLoad(loads, nranks, "runs");
+		aggregateEnsemble(mode, Args);
+		free(loads);
+	}
+
+	for (int k = 0; k < nruns; k++) {
+		free(path[k]);
+	}
+}
+
+/**********************************************************************************
+ * MPI routine, called by every rank
+ ***********************************************************************************/
+int mpiRoutine(enum fluo_modes mode, struct args Args, struct rng *r)
+{
+	int rank, nranks;
+
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &nranks);
+
+	if (Args.ensemble.nfiles > 1) {
+		mpiEnsemble(mode, Args, r, rank, nranks);
+	} else if (nranks == 1) {
+		runRoutine(mode, Args, r);
+	} else {
+		mpiFrames(mode, Args, r, rank, nranks);
+	}
+
+	return 0;
+}
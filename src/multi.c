@@ -25,27 +25,27 @@
 /***********************************************************************************
  * Multi point mode emission routine 
  ***********************************************************************************/
-int multiRoutine(config_t cfg, const char *filename, gsl_rng * r)
+int multiRoutine(struct args Args, struct rng *r)
 {
 	/* Parameters for simulation */
-	float x, y, z, prog;
+	float prog;
 	int countPSF, nPSF;
-	FILE *fileIn;
+	struct trajectory *fileIn;
+	struct frame *frame;
+	struct writer *writer;
+	struct framePool *pool;
+	struct poolJob *job;
+	long nevals = 0, nskipped = 0;
 	char *outname = (char *)malloc(30 * sizeof(char));
-	char *molname = (char *)malloc(10 * sizeof(char));
 
 	/* Open input files */
-	fileIn = fopen(filename, "r");
-	if (fileIn == NULL) {
-		fprintf(stderr, "Error opening %s for reading.\n", filename);
-		exit(1);
-	}
+	fileIn = openTrajectory(Args.filename, Args.input);
 
 	/* Get common parameters */
-	struct commonParms cParms = parseCommon(cfg, fileIn);
+	struct commonParms cParms = parseCommon(Args.cfg, fileIn);
 
 	/* Get multi mode parameters */
-	struct multiParms mParms = parseMulti(cfg);
+	struct multiParms mParms = parseMulti(Args.cfg);
 
 	/* Vectors with PSF centers */
 	countPSF = mParms.nPSFX * mParms.nPSFY;	// total number of PSFs
@@ -72,7 +72,8 @@ int multiRoutine(config_t cfg, const char *filename, gsl_rng * r)
 
 	/* Opening output files and initial photon number set to zero */
 	FILE *fileOut[countPSF][2];
-	int nphot[countPSF][2];
+	int nphot[countPSF][NCHANNELS];
+	memset(nphot, 0, sizeof(nphot));
 
 	if (cParms.sChannel[0].status == 1) {
 		for (nPSF = 0; nPSF < countPSF; nPSF++) {
@@ -80,7 +81,7 @@ int multiRoutine(config_t cfg, const char *filename, gsl_rng * r)
 			fileOut[nPSF][0] = fopen(outname, "w");
 			if (fileOut[nPSF][0] == NULL) {
 				fprintf(stderr, "Error opening output file.\n");
-				fclose(fileIn);
+				closeTrajectory(fileIn);
 				exit(1);
 			}
 			nphot[nPSF][0] = 0;
@@ -93,7 +94,7 @@ int multiRoutine(config_t cfg, const char *filename, gsl_rng * r)
 			fileOut[nPSF][1] = fopen(outname, "w");
 			if (fileOut[nPSF][1] == NULL) {
 				fprintf(stderr, "Error opening output file.\n");
-				fclose(fileIn);
+				closeTrajectory(fileIn);
 				exit(1);
 			}
 			nphot[nPSF][1] = 0;
@@ -104,7 +105,11 @@ int multiRoutine(config_t cfg, const char *filename, gsl_rng * r)
 	printLogo();
 	printf("\n");
 	printf("%s %s starting in multi mode.\n", PROGNAME, VERSION);
-	printf("  Reading input file %s\n", filename);
+	printf("  Reading input file %s\n", Args.filename);
+	printf("  Emitting photons on %d threads, random seed %lu\n", Args.nthreads, Args.seed);
+	if (Args.blockcolumns > 0 && Args.blockcolumns < mParms.nPSFX) {
+		printf("  Emitting each time step in blocks of %d PSF columns\n", Args.blockcolumns);
+	}
 	if (cParms.sChannel[0].status == 1) {
 		printf("  Writing %d output files for channel 0\n", countPSF);
 	}
@@ -143,64 +148,54 @@ int multiRoutine(config_t cfg, const char *filename, gsl_rng * r)
 	}
 	printf("\n");
 
-	/* Photon emission routine */
-	while (fscanf(fileIn, "%s %f %f %f\n", molname, &x, &y, &z) != EOF) {
-		if (x == 100) {
-			prog = 100 * (y / z);
-			printf("Progress: %.1f%%\r", prog);
-			for (nPSF = 0; nPSF < countPSF; nPSF++) {
-				if (cParms.sChannel[0].status == 1) {
-					nphot[nPSF][0] += noiseGenerator(nphot[nPSF][0], cParms.noise, r);
-					fprintf(fileOut[nPSF][0], "%d\n", nphot[nPSF][0]);
-					nphot[nPSF][0] = 0;
-				}
-				if (cParms.sChannel[1].status == 1) {
-					nphot[nPSF][1] += noiseGenerator(nphot[nPSF][1], cParms.noise, r);
-					fprintf(fileOut[nPSF][1], "%d\n", nphot[nPSF][1]);
-					nphot[nPSF][1] = 0;
-				}
+	/* Photon emission routine, PSFs are numbered along y first as in index.txt. Time
+	 * steps, or blocks of PSF columns of them, are emitted on a pool of threads, each
+	 * with its own copy of the grid. */
+	struct psfGrid *grid = newPSFGrid(mParms.nPSFX, centerx, mParms.nPSFY, centery, mParms.centerz);
+	writer = startWriter();
+	pool = startFramePool(fileIn, &cParms, grid, Args.blockcolumns, Args.nthreads, r);
+	for (;;) {
+		while ((job = takeJob(pool)) != NULL) {
+			submitJob(pool, job);
+		}
+		if ((job = finishedJob(pool)) == NULL) {
+			break;
+		}
+		frame = job->frame;
+
+		/* Photons of all molecules in each PSF, those out of the PSF cutoff emit none */
+		nevals += (long)frame->nmols * countPSF;
+		nskipped += job->skipped;
+		for (nPSF = 0; nPSF < countPSF; nPSF++) {
+			nphot[nPSF][0] += job->nphot[nPSF][0];
+			nphot[nPSF][1] += job->nphot[nPSF][1];
+		}
+
+		/* Time step separator */
+		prog = 100 * (frame->iter / frame->total);
+		printf("Progress: %.1f%%\r", prog);
+		streamRng(r, frame->index, RNG_NOISE);
+		for (nPSF = 0; nPSF < countPSF; nPSF++) {
+			if (cParms.sChannel[0].status == 1) {
+				nphot[nPSF][0] += noiseGenerator(nphot[nPSF][0], cParms.noise, r);
+				queueCount(writer, fileOut[nPSF][0], nphot[nPSF][0]);
+				nphot[nPSF][0] = 0;
 			}
-		} else {
-			for (nPSF = 0; nPSF < countPSF; nPSF++) {
-				if (cParms.sChannel[0].status == 1) {
-					for (int i = 0; i < cParms.sChannel[0].nmols; i++) {
-						if (!strcmp(molname, cParms.sChannel[0].mols[i])) {
-							nphot[nPSF][0] +=
-							    gaussPSF(x, y, z,
-								     cParms.w_xy,
-								     cParms.w_z,
-								     center
-								     [nPSF][0],
-								     center
-								     [nPSF][1],
-								     mParms.centerz,
-								     cParms.nevents, cParms.sChannel[0].q[i], r);
-						}
-					}
-				}
-				if (cParms.sChannel[1].status == 1) {
-					for (int i = 0; i < cParms.sChannel[1].nmols; i++) {
-						if (!strcmp(molname, cParms.sChannel[1].mols[i])) {
-							nphot[nPSF][1] +=
-							    gaussPSF(x, y, z,
-								     cParms.w_xy,
-								     cParms.w_z,
-								     center
-								     [nPSF][0],
-								     center
-								     [nPSF][1],
-								     mParms.centerz,
-								     cParms.nevents, cParms.sChannel[1].q[i], r);
-						}
-					}
-				}
+			if (cParms.sChannel[1].status == 1) {
+				nphot[nPSF][1] += noiseGenerator(nphot[nPSF][1], cParms.noise, r);
+				queueCount(writer, fileOut[nPSF][1], nphot[nPSF][1]);
+				nphot[nPSF][1] = 0;
 			}
 		}
 	}
 
 	printf("\n");
+	printCutoff(cParms.cutoff2, nskipped, nevals);
 	/* Close and destroy file pointers */
-	fclose(fileIn);
+	stopFramePool(pool);
+	stopWriter(writer);
+	freePSFGrid(grid);
+	closeTrajectory(fileIn);
 	for (nPSF = 0; nPSF < countPSF; nPSF++) {
 		if (cParms.sChannel[0].status == 1) {
 			fclose(fileOut[nPSF][0]);
@@ -30,14 +30,28 @@ struct args parseArgs(int argc, char **argv)
 	struct args Args;
 
 	/* Command line options */
-	struct arg_file *infile = arg_file1(NULL, NULL, "<input>", "input position file");
+	struct arg_file *infile = arg_filen(NULL, NULL, "<input>", 1, MAX_INPUTS,
+					    "input position file(s), - for standard input");
 	struct arg_file *config = arg_file1("c", "config", "<config file>", "configuration file");
 	struct arg_lit *help = arg_lit0(NULL, "help", "print this help and exit");
 	struct arg_str *mode = arg_str1("m", "mode", "<point,multi,line,raster>", "sampling mode");
+	struct arg_int *threads = arg_int0("j", "threads", "<n>", "threads parsing text input (default 1)");
+	struct arg_int *first = arg_int0(NULL, "first-frame", "<n>", "first time step to read, counting from 0");
+	struct arg_int *last = arg_int0(NULL, "last-frame", "<n>", "last time step to read (default last in file)");
+	struct arg_lit *follow = arg_lit0(NULL, "follow", "keep reading a file that is still being written");
+	struct arg_int *procs = arg_int0("P", "processes", "<n>", "ensemble runs at a time (default number of CPUs)");
+	struct arg_lit *sum = arg_lit0(NULL, "sum", "sum ensemble count traces and images instead of averaging them");
+	struct arg_str *kernel = arg_str0(NULL, "kernel", "<isa>", "PSF kernel: auto, scalar, avx2 or avx512 (default auto)");
+	struct arg_int *emitters = arg_int0("t", "emit-threads", "<n>", "threads emitting photons (default 1)");
+	struct arg_int *block = arg_int0(NULL, "detector-block", "<n>", "PSF columns per emission task in multi mode (default all)");
+	struct arg_int *nimages = arg_int0(NULL, "image-buffer", "<n>", "TIFF images, or carpet lines, the routine may fill ahead of the TIFF writer (default 2)");
+	struct arg_str *seed = arg_str0(NULL, "seed", "<n>", "random seed, to repeat a run exactly (default from the clock)");
 	struct arg_lit *version = arg_lit0(NULL, "version", "print version information and exit");
 	struct arg_end *end = arg_end(20);
 	int nerrors;
-	void *argtable[] = { infile, mode, config, help, version, end };
+	void *argtable[] = { infile, mode, config, threads, emitters, block, nimages, seed, first, last, follow, procs, sum,
+		kernel, help, version, end
+	};
 
 	/* Verify the argtable[] entries were allocated sucessfully */
 	if (arg_nullcheck(argtable) != 0) {
@@ -56,6 +70,9 @@ struct args parseArgs(int argc, char **argv)
 		printf("FERNET: Fluorescence Emission Recipes and NumErical routines Network.\n");
 		printf("This program evaluates the emision of photons in different fluorescence experiments.\n");
 		printf("The input file must have the positions of each molecule in each time step.\n");
+		printf("Run '%s convert --help' to convert it into the faster binary format.\n", argv[0]);
+		printf("Run '%s index --help' to index it for runs starting at any time step.\n", argv[0]);
+		printf("Several input files, or a quoted pattern such as 'seed_*.txt', are run as an ensemble.\n");
 		arg_print_glossary(stdout, argtable, "  %-35s %s\n");
 		exit(0);
 	}
@@ -87,9 +104,85 @@ struct args parseArgs(int argc, char **argv)
 		exit(1);
 	}
 
-	Args.filename = infile->filename[0];
+	/* Input files, patterns are expanded here so they also work when quoted */
+	Args.ensemble.nfiles = 0;
+	Args.ensemble.filenames = NULL;
+	for (int i = 0; i < infile->count; i++) {
+		const char *name = infile->filename[i];
+		glob_t matches;
+		if (strpbrk(name, "*?[") != NULL && glob(name, 0, NULL, &matches) == 0) {
+			Args.ensemble.filenames = (char **)realloc(Args.ensemble.filenames,
+								   (Args.ensemble.nfiles + matches.gl_pathc) * sizeof(char *));
+			for (size_t j = 0; j < matches.gl_pathc; j++) {
+				Args.ensemble.filenames[Args.ensemble.nfiles++] = strdup(matches.gl_pathv[j]);
+			}
+			globfree(&matches);
+		} else {
+			Args.ensemble.filenames = (char **)realloc(Args.ensemble.filenames,
+								   (Args.ensemble.nfiles + 1) * sizeof(char *));
+			Args.ensemble.filenames[Args.ensemble.nfiles++] = strdup(name);
+		}
+	}
+	Args.ensemble.nprocs = procs->count > 0 ? procs->ival[0] : sysconf(_SC_NPROCESSORS_ONLN);
+	Args.ensemble.sum = sum->count > 0;
+	if (Args.ensemble.nprocs < 1) {
+		fprintf(stderr, "The number of processes must be at least 1.\n");
+		exit(1);
+	}
+	if (Args.ensemble.nfiles > 1) {
+		for (int i = 0; i < Args.ensemble.nfiles; i++) {
+			if (!strcmp(Args.ensemble.filenames[i], "-")) {
+				fprintf(stderr, "Standard input can not be part of an ensemble.\n");
+				exit(1);
+			}
+		}
+	}
+
+	Args.filename = Args.ensemble.filenames[0];
 	Args.mode = *mode->sval;
 	Args.cfg = cfg;
+	Args.input.nthreads = threads->count > 0 ? threads->ival[0] : 1;
+	if (Args.input.nthreads < 1) {
+		fprintf(stderr, "The number of threads must be at least 1.\n");
+		exit(1);
+	}
+	Args.nthreads = emitters->count > 0 ? emitters->ival[0] : 1;
+	if (Args.nthreads < 1) {
+		fprintf(stderr, "The number of emission threads must be at least 1.\n");
+		exit(1);
+	}
+	Args.blockcolumns = block->count > 0 ? block->ival[0] : 0;
+	if (Args.blockcolumns < 0) {
+		fprintf(stderr, "The detector block can not have a negative number of columns.\n");
+		exit(1);
+	}
+	Args.nimages = nimages->count > 0 ? nimages->ival[0] : IMAGE_BUFFER;
+	if (Args.nimages < 1) {
+		fprintf(stderr, "The image buffer must hold at least 1 image.\n");
+		exit(1);
+	}
+	Args.seed = rand();
+	if (seed->count > 0) {
+		char *tail;
+		errno = 0;
+		Args.seed = strtoul(seed->sval[0], &tail, 0);
+		if (errno != 0 || tail == seed->sval[0] || *tail != '\0') {
+			fprintf(stderr, "Invalid random seed '%s'.\n", seed->sval[0]);
+			exit(1);
+		}
+	}
+	Args.input.first = first->count > 0 ? first->ival[0] : 0;
+	Args.input.last = last->count > 0 ? last->ival[0] : -1;
+	Args.input.follow = follow->count > 0;
+	Args.input.nspecies = 0;
+	Args.input.species = NULL;
+	if (Args.input.first < 0 || (last->count > 0 && Args.input.last < Args.input.first)) {
+		fprintf(stderr, "Invalid range of time steps: %ld to %ld.\n", Args.input.first, Args.input.last);
+		exit(1);
+	}
+
+	/* PSF kernel, the widest instruction set of the CPU by default */
+	selectKernel(kernel->count > 0 ? kernel->sval[0] : "auto");
 
 	/* Free table */
 	arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
@@ -26,7 +26,7 @@
  * Parse common parameters from config file
  ***********************************************************************************/
 
-struct commonParms parseCommon(config_t cfg, FILE * fileIn)
+struct commonParms parseCommon(config_t cfg, struct trajectory *fileIn)
 {
 	struct commonParms cParms;
 
@@ -56,6 +56,15 @@ struct commonParms parseCommon(config_t cfg, FILE * fileIn)
 		cParms.sChannel[1] = parseChannel(pChann1, cParms.kappa);
 	}
 
+	/* Dense q lookup by species ID and channel, names are resolved once here */
+	cParms.qchannels = calloc(UINT16_MAX + 1, sizeof(*cParms.qchannels));
+	for (int c = 0; c < NCHANNELS; c++) {
+		struct channelInfo *chan = &cParms.sChannel[c];
+		for (int i = 0; chan->status == 1 && i < chan->nmols; i++) {
+			cParms.qchannels[internSpecies(fileIn, chan->mols[i], strlen(chan->mols[i]))][c] += chan->q[i];
+		}
+	}
+
 	/* Get w_xy waist */
 	if (!config_setting_lookup_float(common, "w_xy", &cParms.w_xy)) {
 		parseError("w_xy");
@@ -71,8 +80,62 @@ struct commonParms parseCommon(config_t cfg, FILE * fileIn)
 		parseError("noise_on");
 	}
 
-	/* Parse input file header */
-	fscanf(fileIn, "%f %f\n", &cParms.simu_dt, &cParms.mD);
+	/* Get PSF cutoff, as a radius in waists or as the PSF value at that radius */
+	double cutoff, epsilon;
+	int hascutoff = config_setting_lookup_float(common, "psf_cutoff", &cutoff);
+	int hasepsilon = config_setting_lookup_float(common, "psf_epsilon", &epsilon);
+	cParms.cutoff2 = INFINITY;
+	if (hascutoff && hasepsilon) {
+		fprintf(stderr, "Set either psf_cutoff or psf_epsilon in configuration file, not both.\n");
+		exit(1);
+	} else if (hascutoff) {
+		if (cutoff <= 0) {
+			parseError("psf_cutoff");
+		}
+		cParms.cutoff2 = cutoff * cutoff;
+	} else if (hasepsilon) {
+		if (epsilon <= 0 || epsilon >= 1) {
+			parseError("psf_epsilon");
+		}
+		cParms.cutoff2 = log(1 / epsilon) / 2;
+	}
+
+	/* Get photon sampling, exact per molecule or aggregated per detector */
+	const char *sampling;
+	cParms.sampling = SAMPLING_EXACT;
+	if (config_setting_lookup_string(common, "sampling", &sampling)) {
+		if (!strcmp(sampling, "aggregate")) {
+			cParms.sampling = SAMPLING_AGGREGATE;
+		} else if (strcmp(sampling, "exact")) {
+			parseError("sampling");
+		}
+	}
+
+	/* Get PSF model, the Gaussian unless a tabulated one is given */
+	const char *psffile = NULL;
+	cParms.PSFtype = "gauss";
+	config_setting_lookup_string(common, "psf_type", &cParms.PSFtype);
+	config_setting_lookup_string(common, "psf_file", &psffile);
+	cParms.table = newPSFTable(cParms.PSFtype, psffile, cParms.w_xy, cParms.w_z,
+				   isfinite(cParms.cutoff2) ? sqrt(cParms.cutoff2) : PSF_TABLE_RANGE);
+
+	/* Get time step and maximum D from input file header. The configuration file
+	 * may override them, and must give them for MCell visualization output. */
+	double value;
+	cParms.simu_dt = fileIn->simu_dt;
+	cParms.mD = fileIn->mD;
+	if (config_setting_lookup_float(common, "simu_dt", &value)) {
+		cParms.simu_dt = value;
+	}
+	if (config_setting_lookup_float(common, "mD", &value)) {
+		cParms.mD = value;
+	}
+	if (cParms.simu_dt <= 0) {
+		parseError("simu_dt");
+	}
+	if (cParms.mD <= 0) {
+		parseError("mD");
+	}
 	cParms.nevents = round(cParms.simu_dt / cParms.kappa);
 	double tauD = (cParms.w_xy * cParms.w_xy) / (4 * cParms.mD * 1e8);
 	if (tauD < 10 * cParms.simu_dt) {
@@ -86,6 +149,63 @@ struct commonParms parseCommon(config_t cfg, FILE * fileIn)
 	return cParms;
 }
 
+/***********************************************************************************
+ * Collect the molecule names of the channels that are on, so the trajectory can
+ * drop the molecules of every other species while parsing
+ ***********************************************************************************/
+
+void parseSpecies(config_t cfg, struct inputOptions *input)
+{
+	config_setting_t *common = config_lookup(&cfg, "common");
+	const char *channels[] = { "channel0", "channel1" };
+	struct channelInfo chan;
+
+	input->nspecies = 0;
+	input->species = NULL;
+	for (int c = 0; c < NCHANNELS && common != NULL; c++) {
+		config_setting_t *pChan = config_setting_get_member(common, channels[c]);
+		if (pChan == NULL) {
+			continue;
+		}
+		chan = parseChannel(pChan, 0);
+		for (int i = 0; chan.status == 1 && i < chan.nmols; i++) {
+			input->species = (const char **)realloc(input->species, (input->nspecies + 1) * sizeof(char *));
+			input->species[input->nspecies++] = chan.mols[i];
+		}
+	}
+}
+
+/***********************************************************************************
+ * Check that all trajectories of an ensemble share the time step, which is read
+ * from the header of the first one by parseCommon in every run
+ ***********************************************************************************/
+void checkEnsemble(struct args Args)
+{
+	config_setting_t *common = config_lookup(&Args.cfg, "common");
+	struct inputOptions options = { 1, 0, -1, 0 };
+	struct trajectory *fileIn;
+	float simu_dt = 0;
+	double value;
+
+	/* A time step from the config file applies to every run */
+	if (common != NULL && config_setting_lookup_float(common, "simu_dt", &value)) {
+		return;
+	}
+
+	for (int i = 0; i < Args.ensemble.nfiles; i++) {
+		fileIn = openTrajectory(Args.ensemble.filenames[i], options);
+		if (i == 0) {
+			simu_dt = fileIn->simu_dt;
+		} else if (fileIn->simu_dt != simu_dt) {
+			fprintf(stderr, "Time step of %s (%g s) differs from the one of %s (%g s).\n",
+				Args.ensemble.filenames[i], fileIn->simu_dt, Args.ensemble.filenames[0], simu_dt);
+			closeTrajectory(fileIn);
+			exit(1);
+		}
+		closeTrajectory(fileIn);
+	}
+}
+
 /***********************************************************************************
  * Parse point mode parameters from config file
  ***********************************************************************************/
@@ -23,49 +23,438 @@
 #include "fernet.h"
 
 /***********************************************************************************
- * Checks if a molecule emits photons
+ * Checks if a molecule emits photons. Each of the nevents excitation events in a
+ * time step is absorbed with probability g, the PSF at the molecule, and then
+ * emitted with probability q. The photon count is therefore Binomial(nevents, g q),
+ * which is drawn at once instead of event by event.
  ***********************************************************************************/
 
+static int emitPhotons(double g, int nevents, double q, struct rng *r)
+{
+	double p = g * (q < 1 ? q : 1);
+
+	if (p <= 0 || nevents <= 0) {
+		return 0;
+	}
+	if (p >= 1) {
+		return nevents;
+	}
+	return rngBinomial(r, p, nevents);
+}
+
+/***********************************************************************************
+ * Aggregate sampling. When g q is small for every molecule, the sum of their
+ * binomial counts is close to a Poisson count with the same mean, the sum of
+ * nevents g q. Routines then add up these means over a time step and draw once per
+ * detector. The total variation distance to the exact counts is below
+ * min(1, 1 / mean) times the sum of nevents (g q)^2 (Le Cam, Barbour and Hall),
+ * that is below the largest g q of any molecule.
+ ***********************************************************************************/
+
+static double expectedPhotons(double g, int nevents, double q)
+{
+	double p = g * (q < 1 ? q : 1);
+
+	if (p <= 0 || nevents <= 0) {
+		return 0;
+	}
+	return nevents * (p < 1 ? p : 1);
+}
+
+int samplePhotons(double mean, struct rng *r)
+{
+	return mean > 0 ? gsl_ran_poisson(r->gsl, mean) : 0;
+}
+
 int gaussPSF(double x, double y, double z, double w_xy, double w_z,
-	     double sx, double sy, double sz, int nevents, double q, gsl_rng * r)
+	     double sx, double sy, double sz, int nevents, double q, struct rng *r)
 {
-	double g, prob_abs, prob_emit;
-	int phot = 0;
+	double g;
 
 	g = exp(-2 * ((x - sx) * (x - sx) + (y - sy) * (y - sy)) /
 		(w_xy * w_xy) - 2 * ((z - sz) * (z - sz)) / (w_z * w_z));
 
-	for (int i = 0; i < nevents; i++) {
-		prob_abs = gsl_rng_uniform(r);
-		prob_emit = gsl_rng_uniform(r);
-		if (g > prob_abs && prob_emit < q) {
-			phot++;
+	return emitPhotons(g, nevents, q, r);
+}
+
+/***********************************************************************************
+ * Gaussian PSF observed by every channel at once. The PSF value g only depends on
+ * the geometry, so it is computed once and photons are drawn for each channel with
+ * its own q, in channel order. Channels with q = 0 draw nothing, and no exp() is
+ * computed when the species emits in none of them.
+ ***********************************************************************************/
+
+void gaussPSFChannels(double x, double y, double z, double w_xy, double w_z,
+		      double sx, double sy, double sz, int nevents, const double *q, int *nphot,
+		      struct rng *r)
+{
+	double g;
+	int c;
+
+	for (c = 0; c < NCHANNELS && q[c] <= 0; c++) ;
+	if (c == NCHANNELS) {
+		return;
+	}
+
+	g = exp(-2 * ((x - sx) * (x - sx) + (y - sy) * (y - sy)) /
+		(w_xy * w_xy) - 2 * ((z - sz) * (z - sz)) / (w_z * w_z));
+
+	for (; c < NCHANNELS; c++) {
+		if (q[c] > 0) {
+			nphot[c] += emitPhotons(g, nevents, q[c], r);
 		}
 	}
-	return phot;
 }
 
-int spimPSF(double z, double w_z, double sz, int nevents, double q, gsl_rng * r)
+/***********************************************************************************
+ * Photons of every molecule of a frame from one Gaussian PSF, in every channel.
+ * PSF values are computed a block of molecules at a time by the selected kernel,
+ * then photons are drawn molecule by molecule, in the order of the frame, for each
+ * channel that lists the species. In aggregate sampling their expected photons
+ * are added up instead and drawn once per channel. Returns the molecules beyond
+ * the PSF cutoff.
+ ***********************************************************************************/
+
+long psfFrame(const struct frame *frame, double sx, double sy, double sz, const struct commonParms *cParms,
+	      int *nphot, struct rng *r)
 {
-	double g, prob_abs, prob_emit;
-	int phot = 0;
-	g = exp(-2 * ((z - sz) * (z - sz)) / (w_z * w_z));
+	struct psfGeometry geo = { sx, sy, sz, cParms->w_xy, cParms->w_z, cParms->cutoff2, cParms->table };
+	double g[PSF_BLOCK], mean[NCHANNELS] = { 0 };
+	int aggregate = cParms->sampling == SAMPLING_AGGREGATE;
+	long skipped = 0;
+
+	for (int start = 0; start < frame->nmols; start += PSF_BLOCK) {
+		int n = frame->nmols - start < PSF_BLOCK ? frame->nmols - start : PSF_BLOCK;
+
+		skipped += psfValues(frame->x + start, frame->y + start, frame->z + start, n, &geo, g);
+		for (int m = 0; m < n; m++) {
+			const double *q = cParms->qchannels[frame->species[start + m]];
+			if (g[m] <= 0) {
+				continue;
+			}
+			for (int c = 0; c < NCHANNELS; c++) {
+				if (q[c] > 0 && aggregate) {
+					mean[c] += expectedPhotons(g[m], cParms->nevents, q[c]);
+				} else if (q[c] > 0) {
+					nphot[c] += emitPhotons(g[m], cParms->nevents, q[c], r);
+				}
+			}
+		}
+	}
+	for (int c = 0; aggregate && c < NCHANNELS; c++) {
+		nphot[c] += samplePhotons(mean[c], r);
+	}
+	return skipped;
+}
+
+/***********************************************************************************
+ * Photons of a frame in a grid of Gaussian PSFs. The Gaussian is the product of one
+ * factor per axis, exp(-2 dx^2 / w_xy^2) exp(-2 dy^2 / w_xy^2) exp(-2 dz^2 / w_z^2),
+ * and every PSF of a column shares its x factor and every PSF of a row its y
+ * factor. The selected kernel computes the factors of a block of molecules, and
+ * the value at each center is their product. The cutoff is checked on that value,
+ * which is below exp(-2 cutoff2) exactly when the molecule is further than the
+ * cutoff. The PSF of index i ny + j is centered at (centerx[i], centery[j]), both
+ * evenly spaced, increasing or decreasing as dx and dy are positive or negative,
+ * and photons are added to nphot[i ny + j].
+ *
+ * With a cutoff, molecules are first sorted into the cells of the grid, one cell
+ * around each center. The molecules of a cell can only reach the columns and rows
+ * within the cutoff radius of it, so only those factors and products are computed,
+ * and molecules beyond the cutoff of the outermost centers are dropped at once.
+ * In aggregate sampling every PSF draws once per channel after all the cells.
+ *
+ * psfGridColumns only emits in the PSFs of columns c0 to c1, so that blocks of
+ * columns can be emitted by different threads from the same frame. Molecules out
+ * of reach of those columns are dropped before binning, and skipped evaluations
+ * are only counted in its PSFs, so the blocks of a grid add up to the whole of it.
+ ***********************************************************************************/
+
+struct psfGrid *newPSFGrid(int nx, const double *centerx, int ny, const double *centery, double sz)
+{
+	struct psfGrid *grid = (struct psfGrid *)malloc(sizeof(struct psfGrid));
+
+	grid->nx = nx;
+	grid->ny = ny;
+	grid->centerx = (double *)malloc(nx * sizeof(double));
+	grid->centery = (double *)malloc(ny * sizeof(double));
+	memcpy(grid->centerx, centerx, nx * sizeof(double));
+	memcpy(grid->centery, centery, ny * sizeof(double));
+	grid->sz = sz;
+	grid->zeros = (float *)calloc(PSF_BLOCK, sizeof(float));
+	grid->fx = (double *)malloc(nx * PSF_BLOCK * sizeof(double));
+	grid->fy = (double *)malloc(ny * PSF_BLOCK * sizeof(double));
+	grid->fz = (double *)malloc(PSF_BLOCK * sizeof(double));
+	grid->g = (double *)malloc(PSF_BLOCK * sizeof(double));
+	grid->cells = (int *)malloc((nx * ny + 1) * sizeof(int));
+	grid->mean = calloc(nx * ny, sizeof(*grid->mean));
+	grid->capacity = 0;
+	grid->cell = NULL;
+	grid->sorted.species = NULL;
+	grid->sorted.x = grid->sorted.y = grid->sorted.z = NULL;
+
+	return grid;
+}
+
+void freePSFGrid(struct psfGrid *grid)
+{
+	free(grid->centerx);
+	free(grid->centery);
+	free(grid->zeros);
+	free(grid->fx);
+	free(grid->fy);
+	free(grid->fz);
+	free(grid->g);
+	free(grid->cells);
+	free(grid->mean);
+	free(grid->cell);
+	free(grid->sorted.species);
+	free(grid->sorted.x);
+	free(grid->sorted.y);
+	free(grid->sorted.z);
+	free(grid);
+}
+
+/* Photons of len molecules with PSF values g in one PSF, those with g below gmin are skipped */
+static long gridPhotons(const double *g, const uint16_t *species, int len, double gmin,
+			const struct commonParms *cParms, int *counts, double *mean, struct rng *r)
+{
+	int aggregate = cParms->sampling == SAMPLING_AGGREGATE;
+	long skipped = 0;
+
+	for (int m = 0; m < len; m++) {
+		if (g[m] < gmin) {
+			skipped++;
+			continue;
+		}
+		if (g[m] <= 0) {
+			continue;
+		}
+		const double *q = cParms->qchannels[species[m]];
+		for (int c = 0; c < NCHANNELS; c++) {
+			if (q[c] > 0 && aggregate) {
+				mean[c] += expectedPhotons(g[m], cParms->nevents, q[c]);
+			} else if (q[c] > 0) {
+				counts[c] += emitPhotons(g[m], cParms->nevents, q[c], r);
+			}
+		}
+	}
+	return skipped;
+}
+
+/* Photons of n molecules in the PSFs of columns i0 to i1 and rows j0 to j1 */
+static long psfGridBlock(struct psfGrid *grid, const struct frame *mols, int first, int n, int i0, int i1,
+			 int j0, int j1, const struct commonParms *cParms, int (*nphot)[NCHANNELS], struct rng *r)
+{
+	struct psfGeometry geo = { 0, 0, 0, cParms->w_xy, cParms->w_z, INFINITY, NULL };
+	double gmin = exp(-2 * cParms->cutoff2);
+	long skipped = 0;
+
+	for (int start = first; start < first + n; start += PSF_BLOCK) {
+		int len = first + n - start < PSF_BLOCK ? first + n - start : PSF_BLOCK;
 
-	for (int i = 0; i < nevents; i++) {
-		prob_abs = gsl_rng_uniform(r);
-		prob_emit = gsl_rng_uniform(r);
-		if (g > prob_abs && prob_emit < q) {
-			phot++;
+		/* Tabulated PSFs are not separable, they are looked up in each PSF */
+		if (cParms->table != NULL) {
+			struct psfGeometry tgeo = { 0, 0, grid->sz, cParms->w_xy, cParms->w_z, cParms->cutoff2, cParms->table };
+			for (int i = i0; i <= i1; i++) {
+				tgeo.sx = grid->centerx[i];
+				for (int j = j0; j <= j1; j++) {
+					tgeo.sy = grid->centery[j];
+					skipped += psfValues(mols->x + start, mols->y + start, mols->z + start, len, &tgeo, grid->g);
+					skipped += gridPhotons(grid->g, mols->species + start, len, 0, cParms,
+							       nphot[i * grid->ny + j], grid->mean[i * grid->ny + j], r);
+				}
+			}
+			continue;
 		}
+
+		/* One factor per axis and center, the other two coordinates are at the center */
+		for (int i = i0; i <= i1; i++) {
+			geo.sx = grid->centerx[i];
+			psfValues(mols->x + start, grid->zeros, grid->zeros, len, &geo, grid->fx + (i - i0) * PSF_BLOCK);
+		}
+		geo.sx = 0;
+		for (int j = j0; j <= j1; j++) {
+			geo.sy = grid->centery[j];
+			psfValues(grid->zeros, mols->y + start, grid->zeros, len, &geo, grid->fy + (j - j0) * PSF_BLOCK);
+		}
+		geo.sy = 0;
+		geo.sz = grid->sz;
+		psfValues(grid->zeros, grid->zeros, mols->z + start, len, &geo, grid->fz);
+		geo.sz = 0;
+
+		for (int i = i0; i <= i1; i++) {
+			const double *fx = grid->fx + (i - i0) * PSF_BLOCK;
+			for (int j = j0; j <= j1; j++) {
+				const double *fy = grid->fy + (j - j0) * PSF_BLOCK;
+				for (int m = 0; m < len; m++) {
+					grid->g[m] = fx[m] * fy[m] * grid->fz[m];
+				}
+				skipped += gridPhotons(grid->g, mols->species + start, len, gmin, cParms,
+						       nphot[i * grid->ny + j], grid->mean[i * grid->ny + j], r);
+			}
+		}
+	}
+	return skipped;
+}
+
+/* Cell of a coordinate along one axis of the grid, and the cells reached from it.
+ * The pitch keeps its sign, so centers may decrease along the axis. */
+static int gridCell(double u, const double *center, int n, double pitch)
+{
+	long k = pitch != 0 ? lround((u - center[0]) / pitch) : 0;
+
+	return k < 0 ? 0 : (k >= n ? n - 1 : k);
+}
+
+static int gridReach(double radius, int n, double pitch)
+{
+	double k = pitch != 0 ? ceil(radius / fabs(pitch) + 0.5) : n;
+
+	return k < n ? k : n - 1;
+}
+
+static long psfGridCells(struct psfGrid *grid, const struct frame *frame, int c0, int c1,
+			 const struct commonParms *cParms, int (*nphot)[NCHANNELS], struct rng *r)
+{
+	int nx = grid->nx, ny = grid->ny, ncells = nx * ny, npsf = (c1 - c0 + 1) * ny;
+	double pitchx = nx > 1 ? (grid->centerx[nx - 1] - grid->centerx[0]) / (nx - 1) : 0;
+	double pitchy = ny > 1 ? (grid->centery[ny - 1] - grid->centery[0]) / (ny - 1) : 0;
+	double rxy = sqrt(cParms->cutoff2) * cParms->w_xy, rz = sqrt(cParms->cutoff2) * cParms->w_z;
+	int kx = gridReach(rxy, nx, pitchx), ky = gridReach(rxy, ny, pitchy);
+	int bin = kx < nx - 1 || ky < ny - 1;
+	double xmin = fmin(grid->centerx[c0], grid->centerx[c1]) - rxy;
+	double xmax = fmax(grid->centerx[c0], grid->centerx[c1]) + rxy;
+	double ymin = fmin(grid->centery[0], grid->centery[ny - 1]) - rxy;
+	double ymax = fmax(grid->centery[0], grid->centery[ny - 1]) + rxy;
+	long skipped = 0;
+
+	/* Without a cutoff every molecule reaches every PSF */
+	if (!isfinite(cParms->cutoff2) || ncells == 1) {
+		return psfGridBlock(grid, frame, 0, frame->nmols, c0, c1, 0, ny - 1, cParms, nphot, r);
+	}
+
+	if (frame->nmols > grid->capacity) {
+		grid->capacity = frame->nmols;
+		grid->cell = (int *)realloc(grid->cell, grid->capacity * sizeof(int));
+		grid->sorted.species = (uint16_t *)realloc(grid->sorted.species, grid->capacity * sizeof(uint16_t));
+		grid->sorted.x = (float *)realloc(grid->sorted.x, grid->capacity * sizeof(float));
+		grid->sorted.y = (float *)realloc(grid->sorted.y, grid->capacity * sizeof(float));
+		grid->sorted.z = (float *)realloc(grid->sorted.z, grid->capacity * sizeof(float));
+	}
+
+	/* Count molecules per cell, those out of reach of every PSF get no cell */
+	memset(grid->cells, 0, (ncells + 1) * sizeof(int));
+	for (int m = 0; m < frame->nmols; m++) {
+		float x = frame->x[m], y = frame->y[m], z = frame->z[m];
+		if (x < xmin || x > xmax || y < ymin || y > ymax || fabs(z - grid->sz) > rz) {
+			grid->cell[m] = -1;
+			skipped += npsf;
+			continue;
+		}
+		/* When every cell reaches the whole grid, all molecules share the first one */
+		grid->cell[m] = bin ? gridCell(x, grid->centerx, nx, pitchx) * ny + gridCell(y, grid->centery, ny, pitchy) : 0;
+		grid->cells[grid->cell[m] + 1]++;
+	}
+
+	/* Molecules of each cell are copied together, in frame order */
+	for (int k = 0; k < ncells; k++) {
+		grid->cells[k + 1] += grid->cells[k];
+	}
+	for (int m = 0; m < frame->nmols; m++) {
+		if (grid->cell[m] >= 0) {
+			int s = grid->cells[grid->cell[m]]++;
+			grid->sorted.species[s] = frame->species[m];
+			grid->sorted.x[s] = frame->x[m];
+			grid->sorted.y[s] = frame->y[m];
+			grid->sorted.z[s] = frame->z[m];
+		}
+	}
+
+	/* After placing, cells[k] is the end of cell k and the start of cell k + 1 */
+	for (int k = 0, first = 0; k < ncells; first = grid->cells[k], k++) {
+		int n = grid->cells[k] - first, i = k / ny, j = k % ny;
+		if (n == 0) {
+			continue;
+		}
+		int i0 = i - kx > c0 ? i - kx : c0, i1 = i + kx < c1 ? i + kx : c1;
+		int j0 = j - ky > 0 ? j - ky : 0, j1 = j + ky < ny - 1 ? j + ky : ny - 1;
+		if (i0 > i1) {
+			skipped += (long)n * npsf;
+			continue;
+		}
+		skipped += (long)n * (npsf - (i1 - i0 + 1) * (j1 - j0 + 1));
+		skipped += psfGridBlock(grid, &grid->sorted, first, n, i0, i1, j0, j1, cParms, nphot, r);
+	}
+	return skipped;
+}
+
+long psfGridFrame(struct psfGrid *grid, const struct frame *frame, const struct commonParms *cParms,
+		  int (*nphot)[NCHANNELS], struct rng *r)
+{
+	return psfGridColumns(grid, frame, 0, grid->nx - 1, cParms, nphot, r);
+}
+
+long psfGridColumns(struct psfGrid *grid, const struct frame *frame, int c0, int c1,
+		    const struct commonParms *cParms, int (*nphot)[NCHANNELS], struct rng *r)
+{
+	int ny = grid->ny;
+	long skipped;
+
+	if (cParms->sampling != SAMPLING_AGGREGATE) {
+		return psfGridCells(grid, frame, c0, c1, cParms, nphot, r);
+	}
+
+	/* Expected photons of every PSF over the time step, then one draw each */
+	memset(grid->mean + c0 * ny, 0, (c1 - c0 + 1) * ny * sizeof(*grid->mean));
+	skipped = psfGridCells(grid, frame, c0, c1, cParms, nphot, r);
+	for (int k = c0 * ny; k < (c1 + 1) * ny; k++) {
+		for (int c = 0; c < NCHANNELS; c++) {
+			nphot[k][c] += samplePhotons(grid->mean[k][c], r);
+		}
+	}
+	return skipped;
+}
+
+int spimPSF(double z, double w_z, double sz, int nevents, double q, struct rng *r)
+{
+	double g;
+	g = exp(-2 * ((z - sz) * (z - sz)) / (w_z * w_z));
+
+	return emitPhotons(g, nevents, q, r);
+}
+
+double spimPSFMean(double z, double w_z, double sz, int nevents, double q)
+{
+	return expectedPhotons(exp(-2 * ((z - sz) * (z - sz)) / (w_z * w_z)), nevents, q);
+}
+
+/***********************************************************************************
+ * Checks if a molecule is further from the PSF center than the cutoff, in waists.
+ * Comparing squared distances is much cheaper than the exp() and the draws of
+ * gaussPSF, so routines call it first.
+ ***********************************************************************************/
+
+int outsidePSF(double x, double y, double z, double w_xy, double w_z,
+	       double sx, double sy, double sz, double cutoff2)
+{
+	return ((x - sx) * (x - sx) + (y - sy) * (y - sy)) / (w_xy * w_xy)
+	    + ((z - sz) * (z - sz)) / (w_z * w_z) > cutoff2;
+}
+
+void printCutoff(double cutoff2, long skipped, long evaluated)
+{
+	if (cutoff2 < INFINITY && evaluated > 0) {
+		printf("  %ld of %ld molecule evaluations out of the PSF cutoff (%.1f%%)\n", skipped, evaluated,
+		       100.0 * skipped / evaluated);
 	}
-	return phot;
 }
 
-int noiseGenerator(int photons, int noise_status, gsl_rng * r)
+int noiseGenerator(int photons, int noise_status, struct rng *r)
 {
 	int noise = 0;
 	if (noise_status) {
-		noise += gsl_ran_poisson(r, sqrt((double)photons)) + gsl_ran_gaussian_tail(r, 0, 1);
+		noise += gsl_ran_poisson(r->gsl, sqrt((double)photons)) + gsl_ran_gaussian_tail(r->gsl, 0, 1);
 	}
 	return noise;
 }
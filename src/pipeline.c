@@ -0,0 +1,541 @@
+/***********************************************************************************
+ *                                                                                 *
+ * FERNET: Fluorescence Emission Recipes and NumErical routines Toolkit            *
+ * Developed by Juan F. Angiolini and Esteban Mocskos                              *
+ * Facultad de Ciencias Exactas y Naturales, UBA                                   *
+ *                                                                                 *
+ * This program is free software; you can redistribute it and/or                   *
+ * modify it under the terms of the GNU General Public License                     *
+ * as published by the Free Software Foundation; either version 2                  *
+ * of the License, or (at your option) any later version.                          *
+ *                                                                                 *
+ * This program is distributed in the hope that it will be useful,                 *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of                  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                   *
+ * GNU General Public License for more details.                                    *
+ *                                                                                 *
+ * You should have received a copy of the GNU General Public License               *
+ * along with this program; if not, write to the Free Software                     *
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. *
+ *                                                                                 *
+ ***********************************************************************************/
+
+
+#include "fernet.h"
+
+/***********************************************************************************
+ * Three stage pipeline shared by every mode. A reader thread fills frame slots
+ * ahead of the emission routine, and a writer thread encodes the output of the
+ * routine (TIFF scanlines and directories, text photon counts). Stages exchange
+ * slots through lock-free single-producer single-consumer rings, so reading,
+ * emission and output overlap without locks. Frames and writes keep their order,
+ * so the output is the same as with a single thread.
+ *
+ * The images of the scanning modes go through an image writer instead, a ring of
+ * TIFF rows with a thread of its own. The emission routine gets time steps back
+ * in order, so it fills the rows in place and commits them in order, and the
+ * thread writes them behind it, at most nimages images behind the newest row
+ * asked for.
+ ***********************************************************************************/
+
+struct ring {			// Lock-free single-producer single-consumer ring
+	unsigned size;
+	unsigned head;		// slots filled, written by the producer only
+	unsigned tail;		// slots drained, written by the consumer only
+	int stop;		// set by the consumer to abandon the producer
+};
+
+struct frameSlot {
+	struct frame frame;
+	int capacity;		// molecules allocated in frame
+	int end;		// no more time steps
+};
+
+struct reader {
+	struct trajectory *traj;
+	struct ring ring;
+	struct frameSlot *slots;
+	int held;		// the emission routine is using the slot at tail
+	unsigned taken;		// slots taken with takeQueuedFrame, from tail on
+	pthread_t thread;
+};
+
+enum job_types { JOB_SCANLINE, JOB_DIRECTORY, JOB_COUNT, JOB_STOP };
+
+struct writeJob {
+	enum job_types type;
+	TIFF *tif;
+	FILE *file;
+	int row, width, height, count;
+	char *data;		// scanline copy
+	int capacity;
+};
+
+struct writer {
+	struct ring ring;
+	struct writeJob jobs[RING_JOBS];
+	pthread_t thread;
+};
+
+struct imageWriter {
+	TIFF *tif;
+	int width, height;	// height 0 for carpets, one image of unknown height
+	long nrows;		// rows buffered, nimages images or carpet lines
+	char *data;		// row k in data + (k % nrows) width
+	long committed;		// rows committed, written by the routine only
+	long written;		// rows written, written by the image thread only
+	int started, stop;
+	pthread_t thread;
+};
+
+static void *readerThread(void *);
+static void *writerThread(void *);
+static void *imageThread(void *);
+static int ringReserve(struct ring *);
+static void ringPublish(struct ring *);
+static void ringAwait(struct ring *);
+static void ringRelease(struct ring *);
+
+/***********************************************************************************
+ * Start reading time steps of traj on a background thread
+ ***********************************************************************************/
+
+struct reader *startReader(struct trajectory *traj)
+{
+	struct reader *reader = (struct reader *)calloc(1, sizeof(struct reader));
+
+	reader->traj = traj;
+	reader->ring.size = RING_FRAMES;
+	while (reader->ring.size < traj->readahead) {
+		reader->ring.size *= 2;
+	}
+	reader->slots = (struct frameSlot *)calloc(reader->ring.size, sizeof(struct frameSlot));
+
+	/* The species table must not move while the emission routine reads it */
+	if (traj->maxspecies < UINT16_MAX + 1) {
+		traj->maxspecies = UINT16_MAX + 1;
+		traj->species = (char **)realloc(traj->species, traj->maxspecies * sizeof(char *));
+	}
+
+	if (pthread_create(&reader->thread, NULL, readerThread, reader) != 0) {
+		fprintf(stderr, "Error starting reader thread.\n");
+		exit(1);
+	}
+
+	return reader;
+}
+
+static void *readerThread(void *arg)
+{
+	struct reader *reader = (struct reader *)arg;
+	struct trajectory *traj = reader->traj;
+	struct frameSlot *slot;
+	struct frame *frame;
+
+	while (ringReserve(&reader->ring)) {
+		slot = &reader->slots[reader->ring.head % reader->ring.size];
+		frame = fetchFrame(traj);
+		if (frame == NULL) {
+			slot->end = 1;
+			ringPublish(&reader->ring);
+			break;
+		}
+
+		/* Float binary frames point into the memory map and stay valid, others are copied */
+		if (traj->binary && traj->quant == NULL) {
+			slot->frame = *frame;
+		} else {
+			if (slot->capacity < frame->nmols) {
+				slot->capacity = frame->nmols;
+				slot->frame.species = (uint16_t *)realloc(slot->frame.species, slot->capacity * sizeof(uint16_t));
+				slot->frame.x = (float *)realloc(slot->frame.x, slot->capacity * sizeof(float));
+				slot->frame.y = (float *)realloc(slot->frame.y, slot->capacity * sizeof(float));
+				slot->frame.z = (float *)realloc(slot->frame.z, slot->capacity * sizeof(float));
+			}
+			memcpy(slot->frame.species, frame->species, frame->nmols * sizeof(uint16_t));
+			memcpy(slot->frame.x, frame->x, frame->nmols * sizeof(float));
+			memcpy(slot->frame.y, frame->y, frame->nmols * sizeof(float));
+			memcpy(slot->frame.z, frame->z, frame->nmols * sizeof(float));
+			slot->frame.nmols = frame->nmols;
+			slot->frame.iter = frame->iter;
+			slot->frame.total = frame->total;
+			slot->frame.index = frame->index;
+			slot->frame.start = frame->start;
+			slot->frame.separator = frame->separator;
+		}
+		slot->end = 0;
+		ringPublish(&reader->ring);
+	}
+
+	return NULL;
+}
+
+/***********************************************************************************
+ * Hand the next time step to the emission routine, releasing the previous one
+ ***********************************************************************************/
+
+struct frame *readQueuedFrame(struct reader *reader)
+{
+	struct frameSlot *slot;
+
+	if (reader->held) {
+		ringRelease(&reader->ring);
+		reader->held = 0;
+	}
+
+	ringAwait(&reader->ring);
+	slot = &reader->slots[reader->ring.tail % reader->ring.size];
+	if (slot->end) {
+		return NULL;
+	}
+	reader->held = 1;
+
+	return &slot->frame;
+}
+
+/***********************************************************************************
+ * Take the next time step while keeping the ones taken before, for routines that
+ * emit several time steps at once. They are released in the order they were taken,
+ * and at most the size of the ring can be held.
+ ***********************************************************************************/
+
+struct frame *takeQueuedFrame(struct reader *reader)
+{
+	struct frameSlot *slot;
+	int spins = 0;
+
+	while (__atomic_load_n(&reader->ring.head, __ATOMIC_ACQUIRE) == reader->taken) {
+		ringPause(&spins);
+	}
+	slot = &reader->slots[reader->taken % reader->ring.size];
+	if (slot->end) {
+		return NULL;
+	}
+	reader->taken++;
+
+	return &slot->frame;
+}
+
+void releaseQueuedFrame(struct reader *reader)
+{
+	ringRelease(&reader->ring);
+}
+
+/***********************************************************************************
+ * Stop the reader thread, which may be ahead of the emission routine, and release
+ * the frame slots
+ ***********************************************************************************/
+
+void stopReader(struct reader *reader)
+{
+	__atomic_store_n(&reader->ring.stop, 1, __ATOMIC_RELEASE);
+	pthread_join(reader->thread, NULL);
+
+	if (!reader->traj->binary || reader->traj->quant != NULL) {
+		for (int i = 0; i < reader->ring.size; i++) {
+			free(reader->slots[i].frame.species);
+			free(reader->slots[i].frame.x);
+			free(reader->slots[i].frame.y);
+			free(reader->slots[i].frame.z);
+		}
+	}
+	free(reader->slots);
+	free(reader);
+}
+
+/***********************************************************************************
+ * Start the output writer thread
+ ***********************************************************************************/
+
+struct writer *startWriter()
+{
+	struct writer *writer = (struct writer *)calloc(1, sizeof(struct writer));
+
+	writer->ring.size = RING_JOBS;
+	if (pthread_create(&writer->thread, NULL, writerThread, writer) != 0) {
+		fprintf(stderr, "Error starting writer thread.\n");
+		exit(1);
+	}
+
+	return writer;
+}
+
+static void *writerThread(void *arg)
+{
+	struct writer *writer = (struct writer *)arg;
+	struct writeJob *job;
+
+	for (;;) {
+		ringAwait(&writer->ring);
+		job = &writer->jobs[writer->ring.tail % writer->ring.size];
+		switch (job->type) {
+		case JOB_SCANLINE:
+			TIFFWriteScanline(job->tif, job->data, job->row, 0);
+			break;
+
+		case JOB_DIRECTORY:
+			TIFFWriteDirectory(job->tif);
+			writeImageTIFFtags(job->tif, job->width, job->height);
+			break;
+
+		case JOB_COUNT:
+			fprintf(job->file, "%d\n", job->count);
+			break;
+
+		case JOB_STOP:
+			return NULL;
+		}
+		ringRelease(&writer->ring);
+	}
+}
+
+/***********************************************************************************
+ * Queue the writing of one 8 bit TIFF scanline, which is copied
+ ***********************************************************************************/
+
+void queueScanline(struct writer *writer, TIFF * tif, const char *buf, int width, int row)
+{
+	struct writeJob *job;
+
+	ringReserve(&writer->ring);
+	job = &writer->jobs[writer->ring.head % writer->ring.size];
+	if (job->capacity < width) {
+		job->capacity = width;
+		job->data = (char *)realloc(job->data, width * sizeof(char));
+	}
+	memcpy(job->data, buf, width * sizeof(char));
+	job->type = JOB_SCANLINE;
+	job->tif = tif;
+	job->row = row;
+	ringPublish(&writer->ring);
+}
+
+/***********************************************************************************
+ * Queue the end of a TIFF image and the tags of the next one
+ ***********************************************************************************/
+
+void queueDirectory(struct writer *writer, TIFF * tif, int width, int height)
+{
+	struct writeJob *job;
+
+	ringReserve(&writer->ring);
+	job = &writer->jobs[writer->ring.head % writer->ring.size];
+	job->type = JOB_DIRECTORY;
+	job->tif = tif;
+	job->width = width;
+	job->height = height;
+	ringPublish(&writer->ring);
+}
+
+/***********************************************************************************
+ * Queue the writing of a photon count line
+ ***********************************************************************************/
+
+void queueCount(struct writer *writer, FILE * file, int count)
+{
+	struct writeJob *job;
+
+	ringReserve(&writer->ring);
+	job = &writer->jobs[writer->ring.head % writer->ring.size];
+	job->type = JOB_COUNT;
+	job->file = file;
+	job->count = count;
+	ringPublish(&writer->ring);
+}
+
+/***********************************************************************************
+ * Wait until every queued write is done and stop the writer thread. Output files
+ * can be closed afterwards.
+ ***********************************************************************************/
+
+void stopWriter(struct writer *writer)
+{
+	ringReserve(&writer->ring);
+	writer->jobs[writer->ring.head % writer->ring.size].type = JOB_STOP;
+	ringPublish(&writer->ring);
+	pthread_join(writer->thread, NULL);
+
+	for (int i = 0; i < RING_JOBS; i++) {
+		free(writer->jobs[i].data);
+	}
+	free(writer);
+}
+
+/***********************************************************************************
+ * Start an image writer for the images of tif, width by height pixels, or for a
+ * carpet when height is 0. Up to nimages images, or carpet lines, are buffered.
+ * Row k of the file is row k % height of image k / height. The thread starts with
+ * the first row asked for, so firstImageRow can still move the start.
+ ***********************************************************************************/
+
+struct imageWriter *startImageWriter(TIFF * tif, int width, int height, int nimages)
+{
+	struct imageWriter *image = (struct imageWriter *)calloc(1, sizeof(struct imageWriter));
+
+	image->tif = tif;
+	image->width = width;
+	image->height = height;
+	image->nrows = (long)(nimages > 0 ? nimages : 1) * (height > 0 ? height : 1);
+	image->data = (char *)calloc(image->nrows * width, sizeof(char));
+
+	return image;
+}
+
+static long imageSequence(struct imageWriter *image, long n, int row)
+{
+	return image->height > 0 ? n * image->height + row : row;
+}
+
+static void startImageThread(struct imageWriter *image)
+{
+	if (!image->started) {
+		image->started = 1;
+		if (pthread_create(&image->thread, NULL, imageThread, image) != 0) {
+			fprintf(stderr, "Error starting image writer thread.\n");
+			exit(1);
+		}
+	}
+}
+
+/***********************************************************************************
+ * Skip the rows before row of image n, for runs that start in the middle of an
+ * image. Must be called before any row is asked for.
+ ***********************************************************************************/
+
+void firstImageRow(struct imageWriter *image, long n, int row)
+{
+	image->written = image->committed = imageSequence(image, n, row);
+}
+
+/***********************************************************************************
+ * Row of image n to fill, zero until it is first filled. Waits while the row is
+ * nimages images or more ahead of the oldest row not written yet. Rows are
+ * committed in order, and committing a row also commits the rows before it that
+ * were never committed, which are written as they are.
+ ***********************************************************************************/
+
+char *imageRow(struct imageWriter *image, long n, int row)
+{
+	long k = imageSequence(image, n, row);
+	int spins = 0;
+
+	startImageThread(image);
+	while (k - __atomic_load_n(&image->written, __ATOMIC_ACQUIRE) >= image->nrows) {
+		ringPause(&spins);
+	}
+
+	return image->data + (k % image->nrows) * image->width;
+}
+
+void commitRow(struct imageWriter *image, long n, int row)
+{
+	long k = imageSequence(image, n, row);
+
+	if (k >= image->committed) {
+		__atomic_store_n(&image->committed, k + 1, __ATOMIC_RELEASE);
+	}
+	startImageThread(image);
+}
+
+static void *imageThread(void *arg)
+{
+	struct imageWriter *image = (struct imageWriter *)arg;
+	long k;
+	int row, spins = 0;
+	char *data;
+
+	for (;;) {
+		k = image->written;
+		if (__atomic_load_n(&image->committed, __ATOMIC_ACQUIRE) == k) {
+			/* Rows are all committed before the stop, check once more after it */
+			if (__atomic_load_n(&image->stop, __ATOMIC_ACQUIRE) &&
+			    __atomic_load_n(&image->committed, __ATOMIC_ACQUIRE) == k) {
+				return NULL;
+			}
+			ringPause(&spins);
+			continue;
+		}
+		spins = 0;
+
+		row = image->height > 0 ? k % image->height : k;
+		data = image->data + (k % image->nrows) * image->width;
+		TIFFWriteScanline(image->tif, data, row, 0);
+		if (image->height > 0 && row == image->height - 1) {
+			TIFFWriteDirectory(image->tif);
+			writeImageTIFFtags(image->tif, image->width, image->height);
+		}
+
+		/* The row is reused for row k + nrows, which starts empty */
+		memset(data, 0, image->width * sizeof(char));
+		__atomic_store_n(&image->written, k + 1, __ATOMIC_RELEASE);
+	}
+}
+
+/***********************************************************************************
+ * Write every committed row and stop the thread. The TIFF file can be closed
+ * afterwards.
+ ***********************************************************************************/
+
+void stopImageWriter(struct imageWriter *image)
+{
+	if (image->started) {
+		__atomic_store_n(&image->stop, 1, __ATOMIC_RELEASE);
+		pthread_join(image->thread, NULL);
+	}
+	free(image->data);
+	free(image);
+}
+
+/***********************************************************************************
+ * Ring operations. The producer reserves a free slot, fills it and publishes it;
+ * the consumer awaits a filled slot, drains it and releases it. Counters only
+ * grow, the slot is the counter modulo the ring size.
+ ***********************************************************************************/
+
+static int ringReserve(struct ring *ring)
+{
+	int spins = 0;
+
+	while (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring->size) {
+		if (__atomic_load_n(&ring->stop, __ATOMIC_ACQUIRE)) {
+			return 0;
+		}
+		ringPause(&spins);
+	}
+
+	return !__atomic_load_n(&ring->stop, __ATOMIC_ACQUIRE);
+}
+
+static void ringPublish(struct ring *ring)
+{
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+static void ringAwait(struct ring *ring)
+{
+	int spins = 0;
+
+	while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail) {
+		ringPause(&spins);
+	}
+}
+
+static void ringRelease(struct ring *ring)
+{
+	__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+/***********************************************************************************
+ * Yield while the other stage is expected to be quick, then sleep
+ ***********************************************************************************/
+
+void ringPause(int *spins)
+{
+	struct timespec pause = { 0, RING_SLEEP * 1000L };
+
+	if ((*spins)++ < RING_SPINS) {
+		sched_yield();
+	} else {
+		nanosleep(&pause, NULL);
+	}
+}
@@ -25,29 +25,30 @@
 /***********************************************************************************
  * Point mode emission routine
  ***********************************************************************************/
-int pointRoutine(config_t cfg, const char *filename, gsl_rng * r)
+int pointRoutine(struct args Args, struct rng *r)
 {
 	/* Parameters for simulation */
-	float x, y, z, prog;
+	float prog;
 	int nphot[] = { 0, 0 };
-	FILE *fileIn, *fileOut[2];
+	FILE *fileOut[2];
+	struct trajectory *fileIn;
+	struct frame *frame;
+	struct writer *writer;
+	struct framePool *pool;
+	struct poolJob *job;
+	long nevals = 0, nskipped = 0;
 	char *outname[] = { (char *)malloc(30 * sizeof(char)),
 		(char *)malloc(30 * sizeof(char))
 	};
-	char *molname = (char *)malloc(10 * sizeof(char));
 
 	/* Open input file */
-	fileIn = fopen(filename, "r");
-	if (fileIn == NULL) {
-		fprintf(stderr, "Error opening %s for reading.\n", filename);
-		exit(1);
-	}
+	fileIn = openTrajectory(Args.filename, Args.input);
 
 	/* Get common parameters */
-	struct commonParms cParms = parseCommon(cfg, fileIn);
+	struct commonParms cParms = parseCommon(Args.cfg, fileIn);
 
 	/* Get point mode parameters */
-	struct pointParms pParms = parsePoint(cfg);
+	struct pointParms pParms = parsePoint(Args.cfg);
 
 	/* Open output files */
 	if (cParms.sChannel[0].status == 1) {
@@ -55,7 +56,7 @@ int pointRoutine(config_t cfg, const char *filename, gsl_rng * r)
 		fileOut[0] = fopen(outname[0], "w");
 		if (fileOut[0] == NULL) {
 			fprintf(stderr, "Error opening %s for writing.\n", outname[0]);
-			fclose(fileIn);
+			closeTrajectory(fileIn);
 			exit(1);
 		}
 	}
@@ -65,7 +66,7 @@ int pointRoutine(config_t cfg, const char *filename, gsl_rng * r)
 		fileOut[1] = fopen(outname[1], "w");
 		if (fileOut[1] == NULL) {
 			fprintf(stderr, "Error opening %s for writing.\n", outname[1]);
-			fclose(fileIn);
+			closeTrajectory(fileIn);
 			exit(1);
 		}
 	}
@@ -74,7 +75,8 @@ int pointRoutine(config_t cfg, const char *filename, gsl_rng * r)
 	printLogo();
 	printf("\n");
 	printf("%s %s starting in point mode.\n", PROGNAME, VERSION);
-	printf("  Reading input file %s\n", filename);
+	printf("  Reading input file %s\n", Args.filename);
+	printf("  Emitting photons on %d threads, random seed %lu\n", Args.nthreads, Args.seed);
 	if (cParms.sChannel[0].status == 1) {
 		printf("  Writing output file %s_c0.txt for channel 0\n", pParms.prefix);
 	}
@@ -116,61 +118,52 @@ int pointRoutine(config_t cfg, const char *filename, gsl_rng * r)
 	}
 	printf("\n");
 
-	/* Photon emission routine */
-
-	while (fscanf(fileIn, "%s %f %f %f\n", molname, &x, &y, &z) != EOF) {
-		if (x == 100) {
-			/*Time step separator */
-			/* Restart the number of processed molecule position */
-			prog = 100 * (y / z);
-			printf("Progress: %.1f%%\r", prog);
-
-			if (cParms.sChannel[0].status == 1) {
-				nphot[0] += noiseGenerator(nphot[0], cParms.noise, r);
-				fprintf(fileOut[0], "%d\n", nphot[0]);
-				nphot[0] = 0;
-			}
-			if (cParms.sChannel[1].status == 1) {
-				nphot[1] += noiseGenerator(nphot[1], cParms.noise, r);
-				fprintf(fileOut[1], "%d\n", nphot[1]);
-				nphot[1] = 0;
-			}
-		} else {
-			if (cParms.sChannel[0].status == 1) {
-				for (int i = 0; i < cParms.sChannel[0].nmols; i++) {
-					if (!strcmp(molname, cParms.sChannel[0].mols[i])) {
-						nphot[0] +=
-						    gaussPSF(x, y, z,
-							     cParms.w_xy,
-							     cParms.w_z,
-							     pParms.centerx,
-							     pParms.centery,
-							     pParms.centerz,
-							     cParms.nevents, cParms.sChannel[0].q[i], r);
-					}
-				}
-			}
-
-			if (cParms.sChannel[1].status == 1) {
-				for (int i = 0; i < cParms.sChannel[1].nmols; i++) {
-					if (!strcmp(molname, cParms.sChannel[1].mols[i])) {
-						nphot[1] +=
-						    gaussPSF(x, y, z,
-							     cParms.w_xy,
-							     cParms.w_z,
-							     pParms.centerx,
-							     pParms.centery,
-							     pParms.centerz,
-							     cParms.nevents, cParms.sChannel[1].q[i], r);
-					}
-				}
-			}
+	/* Photon emission routine, time steps are emitted on a pool of threads and come back in order */
+	writer = startWriter();
+	pool = startFramePool(fileIn, &cParms, NULL, 0, Args.nthreads, r);
+
+	for (;;) {
+		while ((job = takeJob(pool)) != NULL) {
+			job->sx = pParms.centerx;
+			job->sy = pParms.centery;
+			job->sz = pParms.centerz;
+			submitJob(pool, job);
+		}
+		if ((job = finishedJob(pool)) == NULL) {
+			break;
+		}
+		frame = job->frame;
+
+		/* Photons of all molecules, those out of the PSF cutoff emit none */
+		nevals += frame->nmols;
+		nskipped += job->skipped;
+		nphot[0] += job->nphot[0][0];
+		nphot[1] += job->nphot[0][1];
+
+		/* Time step separator */
+		/* Restart the number of processed molecule position */
+		prog = 100 * (frame->iter / frame->total);
+		printf("Progress: %.1f%%\r", prog);
+		streamRng(r, frame->index, RNG_NOISE);
+
+		if (cParms.sChannel[0].status == 1) {
+			nphot[0] += noiseGenerator(nphot[0], cParms.noise, r);
+			queueCount(writer, fileOut[0], nphot[0]);
+			nphot[0] = 0;
+		}
+		if (cParms.sChannel[1].status == 1) {
+			nphot[1] += noiseGenerator(nphot[1], cParms.noise, r);
+			queueCount(writer, fileOut[1], nphot[1]);
+			nphot[1] = 0;
 		}
 	}
 	printf("\n");
+	printCutoff(cParms.cutoff2, nskipped, nevals);
 
 	/* Closing all pointers and cleaning up */
-	fclose(fileIn);
+	stopFramePool(pool);
+	stopWriter(writer);
+	closeTrajectory(fileIn);
 	if (cParms.sChannel[0].status == 1) {
 		fclose(fileOut[0]);
 	}
@@ -0,0 +1,427 @@
+/***********************************************************************************
+ *                                                                                 *
+ * FERNET: Fluorescence Emission Recipes and NumErical routines Toolkit            *
+ * Developed by Juan F. Angiolini and Esteban Mocskos                              *
+ * Facultad de Ciencias Exactas y Naturales, UBA                                   *
+ *                                                                                 *
+ * This program is free software; you can redistribute it and/or                   *
+ * modify it under the terms of the GNU General Public License                     *
+ * as published by the Free Software Foundation; either version 2                  *
+ * of the License, or (at your option) any later version.                          *
+ *                                                                                 *
+ * This program is distributed in the hope that it will be useful,                 *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of                  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                   *
+ * GNU General Public License for more details.                                    *
+ *                                                                                 *
+ * You should have received a copy of the GNU General Public License               *
+ * along with this program; if not, write to the Free Software                     *
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. *
+ *                                                                                 *
+ ***********************************************************************************/
+
+#include "fernet.h"
+
+/***********************************************************************************
+ * Frame pool. The emission routine takes time steps from the trajectory, sets the
+ * PSF center of each and submits them; worker threads compute their photons, and
+ * the routine gets them back in the order they were taken to add noise and write
+ * them. Routines keep their scan state and output on their own thread.
+ *
+ * Time steps are emitted as tasks. A time step with more than POOL_CHUNK molecules
+ * is split into chunks of about the same size, and in a PSF grid it can also be
+ * split into blocks of grid columns, so that a few large time steps still keep
+ * every thread busy. Task t of a time step emits chunk t / nblocks in the PSFs of
+ * block t % nblocks from the shared frame, with a random stream set from the seed,
+ * the time step and t (see rng.c). The tasks of a time step only depend on its
+ * molecule count and the block size, and their photons are added up as integers,
+ * so results are the same for any number of threads.
+ *
+ * Scheduling is by work stealing. Submitted time steps are claimed one at a time
+ * by the workers, which queue the tasks of theirs in their own deque, up to
+ * POOL_DEQUE at a time. A worker runs the newest task of its deque, and once it is
+ * empty claims another time step or steals the oldest task of another worker, so
+ * the tasks of a crowded time step spread over idle threads while a worker keeps
+ * to its own time steps otherwise. Deques follow Chase and Lev, with the memory
+ * orders of Le, Pop, Cohen and Zappa Nardelli (PPoPP 2013).
+ *
+ * Jobs live in a ring of window slots. Counters only grow: the routine takes and
+ * submits jobs in order, workers claim submitted jobs, and the routine waits for
+ * every task of the oldest one to be done.
+ ***********************************************************************************/
+
+struct poolDeque {		// Tasks of one worker, task k in tasks[k % POOL_DEQUE]
+	long top;		// oldest task, taken by thieves
+	long bottom;		// one past the newest task, pushed and popped by the owner
+	uint64_t tasks[POOL_DEQUE];	// job slot in the high half, task of the job in the low half
+};
+
+struct poolWorker {
+	struct framePool *pool;
+	struct rng *r;
+	struct psfGrid *grid;	// own copy of the PSF grid, NULL for one PSF
+	int (*nphot)[NCHANNELS];	// photons of the current task
+	struct poolDeque deque;
+	uint64_t pending;	// next task of the claimed job to queue
+	int npending;		// tasks of it still to queue
+	long ntasks, nstolen;	// tasks run, and those stolen from other workers
+	double idle, busy;	// seconds waiting for work and running tasks
+	pthread_t thread;
+};
+
+struct framePool {
+	struct trajectory *traj;
+	const struct commonParms *cParms;
+	int nthreads, window, ndetectors;
+	int columns, nblocks;	// grid columns in each block, and blocks in a time step
+	struct poolJob *jobs;	// job k in jobs[k % window]
+	unsigned long taken;	// jobs handed to the routine, written by the routine only
+	unsigned long submitted;	// jobs the workers may claim, written by the routine only
+	unsigned long claimed;	// jobs whose tasks a worker has queued
+	unsigned long released;	// jobs given back by the routine, their frames released
+	int held;		// the routine is using the job at released
+	int end;		// no more time steps
+	int stop;		// set by the routine to stop the workers
+	struct poolWorker *workers;
+};
+
+static void *poolThread(void *);
+
+/***********************************************************************************
+ * Start nthreads workers emitting the time steps of traj in one PSF, or in every
+ * PSF of grid when it is not NULL, in blocks of columns grid columns when it is
+ * positive. Their random streams share the seed of r. Must be called before the
+ * first time step is read.
+ ***********************************************************************************/
+
+struct framePool *startFramePool(struct trajectory *traj, const struct commonParms *cParms, struct psfGrid *grid,
+				 int columns, int nthreads, const struct rng *r)
+{
+	struct framePool *pool = (struct framePool *)calloc(1, sizeof(struct framePool));
+
+	pool->traj = traj;
+	pool->cParms = cParms;
+	pool->nthreads = nthreads > 0 ? nthreads : 1;
+	pool->window = POOL_WINDOW * pool->nthreads;
+	pool->ndetectors = grid != NULL ? grid->nx * grid->ny : 1;
+	pool->columns = grid != NULL ? (columns > 0 && columns < grid->nx ? columns : grid->nx) : 1;
+	pool->nblocks = grid != NULL ? (grid->nx + pool->columns - 1) / pool->columns : 1;
+	pool->jobs = (struct poolJob *)calloc(pool->window, sizeof(struct poolJob));
+	for (int k = 0; k < pool->window; k++) {
+		pool->jobs[k].nphot = calloc(pool->ndetectors, sizeof(*pool->jobs[k].nphot));
+	}
+
+	/* Every job in flight holds its frame, and the reader keeps reading ahead */
+	traj->readahead = pool->window + RING_FRAMES;
+
+	pool->workers = (struct poolWorker *)calloc(pool->nthreads, sizeof(struct poolWorker));
+	for (int t = 0; t < pool->nthreads; t++) {
+		struct poolWorker *worker = &pool->workers[t];
+		worker->pool = pool;
+		worker->r = newRng(0);
+		memcpy(worker->r->key, r->key, sizeof(r->key));
+		worker->grid = grid != NULL ? newPSFGrid(grid->nx, grid->centerx, grid->ny, grid->centery, grid->sz) : NULL;
+		worker->nphot = calloc(pool->ndetectors, sizeof(*worker->nphot));
+	}
+	for (int t = 0; t < pool->nthreads; t++) {
+		if (pthread_create(&pool->workers[t].thread, NULL, poolThread, &pool->workers[t]) != 0) {
+			fprintf(stderr, "Error starting emission thread.\n");
+			exit(1);
+		}
+	}
+
+	return pool;
+}
+
+/***********************************************************************************
+ * Work stealing deque. Only the owner pushes and pops, at the bottom; any worker
+ * steals at the top. Each returns 0 when there is no room or no task.
+ ***********************************************************************************/
+
+static int pushTask(struct poolDeque *deque, uint64_t task)
+{
+	long b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+	long t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+
+	if (b - t >= POOL_DEQUE) {
+		return 0;
+	}
+	__atomic_store_n(&deque->tasks[b % POOL_DEQUE], task, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+
+	return 1;
+}
+
+static int popTask(struct poolDeque *deque, uint64_t *task)
+{
+	long b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+	long t;
+	int found = 1;
+
+	__atomic_store_n(&deque->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+	if (t > b) {
+		__atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	*task = __atomic_load_n(&deque->tasks[b % POOL_DEQUE], __ATOMIC_RELAXED);
+	if (t == b) {
+		/* Last task, thieves may be taking it too */
+		found = __atomic_compare_exchange_n(&deque->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+		__atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+
+	return found;
+}
+
+static int stealTask(struct poolDeque *deque, uint64_t *task)
+{
+	long t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	long b;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b) {
+		return 0;
+	}
+	*task = __atomic_load_n(&deque->tasks[t % POOL_DEQUE], __ATOMIC_RELAXED);
+
+	return __atomic_compare_exchange_n(&deque->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+/***********************************************************************************
+ * Next task for a worker: its own newest one, then the next submitted job, then
+ * the oldest task of another worker. The tasks of a claimed job are queued as
+ * the deque makes room for them.
+ ***********************************************************************************/
+
+static int nextTask(struct poolWorker *worker, uint64_t *task)
+{
+	struct framePool *pool = worker->pool;
+	struct poolJob *job;
+	unsigned long k;
+
+	while (worker->npending > 0 && pushTask(&worker->deque, worker->pending)) {
+		worker->pending++;
+		worker->npending--;
+	}
+	if (popTask(&worker->deque, task)) {
+		return 1;
+	}
+
+	k = __atomic_load_n(&pool->claimed, __ATOMIC_RELAXED);
+	if (k != __atomic_load_n(&pool->submitted, __ATOMIC_ACQUIRE) &&
+	    __atomic_compare_exchange_n(&pool->claimed, &k, k + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		job = &pool->jobs[k % pool->window];
+		*task = (uint64_t)(k % pool->window) << 32;
+		worker->pending = *task + 1;
+		worker->npending = job->ntasks - 1;
+		return 1;
+	}
+
+	for (int v = 1; v < pool->nthreads; v++) {
+		struct poolWorker *victim = &pool->workers[(worker - pool->workers + v) % pool->nthreads];
+		if (stealTask(&victim->deque, task)) {
+			worker->nstolen++;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Photons of one task, added to those of its job */
+static void runTask(struct poolWorker *worker, uint64_t task)
+{
+	struct framePool *pool = worker->pool;
+	struct poolJob *job = &pool->jobs[task >> 32];
+	int t = task & 0xffffffffU, b = t % pool->nblocks, first = t / pool->nblocks * job->chunk;
+	int c0 = b * pool->columns, c1 = c0 + pool->columns - 1, npsf;
+	struct frame chunk = *job->frame;
+	long skipped;
+
+	/* The molecules of the chunk, in the shared frame */
+	chunk.nmols = job->frame->nmols - first < job->chunk ? job->frame->nmols - first : job->chunk;
+	chunk.species += first;
+	chunk.x += first;
+	chunk.y += first;
+	chunk.z += first;
+
+	streamRng(worker->r, job->frame->index, t);
+	if (worker->grid != NULL) {
+		c1 = c1 < worker->grid->nx - 1 ? c1 : worker->grid->nx - 1;
+		npsf = (c1 - c0 + 1) * worker->grid->ny;
+		memset(worker->nphot + c0 * worker->grid->ny, 0, npsf * sizeof(*worker->nphot));
+		skipped = psfGridColumns(worker->grid, &chunk, c0, c1, pool->cParms, worker->nphot, worker->r);
+	} else {
+		npsf = 1;
+		memset(worker->nphot, 0, sizeof(*worker->nphot));
+		skipped = psfFrame(&chunk, job->sx, job->sy, job->sz, pool->cParms, worker->nphot[0], worker->r);
+	}
+
+	/* Only the photons of a whole job are used, so the tasks may add them in any order */
+	c0 = worker->grid != NULL ? c0 * worker->grid->ny : 0;
+	for (int k = c0; k < c0 + npsf; k++) {
+		for (int c = 0; c < NCHANNELS; c++) {
+			if (worker->nphot[k][c] != 0) {
+				__atomic_add_fetch(&job->nphot[k][c], worker->nphot[k][c], __ATOMIC_RELAXED);
+			}
+		}
+	}
+	__atomic_add_fetch(&job->skipped, skipped, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&job->done, 1, __ATOMIC_RELEASE);
+}
+
+static void *poolThread(void *arg)
+{
+	struct poolWorker *worker = (struct poolWorker *)arg;
+	struct framePool *pool = worker->pool;
+	struct timespec since, now;
+	uint64_t task;
+	int spins = 0, idle = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &since);
+	for (;;) {
+		if (nextTask(worker, &task)) {
+			if (idle) {
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				worker->idle += (now.tv_sec - since.tv_sec) + 1e-9 * (now.tv_nsec - since.tv_nsec);
+				since = now;
+				idle = 0;
+			}
+			runTask(worker, task);
+			worker->ntasks++;
+			spins = 0;
+			continue;
+		}
+		if (!idle) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			worker->busy += (now.tv_sec - since.tv_sec) + 1e-9 * (now.tv_nsec - since.tv_nsec);
+			since = now;
+			idle = 1;
+		}
+		if (__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+		ringPause(&spins);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	worker->idle += (now.tv_sec - since.tv_sec) + 1e-9 * (now.tv_nsec - since.tv_nsec);
+
+	return NULL;
+}
+
+/***********************************************************************************
+ * Next time step for the routine to set up and submit, NULL when the pool is full
+ * or the trajectory has ended. Jobs must be submitted in the order they are taken.
+ ***********************************************************************************/
+
+struct poolJob *takeJob(struct framePool *pool)
+{
+	struct poolJob *job;
+	struct frame *frame;
+
+	if (pool->end || pool->taken - pool->released == (unsigned long)pool->window) {
+		return NULL;
+	}
+	if ((frame = takeFrame(pool->traj)) == NULL) {
+		pool->end = 1;
+		return NULL;
+	}
+	job = &pool->jobs[pool->taken % pool->window];
+	job->frame = frame;
+	pool->taken++;
+
+	return job;
+}
+
+void submitJob(struct framePool *pool, struct poolJob *job)
+{
+	int nchunks = (job->frame->nmols + POOL_CHUNK - 1) / POOL_CHUNK;
+
+	/* Chunks of about the same size, set by the molecule count alone */
+	nchunks = nchunks > 0 ? nchunks : 1;
+	job->chunk = (job->frame->nmols + nchunks - 1) / nchunks;
+	job->ntasks = nchunks * pool->nblocks;
+	memset(job->nphot, 0, pool->ndetectors * sizeof(*job->nphot));
+	job->skipped = 0;
+	job->done = 0;
+	__atomic_store_n(&pool->submitted, pool->submitted + 1, __ATOMIC_RELEASE);
+}
+
+/***********************************************************************************
+ * Oldest time step submitted, once its photons are computed, NULL when every time
+ * step has been returned. It stays valid until the next call, which releases it.
+ ***********************************************************************************/
+
+struct poolJob *finishedJob(struct framePool *pool)
+{
+	struct poolJob *job;
+	int spins = 0;
+
+	if (pool->held) {
+		releaseFrame(pool->traj);
+		pool->released++;
+		pool->held = 0;
+	}
+	if (pool->released == pool->submitted) {
+		return NULL;
+	}
+
+	job = &pool->jobs[pool->released % pool->window];
+	while (__atomic_load_n(&job->done, __ATOMIC_ACQUIRE) < job->ntasks) {
+		ringPause(&spins);
+	}
+	pool->held = 1;
+
+	return job;
+}
+
+/***********************************************************************************
+ * Stop the workers once every job has been returned, and report how the tasks
+ * were shared among them
+ ***********************************************************************************/
+
+void stopFramePool(struct framePool *pool)
+{
+	long ntasks = 0, nstolen = 0;
+	double idle = 0, busy = 0;
+
+	__atomic_store_n(&pool->stop, 1, __ATOMIC_RELEASE);
+	for (int t = 0; t < pool->nthreads; t++) {
+		pthread_join(pool->workers[t].thread, NULL);
+		ntasks += pool->workers[t].ntasks;
+		nstolen += pool->workers[t].nstolen;
+		idle += pool->workers[t].idle;
+		busy += pool->workers[t].busy;
+	}
+
+	if (ntasks > 0) {
+		printf("  %ld emission tasks on %d thread%s, %ld stolen (%.1f%%), threads idle %.1f%% of the time\n",
+		       ntasks, pool->nthreads, pool->nthreads > 1 ? "s" : "", nstolen, 100.0 * nstolen / ntasks,
+		       100.0 * idle / (idle + busy));
+	}
+	if (pool->nthreads > 1 && ntasks > 0) {
+		for (int t = 0; t < pool->nthreads; t++) {
+			struct poolWorker *worker = &pool->workers[t];
+			printf("    Thread %d: %ld tasks, %ld stolen, %.3f s busy, %.3f s idle\n", t, worker->ntasks,
+			       worker->nstolen, worker->busy, worker->idle);
+		}
+	}
+
+	for (int t = 0; t < pool->nthreads; t++) {
+		freeRng(pool->workers[t].r);
+		if (pool->workers[t].grid != NULL) {
+			freePSFGrid(pool->workers[t].grid);
+		}
+		free(pool->workers[t].nphot);
+	}
+	for (int k = 0; k < pool->window; k++) {
+		free(pool->jobs[k].nphot);
+	}
+	free(pool->jobs);
+	free(pool->workers);
+	free(pool);
+}
@@ -0,0 +1,289 @@
+/***********************************************************************************
+ *                                                                                 *
+ * FERNET: Fluorescence Emission Recipes and NumErical routines Toolkit            *
+ * Developed by Juan F. Angiolini and Esteban Mocskos                              *
+ * Facultad de Ciencias Exactas y Naturales, UBA                                   *
+ *                                                                                 *
+ * This program is free software; you can redistribute it and/or                   *
+ * modify it under the terms of the GNU General Public License                     *
+ * as published by the Free Software Foundation; either version 2                  *
+ * of the License, or (at your option) any later version.                          *
+ *                                                                                 *
+ * This program is distributed in the hope that it will be useful,                 *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of                  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                   *
+ * GNU General Public License for more details.                                    *
+ *                                                                                 *
+ * You should have received a copy of the GNU General Public License               *
+ * along with this program; if not, write to the Free Software                     *
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. *
+ *                                                                                 *
+ ***********************************************************************************/
+
+#include "fernet.h"
+
+/***********************************************************************************
+ * Tabulated PSFs. Any axially symmetric PSF is stored as a table of its value at
+ * ns values of r^2 and nz values of z, and evaluated by bilinear interpolation.
+ * Indexing by r^2 needs no square root, and the PSF is smooth in r^2 near the
+ * axis. The peak of every table is 1, like the Gaussian.
+ *
+ * The "airy" model is the paraxial Born-Wolf PSF of a circular pupil,
+ *   h(u, v) = |2 int_0^1 J0(v rho) exp(-i u rho^2 / 2) rho drho|^2,
+ * and "twophoton" is its square, the excitation of a two-photon process. Both are
+ * scaled so that they fall to exp(-2) at r = w_xy in focus and at z = w_z on the
+ * axis, like the Gaussian with the same waists, so the waists and the cutoff in
+ * the configuration file keep their meaning. "table" reads a measured PSF.
+ ***********************************************************************************/
+
+/* Paraxial Born-Wolf PSF by midpoint quadrature over the pupil radius */
+static double bornWolf(double u, double v)
+{
+	double re = 0, im = 0, rho, w;
+
+	for (int k = 0; k < PSF_PUPIL_NODES; k++) {
+		rho = (k + 0.5) / PSF_PUPIL_NODES;
+		w = 2 * rho / PSF_PUPIL_NODES * gsl_sf_bessel_J0(v * rho);
+		re += w * cos(u * rho * rho / 2);
+		im -= w * sin(u * rho * rho / 2);
+	}
+	return re * re + im * im;
+}
+
+static double psfModel(double u, double v, int power)
+{
+	return power == 2 ? pow(bornWolf(u, v), 2) : bornWolf(u, v);
+}
+
+/* Optical coordinate where the model falls to exp(-2) along one axis, by bisection
+ * below its first zero */
+static double modelWaist(int power, int axial)
+{
+	double lo = 0, hi = axial ? 4 * M_PI : 3.8317, mid;
+
+	for (int i = 0; i < 60; i++) {
+		mid = (lo + hi) / 2;
+		if ((axial ? psfModel(mid, 0, power) : psfModel(0, mid, power)) > exp(-2)) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	return (lo + hi) / 2;
+}
+
+static struct psfTable *allocPSFTable(double rmax, double zmax)
+{
+	struct psfTable *table = (struct psfTable *)malloc(sizeof(struct psfTable));
+
+	table->ns = PSF_TABLE_R;
+	table->nz = PSF_TABLE_Z;
+	table->smax = rmax * rmax;
+	table->zmax = zmax;
+	table->ds = table->smax / (table->ns - 1);
+	table->dz = 2 * zmax / (table->nz - 1);
+	table->value = (float *)malloc(table->ns * table->nz * sizeof(float));
+
+	return table;
+}
+
+/* Born-Wolf models, the pupil sums reuse J0 along r and the phases along z */
+static struct psfTable *modelPSFTable(int power, double w_xy, double w_z, double range)
+{
+	struct psfTable *table = allocPSFTable(range * w_xy, range * w_z);
+	double a = modelWaist(power, 0) / w_xy, b = modelWaist(power, 1) / w_z;
+	double *J = (double *)malloc(PSF_PUPIL_NODES * sizeof(double));
+	double *C = (double *)malloc(table->nz * PSF_PUPIL_NODES * sizeof(double));
+	double *S = (double *)malloc(table->nz * PSF_PUPIL_NODES * sizeof(double));
+
+	for (int iz = 0; iz < table->nz; iz++) {
+		double u = b * (iz * table->dz - table->zmax);
+		for (int k = 0; k < PSF_PUPIL_NODES; k++) {
+			double rho = (k + 0.5) / PSF_PUPIL_NODES;
+			C[iz * PSF_PUPIL_NODES + k] = cos(u * rho * rho / 2);
+			S[iz * PSF_PUPIL_NODES + k] = sin(u * rho * rho / 2);
+		}
+	}
+	for (int is = 0; is < table->ns; is++) {
+		double v = a * sqrt(is * table->ds);
+		for (int k = 0; k < PSF_PUPIL_NODES; k++) {
+			double rho = (k + 0.5) / PSF_PUPIL_NODES;
+			J[k] = 2 * rho / PSF_PUPIL_NODES * gsl_sf_bessel_J0(v * rho);
+		}
+		for (int iz = 0; iz < table->nz; iz++) {
+			double re = 0, im = 0, h;
+			for (int k = 0; k < PSF_PUPIL_NODES; k++) {
+				re += J[k] * C[iz * PSF_PUPIL_NODES + k];
+				im += J[k] * S[iz * PSF_PUPIL_NODES + k];
+			}
+			h = re * re + im * im;
+			table->value[iz * table->ns + is] = power == 2 ? h * h : h;
+		}
+	}
+
+	free(J);
+	free(C);
+	free(S);
+	return table;
+}
+
+/* The Gaussian itself, to check the interpolation against gaussPSF */
+static struct psfTable *gaussPSFTable(double w_xy, double w_z, double range)
+{
+	struct psfTable *table = allocPSFTable(range * w_xy, range * w_z);
+
+	for (int iz = 0; iz < table->nz; iz++) {
+		double z = iz * table->dz - table->zmax;
+		for (int is = 0; is < table->ns; is++) {
+			table->value[iz * table->ns + is] = exp(-2 * is * table->ds / (w_xy * w_xy) - 2 * z * z / (w_z * w_z));
+		}
+	}
+	return table;
+}
+
+/* Measured PSF file: lines starting with # are comments, the first line holds the
+ * r and z steps in um, and each following line the PSF at r = 0, dr, 2 dr... for
+ * one z, from the lowest z to the highest, centered on the middle line */
+static struct psfTable *readPSFTable(const char *filename)
+{
+	FILE *file = fopen(filename, "r");
+	char line[65536], *p, *end;
+	double dr = 0, dz = 0, *data = NULL, peak = 0;
+	int nr = 0, nz = 0, n, count = 0, size = 0;
+
+	if (file == NULL) {
+		fprintf(stderr, "Error opening PSF file %s for reading.\n", filename);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), file) != NULL) {
+		if (line[0] == '#' || strspn(line, " \t\r\n") == strlen(line)) {
+			continue;
+		}
+		if (dr == 0) {
+			if (sscanf(line, "%lf %lf", &dr, &dz) != 2 || dr <= 0 || dz <= 0) {
+				fprintf(stderr, "Invalid r and z steps in PSF file %s.\n", filename);
+				exit(1);
+			}
+			continue;
+		}
+		n = 0;
+		for (p = line;; p = end, n++) {
+			double value = strtod(p, &end);
+			if (end == p) {
+				break;
+			}
+			if (count == size) {
+				size = 2 * size + 1024;
+				data = (double *)realloc(data, size * sizeof(double));
+			}
+			data[count++] = value;
+			peak = value > peak ? value : peak;
+		}
+		if (nr == 0) {
+			nr = n;
+		}
+		if (n != nr || n < 2) {
+			fprintf(stderr, "Line %d of PSF file %s has %d values, expected %d.\n", nz + 1, filename, n, nr);
+			exit(1);
+		}
+		nz++;
+	}
+	fclose(file);
+	if (nz < 2 || peak <= 0) {
+		fprintf(stderr, "PSF file %s holds no valid table.\n", filename);
+		exit(1);
+	}
+
+	/* Resample bilinearly in r and z onto the r^2 grid, normalized to a peak of 1 */
+	struct psfTable *table = allocPSFTable((nr - 1) * dr, (nz - 1) * dz / 2);
+	for (int iz = 0; iz < table->nz; iz++) {
+		double fz = (iz * table->dz) / dz;
+		int jz = fz < nz - 1 ? (int)fz : nz - 2;
+		double tz = fz - jz;
+		for (int is = 0; is < table->ns; is++) {
+			double fr = sqrt(is * table->ds) / dr;
+			int jr = fr < nr - 1 ? (int)fr : nr - 2;
+			double tr = fr - jr;
+			double v = (1 - tz) * ((1 - tr) * data[jz * nr + jr] + tr * data[jz * nr + jr + 1])
+			    + tz * ((1 - tr) * data[(jz + 1) * nr + jr] + tr * data[(jz + 1) * nr + jr + 1]);
+			table->value[iz * table->ns + is] = v > 0 ? v / peak : 0;
+		}
+	}
+	free(data);
+
+	return table;
+}
+
+/***********************************************************************************
+ * PSF table of a type, NULL for the analytic Gaussian. Models span range waists
+ * around the center.
+ ***********************************************************************************/
+
+struct psfTable *newPSFTable(const char *type, const char *filename, double w_xy, double w_z, double range)
+{
+	if (!strcmp(type, "gauss")) {
+		return NULL;
+	} else if (!strcmp(type, "gauss_table")) {
+		return gaussPSFTable(w_xy, w_z, range);
+	} else if (!strcmp(type, "airy")) {
+		return modelPSFTable(1, w_xy, w_z, range);
+	} else if (!strcmp(type, "twophoton")) {
+		return modelPSFTable(2, w_xy, w_z, range);
+	} else if (!strcmp(type, "table")) {
+		if (filename == NULL) {
+			fprintf(stderr, "A psf_file is needed for psf_type \"table\".\n");
+			exit(1);
+		}
+		return readPSFTable(filename);
+	}
+	fprintf(stderr, "Unknown psf_type '%s', use gauss, airy, twophoton or table.\n", type);
+	exit(1);
+}
+
+void freePSFTable(struct psfTable *table)
+{
+	if (table != NULL) {
+		free(table->value);
+		free(table);
+	}
+}
+
+/***********************************************************************************
+ * PSF values of a block of molecules from a table, as psfValues. Molecules beyond
+ * the cutoff or outside the table get 0.
+ ***********************************************************************************/
+
+int psfTableValues(const float *x, const float *y, const float *z, int n, const struct psfGeometry *geo,
+		   double *g)
+{
+	const struct psfTable *table = geo->table;
+	const float *value = table->value;
+	double dx, dy, dz, s, fs, fz, ts, tz;
+	int skipped = 0, is, iz;
+
+	for (int i = 0; i < n; i++) {
+		dx = x[i] - geo->sx;
+		dy = y[i] - geo->sy;
+		dz = z[i] - geo->sz;
+		s = dx * dx + dy * dy;
+		if (s / (geo->w_xy * geo->w_xy) + (dz * dz) / (geo->w_z * geo->w_z) > geo->cutoff2) {
+			g[i] = 0;
+			skipped++;
+			continue;
+		}
+		fz = (dz + table->zmax) / table->dz;
+		if (s >= table->smax || fz < 0 || fz >= table->nz - 1) {
+			g[i] = 0;
+			continue;
+		}
+		fs = s / table->ds;
+		is = (int)fs;
+		iz = (int)fz;
+		ts = fs - is;
+		tz = fz - iz;
+		value = table->value + iz * table->ns + is;
+		g[i] = (1 - tz) * ((1 - ts) * value[0] + ts * value[1])
+		    + tz * ((1 - ts) * value[table->ns] + ts * value[table->ns + 1]);
+	}
+	return skipped;
+}
@@ -0,0 +1,412 @@
+/***********************************************************************************
+ *                                                                                 *
+ * FERNET: Fluorescence Emission Recipes and NumErical routines Toolkit            *
+ * Developed by Juan F. Angiolini and Esteban Mocskos                              *
+ * Facultad de Ciencias Exactas y Naturales, UBA                                   *
+ *                                                                                 *
+ * This program is free software; you can redistribute it and/or                   *
+ * modify it under the terms of the GNU General Public License                     *
+ * as published by the Free Software Foundation; either version 2                  *
+ * of the License, or (at your option) any later version.                          *
+ *                                                                                 *
+ * This program is distributed in the hope that it will be useful,                 *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of                  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                   *
+ * GNU General Public License for more details.                                    *
+ *                                                                                 *
+ * You should have received a copy of the GNU General Public License               *
+ * along with this program; if not, write to the Free Software                     *
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. *
+ *                                                                                 *
+ ***********************************************************************************/
+
+#include "fernet.h"
+
+/***********************************************************************************
+ * Quantized binary trajectories (version TRAJ_QUANTIZED). Positions are rounded
+ * to a grid of spacing step and stored as int32 grid coordinates, so every
+ * coordinate is within step / 2 of the original one. The trajHeader is followed by
+ * a quantHeader, then one block per time step:
+ *
+ *   quantFrameHeader
+ *   quantRun[nruns]		molecules grouped by species, in increasing species ID
+ *   keyframe:   int32 x[nmols], y[nmols], z[nmols]
+ *   delta frame: int16 dx[nmols], dy[nmols], dz[nmols] (each padded to 4 bytes),
+ *                uint32 escape[nescapes], int32 x[nescapes], y[nescapes], z[nescapes]
+ *
+ * In a delta frame, the k-th molecule of a species moves from the k-th molecule of
+ * the same species in the previous time step. Molecules with no such predecessor
+ * or moving further than an int16 are escapes, stored with absolute coordinates.
+ * Deltas are added in integers, so errors do not build up between keyframes.
+ ***********************************************************************************/
+
+struct quantState {
+	float step;
+	int capacity;
+	int32_t *grid[2][3];	// x, y and z grid coordinates of the current and previous time steps
+	int cur;
+	int valid;		// previous time step decoded or encoded
+	struct quantRun *runs[2];
+	uint32_t nruns[2];
+	int runcapacity[2];
+	int *order, *count;	// encoder: molecules sorted by species, molecules per species
+	int ncount;
+	int16_t *delta[3];
+	uint32_t *escape;
+};
+
+static void reserveGrid(struct quantState *, int);
+static void reserveRuns(struct quantState *, int, uint32_t);
+
+/***********************************************************************************
+ * Decoding kernels, plain unit stride loops that compilers turn into SIMD code
+ ***********************************************************************************/
+
+static void addDeltas(int32_t * restrict grid, const int32_t * restrict prev, const int16_t * restrict delta, int n)
+{
+	for (int i = 0; i < n; i++) {
+		grid[i] = prev[i] + delta[i];
+	}
+}
+
+static void gridToFloat(float *restrict out, const int32_t * restrict grid, int n, float step)
+{
+	for (int i = 0; i < n; i++) {
+		out[i] = grid[i] * step;
+	}
+}
+
+/***********************************************************************************
+ * Allocate the state of a quantized trajectory reader or writer
+ ***********************************************************************************/
+
+struct quantState *newQuantState(float step)
+{
+	struct quantState *q = (struct quantState *)calloc(1, sizeof(struct quantState));
+
+	q->step = step;
+
+	return q;
+}
+
+void freeQuantState(struct quantState *q)
+{
+	for (int b = 0; b < 2; b++) {
+		for (int c = 0; c < 3; c++) {
+			free(q->grid[b][c]);
+		}
+		free(q->runs[b]);
+	}
+	for (int c = 0; c < 3; c++) {
+		free(q->delta[c]);
+	}
+	free(q->order);
+	free(q->count);
+	free(q->escape);
+	free(q);
+}
+
+static void reserveGrid(struct quantState *q, int nmols)
+{
+	if (nmols <= q->capacity) {
+		return;
+	}
+	while (q->capacity < nmols) {
+		q->capacity = q->capacity ? 2 * q->capacity : 1024;
+	}
+	for (int b = 0; b < 2; b++) {
+		for (int c = 0; c < 3; c++) {
+			q->grid[b][c] = (int32_t *)realloc(q->grid[b][c], q->capacity * sizeof(int32_t));
+		}
+	}
+	for (int c = 0; c < 3; c++) {
+		q->delta[c] = (int16_t *)realloc(q->delta[c], q->capacity * sizeof(int16_t));
+	}
+	q->order = (int *)realloc(q->order, q->capacity * sizeof(int));
+	q->escape = (uint32_t *)realloc(q->escape, q->capacity * sizeof(uint32_t));
+}
+
+static void reserveRuns(struct quantState *q, int b, uint32_t nruns)
+{
+	if ((int)nruns > q->runcapacity[b]) {
+		q->runcapacity[b] = nruns;
+		q->runs[b] = (struct quantRun *)realloc(q->runs[b], nruns * sizeof(struct quantRun));
+	}
+}
+
+/***********************************************************************************
+ * Read next quantized time step into the frame buffers of the trajectory
+ ***********************************************************************************/
+
+struct frame *readQuantizedFrame(struct trajectory *traj)
+{
+	struct quantState *q = traj->quant;
+	struct frame *frame = &traj->frame;
+	struct quantFrameHeader *header;
+	struct quantRun *runs;
+	size_t pos = traj->offset, size;
+	int prev = q->cur, cur = q->cur ^ 1;
+
+	if (pos + sizeof(struct quantFrameHeader) > traj->end) {
+		return NULL;
+	}
+	header = (struct quantFrameHeader *)(traj->map + pos);
+	frame->start = frame->separator = pos;
+	pos += sizeof(struct quantFrameHeader);
+
+	/* Check that the whole block is in the file before touching it */
+	size = header->nruns * sizeof(struct quantRun);
+	if (header->keyframe) {
+		size += 3 * (size_t)header->nmols * sizeof(int32_t);
+	} else {
+		size += 3 * (((size_t)header->nmols * sizeof(int16_t) + 3) & ~(size_t) 3);
+		size += (size_t)header->nescapes * (sizeof(uint32_t) + 3 * sizeof(int32_t));
+	}
+	if (pos + size > traj->end) {
+		fprintf(stderr, "Truncated frame in quantized trajectory.\n");
+		exit(1);
+	}
+	if (!header->keyframe && !q->valid) {
+		fprintf(stderr, "Quantized trajectory does not start with a keyframe.\n");
+		exit(1);
+	}
+
+	frame->nmols = header->nmols;
+	frame->iter = header->iter;
+	frame->total = header->total;
+	while (traj->capacity < frame->nmols) {
+		growFrame(traj);
+	}
+	reserveGrid(q, frame->nmols);
+
+	/* Species of every molecule from the runs */
+	runs = (struct quantRun *)(traj->map + pos);
+	pos += header->nruns * sizeof(struct quantRun);
+	uint32_t start = 0;
+	for (uint32_t r = 0; r < header->nruns; r++) {
+		if (runs[r].species >= (uint32_t) traj->nspecies || runs[r].count > header->nmols - start) {
+			fprintf(stderr, "Invalid species run in quantized trajectory.\n");
+			exit(1);
+		}
+		for (uint32_t k = 0; k < runs[r].count; k++) {
+			frame->species[start + k] = runs[r].species;
+		}
+		start += runs[r].count;
+	}
+	if (start != header->nmols) {
+		fprintf(stderr, "Invalid species run in quantized trajectory.\n");
+		exit(1);
+	}
+
+	if (header->keyframe) {
+		for (int c = 0; c < 3; c++) {
+			memcpy(q->grid[cur][c], traj->map + pos, frame->nmols * sizeof(int32_t));
+			pos += frame->nmols * sizeof(int32_t);
+		}
+	} else {
+		const int16_t *delta[3];
+		for (int c = 0; c < 3; c++) {
+			delta[c] = (const int16_t *)(traj->map + pos);
+			pos += (frame->nmols * sizeof(int16_t) + 3) & ~(size_t) 3;
+		}
+
+		/* Each run moves from the run of the same species in the previous time step */
+		uint32_t p = 0, pstart = 0;
+		start = 0;
+		for (uint32_t r = 0; r < header->nruns; r++) {
+			while (p < q->nruns[prev] && q->runs[prev][p].species < runs[r].species) {
+				pstart += q->runs[prev][p].count;
+				p++;
+			}
+			uint32_t shared = 0;
+			if (p < q->nruns[prev] && q->runs[prev][p].species == runs[r].species) {
+				shared = runs[r].count < q->runs[prev][p].count ? runs[r].count : q->runs[prev][p].count;
+			}
+			for (int c = 0; c < 3; c++) {
+				addDeltas(q->grid[cur][c] + start, q->grid[prev][c] + pstart, delta[c] + start, shared);
+			}
+			start += runs[r].count;
+		}
+
+		/* Escapes overwrite whatever was decoded for them */
+		const uint32_t *escape = (const uint32_t *)(traj->map + pos);
+		pos += header->nescapes * sizeof(uint32_t);
+		for (int c = 0; c < 3; c++) {
+			const int32_t *value = (const int32_t *)(traj->map + pos);
+			for (uint32_t e = 0; e < header->nescapes; e++) {
+				if (escape[e] >= header->nmols) {
+					fprintf(stderr, "Invalid escape in quantized trajectory.\n");
+					exit(1);
+				}
+				q->grid[cur][c][escape[e]] = value[e];
+			}
+			pos += header->nescapes * sizeof(int32_t);
+		}
+	}
+
+	gridToFloat(frame->x, q->grid[cur][0], frame->nmols, q->step);
+	gridToFloat(frame->y, q->grid[cur][1], frame->nmols, q->step);
+	gridToFloat(frame->z, q->grid[cur][2], frame->nmols, q->step);
+
+	/* Keep the runs for the next delta frame */
+	reserveRuns(q, cur, header->nruns);
+	memcpy(q->runs[cur], runs, header->nruns * sizeof(struct quantRun));
+	q->nruns[cur] = header->nruns;
+	q->cur = cur;
+	q->valid = 1;
+	traj->offset = pos;
+
+	return frame;
+}
+
+/***********************************************************************************
+ * Time step of the last keyframe at or before time step first, found through the
+ * frame index. Decoding must start there to reach first.
+ ***********************************************************************************/
+
+long quantizedKeyframe(struct trajectory *traj, long first)
+{
+	struct quantFrameHeader *header;
+
+	for (long i = first; i > 0; i--) {
+		if (traj->index[i].start + sizeof(struct quantFrameHeader) > traj->end) {
+			break;
+		}
+		header = (struct quantFrameHeader *)(traj->map + traj->index[i].start);
+		if (header->keyframe) {
+			return i;
+		}
+	}
+
+	return 0;
+}
+
+/***********************************************************************************
+ * Write a time step as a quantized frame block. Molecules are grouped by species,
+ * a keyframe is written when forced or when a delta frame would mostly hold
+ * escapes. Returns the number of escapes, or -1 for a keyframe.
+ ***********************************************************************************/
+
+long writeQuantizedFrame(FILE *fileOut, struct quantState *q, struct frame *frame, int keyframe)
+{
+	struct quantFrameHeader header;
+	const char padding[4] = { 0, 0, 0, 0 };
+	const float *pos[3] = { frame->x, frame->y, frame->z };
+	int prev = q->cur, cur = q->cur ^ 1, nmols = frame->nmols, nspecies = 0;
+	uint32_t nescapes = 0;
+
+	reserveGrid(q, nmols);
+
+	/* Counting sort by species keeps the file order within each species */
+	for (int m = 0; m < nmols; m++) {
+		if (frame->species[m] >= nspecies) {
+			nspecies = frame->species[m] + 1;
+		}
+	}
+	if (nspecies + 1 > q->ncount) {
+		q->ncount = nspecies + 1;
+		q->count = (int *)realloc(q->count, q->ncount * sizeof(int));
+	}
+	memset(q->count, 0, (nspecies + 1) * sizeof(int));
+	for (int m = 0; m < nmols; m++) {
+		q->count[frame->species[m] + 1]++;
+	}
+	uint32_t nruns = 0;
+	for (int s = 0; s < nspecies; s++) {
+		nruns += q->count[s + 1] > 0;
+		q->count[s + 1] += q->count[s];
+	}
+	for (int m = 0; m < nmols; m++) {
+		q->order[q->count[frame->species[m]]++] = m;
+	}
+
+	/* Runs, count[s] is now the end of species s */
+	reserveRuns(q, cur, nruns);
+	nruns = 0;
+	for (int s = 0, start = 0; s < nspecies; s++) {
+		if (q->count[s] > start) {
+			q->runs[cur][nruns].species = s;
+			q->runs[cur][nruns].count = q->count[s] - start;
+			nruns++;
+			start = q->count[s];
+		}
+	}
+
+	/* Grid coordinates */
+	for (int c = 0; c < 3; c++) {
+		for (int i = 0; i < nmols; i++) {
+			double g = rint(pos[c][q->order[i]] / q->step);
+			if (fabs(g) > INT32_MAX) {
+				fprintf(stderr, "Position %g um is out of the quantization range, use a larger step.\n",
+					pos[c][q->order[i]]);
+				exit(1);
+			}
+			q->grid[cur][c][i] = g;
+		}
+	}
+
+	/* Deltas against the same run of the previous time step */
+	if (!keyframe && q->valid) {
+		uint32_t p = 0, pstart = 0, start = 0;
+		for (uint32_t r = 0; r < nruns; r++) {
+			uint32_t species = q->runs[cur][r].species, count = q->runs[cur][r].count, shared = 0;
+			while (p < q->nruns[prev] && q->runs[prev][p].species < species) {
+				pstart += q->runs[prev][p].count;
+				p++;
+			}
+			if (p < q->nruns[prev] && q->runs[prev][p].species == species) {
+				shared = count < q->runs[prev][p].count ? count : q->runs[prev][p].count;
+			}
+			for (uint32_t k = 0; k < count; k++) {
+				int escaped = k >= shared;
+				for (int c = 0; c < 3 && !escaped; c++) {
+					int64_t d = (int64_t) q->grid[cur][c][start + k] - q->grid[prev][c][pstart + k];
+					escaped = d < INT16_MIN || d > INT16_MAX;
+				}
+				for (int c = 0; c < 3; c++) {
+					q->delta[c][start + k] = escaped ? 0 :
+					    q->grid[cur][c][start + k] - q->grid[prev][c][pstart + k];
+				}
+				if (escaped) {
+					q->escape[nescapes++] = start + k;
+				}
+			}
+			start += count;
+		}
+		keyframe = nescapes > (uint32_t) nmols / 2;
+	} else {
+		keyframe = 1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.nmols = nmols;
+	header.iter = frame->iter;
+	header.total = frame->total;
+	header.keyframe = keyframe;
+	header.nruns = nruns;
+	header.nescapes = keyframe ? 0 : nescapes;
+	fwrite(&header, sizeof(header), 1, fileOut);
+	fwrite(q->runs[cur], sizeof(struct quantRun), nruns, fileOut);
+	if (keyframe) {
+		for (int c = 0; c < 3; c++) {
+			fwrite(q->grid[cur][c], sizeof(int32_t), nmols, fileOut);
+		}
+	} else {
+		for (int c = 0; c < 3; c++) {
+			fwrite(q->delta[c], sizeof(int16_t), nmols, fileOut);
+			fwrite(padding, 1, (4 - nmols * sizeof(int16_t) % 4) % 4, fileOut);
+		}
+		fwrite(q->escape, sizeof(uint32_t), nescapes, fileOut);
+		for (int c = 0; c < 3; c++) {
+			for (uint32_t e = 0; e < nescapes; e++) {
+				fwrite(&q->grid[cur][c][q->escape[e]], sizeof(int32_t), 1, fileOut);
+			}
+		}
+	}
+
+	q->nruns[cur] = nruns;
+	q->cur = cur;
+	q->valid = 1;
+
+	return keyframe ? -1 : (long)nescapes;
+}
@@ -25,31 +25,32 @@
 /**********************************************************************************
 * Raster mode emission routine
 ***********************************************************************************/
-int rasterRoutine(config_t cfg, const char *filename, gsl_rng * r)
+int rasterRoutine(struct args Args, struct rng *r)
 {
 	/* Parameters for simulation */
-	float x, y, z, prog;
+	float prog;
 	int nphot[] = { 0, 0 };
 	int column = 0, row = 0;
-	FILE *fileIn;
+	long image = 0;
+	struct trajectory *fileIn;
+	struct frame *frame;
+	struct imageWriter *images[2];
+	struct framePool *pool;
+	struct poolJob *job;
+	long nevals = 0, nskipped = 0;
 	TIFF *tif[2];
 	char *outname[] = { (char *)malloc(30 * sizeof(char)),
 		(char *)malloc(30 * sizeof(char))
 	};
-	char *molname = { (char *)malloc(10 * sizeof(char)) };
 
 	/* Opening input file */
-	fileIn = fopen(filename, "r");
-	if (fileIn == NULL) {
-		fprintf(stderr, "Error opening %s for reading.\n", filename);
-		exit(1);
-	}
+	fileIn = openTrajectory(Args.filename, Args.input);
 
 	/* Get common parameters */
-	struct commonParms cParms = parseCommon(cfg, fileIn);
+	struct commonParms cParms = parseCommon(Args.cfg, fileIn);
 
 	/* Get image mode parameters */
-	struct rasterParms rParms = parseRaster(cfg);
+	struct rasterParms rParms = parseRaster(Args.cfg);
 
 	/* Open output files */
 	if (cParms.sChannel[0].status == 1) {
@@ -57,7 +58,7 @@ int rasterRoutine(config_t cfg, const char *filename, gsl_rng * r)
 		tif[0] = TIFFOpen(outname[0], "w");
 		if (tif[0] == NULL) {
 			fprintf(stderr, "Error opening %s for writing.\n", outname[0]);
-			fclose(fileIn);
+			closeTrajectory(fileIn);
 			exit(1);
 		}
 	}
@@ -67,7 +68,7 @@ int rasterRoutine(config_t cfg, const char *filename, gsl_rng * r)
 		tif[1] = TIFFOpen(outname[1], "w");
 		if (tif[1] == NULL) {
 			fprintf(stderr, "Error opening %s for writing.\n", outname[1]);
-			fclose(fileIn);
+			closeTrajectory(fileIn);
 			exit(1);
 		}
 	}
@@ -98,7 +99,8 @@ int rasterRoutine(config_t cfg, const char *filename, gsl_rng * r)
 	printLogo();
 	printf("\n");
 	printf("%s %s starting in raster mode.\n", PROGNAME, VERSION);
-	printf("  Reading input file %s\n", filename);
+	printf("  Reading input file %s\n", Args.filename);
+	printf("  Emitting photons on %d threads, random seed %lu\n", Args.nthreads, Args.seed);
 	if (cParms.sChannel[0].status == 1) {
 		printf("  Writing output file %s for channel 0\n", outname[0]);
 	}
@@ -146,98 +148,105 @@ int rasterRoutine(config_t cfg, const char *filename, gsl_rng * r)
 	}
 	printf("\n");
 
-	/* Photon emission routine */
-	char buf_row[2][rParms.width];
+	/* Photon emission routine, time steps are emitted on a pool of threads and come back in order */
+	for (int c = 0; c < NCHANNELS; c++) {
+		if (cParms.sChannel[c].status == 1) {
+			images[c] = startImageWriter(tif[c], rParms.width, rParms.height, Args.nimages);
+		}
+	}
+	pool = startFramePool(fileIn, &cParms, NULL, 0, Args.nthreads, r);
 
-	while (fscanf(fileIn, "%s %f %f %f\n", molname, &x, &y, &z) != EOF) {
-		if (x == 100) {
-			prog = 100 * (y / z);
-			printf("Progress: %0.1f%%\r", prog);
-			if ((int)y % ndummy < rParms.width) {
-				if (cParms.sChannel[0].status == 1) {
-					nphot[0] += noiseGenerator(nphot[0], cParms.noise, r);
-					buf_row[0][column] = nphot[0];
-					nphot[0] = 0;
-				}
-				if (cParms.sChannel[1].status == 1) {
-					nphot[1] += noiseGenerator(nphot[1], cParms.noise, r);
-					buf_row[1][column] = nphot[1];
-					nphot[1] = 0;
-				}
+	for (;;) {
+		/* The scan moves on as time steps are submitted, each keeps its pixel */
+		while ((job = takeJob(pool)) != NULL) {
+			frame = job->frame;
 
-				if (column == rParms.width - 1) {
-					if (cParms.sChannel[0].status == 1) {
-						TIFFWriteScanline(tif[0], buf_row[0], row, 0);
-					}
-					if (cParms.sChannel[1].status == 1) {
-						TIFFWriteScanline(tif[1], buf_row[1], row, 0);
+			/* Runs starting at a later time step resume the scan where it would be */
+			if (frame->index == Args.input.first && Args.input.first > 0) {
+				int scanline = (int)frame->iter / ndummy + ((int)frame->iter % ndummy >= rParms.width);
+				column = (int)frame->iter % ndummy < rParms.width ? (int)frame->iter % ndummy : 0;
+				row = scanline % rParms.height;
+				for (int c = 0; c < NCHANNELS; c++) {
+					if (cParms.sChannel[c].status == 1) {
+						firstImageRow(images[c], 0, row);
 					}
+				}
+			}
+			job->sx = centerx[column];
+			job->sy = centery[row];
+			job->sz = rParms.centerz;
+			job->column = column;
+			job->row = row;
+			submitJob(pool, job);
+			if ((int)frame->iter % ndummy < rParms.width) {
+				if (column == rParms.width - 1) {
 					column = 0;
-
-					if (row == rParms.height - 1) {
-						if (cParms.sChannel[0].status == 1) {
-							TIFFWriteDirectory(tif[0]);
-							writeImageTIFFtags(tif[0], rParms.width, rParms.height);
-						}
-						if (cParms.sChannel[1].status == 1) {
-							TIFFWriteDirectory(tif[1]);
-							writeImageTIFFtags(tif[1], rParms.width, rParms.height);
-						}
-						row = 0;
-					} else {
-						row++;
-					}
+					row = row == rParms.height - 1 ? 0 : row + 1;
 				} else {
 					column++;
 				}
-			} else {
+			}
+		}
+		if ((job = finishedJob(pool)) == NULL) {
+			break;
+		}
+		frame = job->frame;
+
+		/* Photons of all molecules, those out of the PSF cutoff emit none */
+		nevals += frame->nmols;
+		nskipped += job->skipped;
+		nphot[0] += job->nphot[0][0];
+		nphot[1] += job->nphot[0][1];
+
+		/* Time step separator */
+		prog = 100 * (frame->iter / frame->total);
+		printf("Progress: %0.1f%%\r", prog);
+		streamRng(r, frame->index, RNG_NOISE);
+		if ((int)frame->iter % ndummy < rParms.width) {
+			if (cParms.sChannel[0].status == 1) {
+				nphot[0] += noiseGenerator(nphot[0], cParms.noise, r);
+				imageRow(images[0], image, job->row)[job->column] = nphot[0];
+				nphot[0] = 0;
+			}
+			if (cParms.sChannel[1].status == 1) {
+				nphot[1] += noiseGenerator(nphot[1], cParms.noise, r);
+				imageRow(images[1], image, job->row)[job->column] = nphot[1];
+				nphot[1] = 0;
+			}
+
+			/* The image writers end each image after its last row */
+			if (job->column == rParms.width - 1) {
 				if (cParms.sChannel[0].status == 1) {
-					nphot[0] = 0;
+					commitRow(images[0], image, job->row);
 				}
 				if (cParms.sChannel[1].status == 1) {
-					nphot[1] = 0;
+					commitRow(images[1], image, job->row);
+				}
+				if (job->row == rParms.height - 1) {
+					image++;
 				}
 			}
 		} else {
 			if (cParms.sChannel[0].status == 1) {
-				for (int i = 0; i < cParms.sChannel[0].nmols; i++) {
-					if (!strcmp(molname, cParms.sChannel[0].mols[i])) {
-						nphot[0] +=
-						    gaussPSF(x, y, z,
-							     cParms.w_xy,
-							     cParms.w_z,
-							     centerx[column],
-							     centery[row],
-							     rParms.centerz,
-							     cParms.nevents, cParms.sChannel[0].q[i], r);
-					}
-				}
+				nphot[0] = 0;
 			}
-
 			if (cParms.sChannel[1].status == 1) {
-				for (int i = 0; i < cParms.sChannel[1].nmols; i++) {
-					if (!strcmp(molname, cParms.sChannel[1].mols[i])) {
-						nphot[1] +=
-						    gaussPSF(x, y, z,
-							     cParms.w_xy,
-							     cParms.w_z,
-							     centerx[column],
-							     centery[row],
-							     rParms.centerz,
-							     cParms.nevents, cParms.sChannel[1].q[i], r);
-					}
-				}
+				nphot[1] = 0;
 			}
 		}
 	}
 	printf("\n");
+	printCutoff(cParms.cutoff2, nskipped, nevals);
 
 	/* Closing files */
-	fclose(fileIn);
+	stopFramePool(pool);
+	closeTrajectory(fileIn);
 	if (cParms.sChannel[0].status == 1) {
+		stopImageWriter(images[0]);
 		TIFFClose(tif[0]);
 	}
 	if (cParms.sChannel[1].status == 1) {
+		stopImageWriter(images[1]);
 		TIFFClose(tif[1]);
 	}
 
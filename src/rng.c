@@ -0,0 +1,125 @@
+/***********************************************************************************
+ *                                                                                 *
+ * FERNET: Fluorescence Emission Recipes and NumErical routines Toolkit            *
+ * Developed by Juan F. Angiolini and Esteban Mocskos                              *
+ * Facultad de Ciencias Exactas y Naturales, UBA                                   *
+ *                                                                                 *
+ * This program is free software; you can redistribute it and/or                   *
+ * modify it under the terms of the GNU General Public License                     *
+ * as published by the Free Software Foundation; either version 2                  *
+ * of the License, or (at your option) any later version.                          *
+ *                                                                                 *
+ * This program is distributed in the hope that it will be useful,                 *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of                  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                   *
+ * GNU General Public License for more details.                                    *
+ *                                                                                 *
+ * You should have received a copy of the GNU General Public License               *
+ * along with this program; if not, write to the Free Software                     *
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. *
+ *                                                                                 *
+ ***********************************************************************************/
+
+
+#include "fernet.h"
+
+/***********************************************************************************
+ * Random numbers come from Philox4x32-10 (Salmon et al., Random123), a counter
+ * based generator: block n of a stream is the encryption of the counter
+ * (n, stream, frame) under a key made from the seed. A stream is therefore set in
+ * constant time from the seed, the time step and the detector, and gives the same
+ * numbers whichever thread draws them and in whatever order the time steps run.
+ * Blocks are independent, so a refill of the buffer is a loop the compiler can
+ * vectorize. The top 52 bits of each 64 bit half of a block are the mantissa of a
+ * double in [1, 2), which minus 1 is uniform in [0, 1).
+ *
+ * GSL samplers (Poisson, Gaussian, large binomial counts) draw from the same
+ * buffer through a GSL generator type that reads it, so they follow the stream too.
+ ***********************************************************************************/
+
+#define PHILOX_M0 0xd2511f53U
+#define PHILOX_M1 0xcd9e8d57U
+#define PHILOX_W0 0x9e3779b9U
+#define PHILOX_W1 0xbb67ae85U
+
+static void philoxSet(void *state, unsigned long seed)
+{
+	/* Streams are set by seedRng and streamRng */
+}
+
+static unsigned long philoxGet(void *state)
+{
+	return (unsigned long)(rngUniform(*(struct rng **)state) * 4294967296.0);
+}
+
+static double philoxGetDouble(void *state)
+{
+	return rngUniform(*(struct rng **)state);
+}
+
+static const gsl_rng_type philoxType = {
+	"philox4x32", 0xffffffffUL, 0, sizeof(struct rng *), philoxSet, philoxGet, philoxGetDouble
+};
+
+struct rng *newRng(unsigned long seed)
+{
+	struct rng *r = (struct rng *)malloc(sizeof(struct rng));
+
+	r->gsl = gsl_rng_alloc(&philoxType);
+	*(struct rng **)r->gsl->state = r;
+	seedRng(r, seed);
+
+	return r;
+}
+
+/* Key of all streams, and the serial stream for draws outside time steps */
+void seedRng(struct rng *r, unsigned long seed)
+{
+	r->key[0] = (uint32_t)seed;
+	r->key[1] = (uint32_t)((uint64_t)seed >> 32);
+	streamRng(r, 0, RNG_SERIAL);
+}
+
+/* Stream of a detector, or of RNG_NOISE or RNG_SERIAL, in a time step */
+void streamRng(struct rng *r, long frame, uint32_t stream)
+{
+	r->ctr[0] = 0;
+	r->ctr[1] = stream;
+	r->ctr[2] = (uint32_t)frame;
+	r->ctr[3] = (uint32_t)((uint64_t)frame >> 32);
+	r->next = RNG_BUFFER;
+}
+
+void freeRng(struct rng *r)
+{
+	gsl_rng_free(r->gsl);
+	free(r);
+}
+
+void fillUniforms(struct rng *r)
+{
+	uint64_t bits[RNG_BUFFER];
+
+	/* Outputs are first stored as the bits of doubles in [1, 2) */
+	for (int b = 0; b < RNG_BUFFER / 2; b++) {
+		uint32_t c0 = r->ctr[0] + b, c1 = r->ctr[1], c2 = r->ctr[2], c3 = r->ctr[3];
+		uint32_t k0 = r->key[0], k1 = r->key[1];
+		for (int round = 0; round < 10; round++) {
+			uint64_t p0 = (uint64_t)PHILOX_M0 * c0, p1 = (uint64_t)PHILOX_M1 * c2;
+			c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+			c1 = (uint32_t)p1;
+			c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+			c3 = (uint32_t)p0;
+			k0 += PHILOX_W0;
+			k1 += PHILOX_W1;
+		}
+		bits[2 * b] = ((uint64_t)c0 << 32 | c1) >> 12 | 0x3ff0000000000000ULL;
+		bits[2 * b + 1] = ((uint64_t)c2 << 32 | c3) >> 12 | 0x3ff0000000000000ULL;
+	}
+	memcpy(r->u, bits, sizeof(bits));
+	for (int i = 0; i < RNG_BUFFER; i++) {
+		r->u[i] -= 1;
+	}
+	r->ctr[0] += RNG_BUFFER / 2;
+	r->next = 0;
+}
@@ -0,0 +1,68 @@
+/***********************************************************************************
+ *                                                                                 *
+ * FERNET: Fluorescence Emission Recipes and NumErical routines Toolkit            *
+ * Developed by Juan F. Angiolini and Esteban Mocskos                              *
+ * Facultad de Ciencias Exactas y Naturales, UBA                                   *
+ *                                                                                 *
+ * This program is free software; you can redistribute it and/or                   *
+ * modify it under the terms of the GNU General Public License                     *
+ * as published by the Free Software Foundation; either version 2                  *
+ * of the License, or (at your option) any later version.                          *
+ *                                                                                 *
+ * This program is distributed in the hope that it will be useful,                 *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of                  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                   *
+ * GNU General Public License for more details.                                    *
+ *                                                                                 *
+ * You should have received a copy of the GNU General Public License               *
+ * along with this program; if not, write to the Free Software                     *
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. *
+ *                                                                                 *
+ ***********************************************************************************/
+
+
+/***********************************************************************************
+ * Uniform numbers come from the buffer of the generator, refilled RNG_BUFFER at a
+ * time by fillUniforms, so a draw is an array load instead of a call into GSL.
+ ***********************************************************************************/
+
+static inline double rngUniform(struct rng *r)
+{
+	if (r->next == RNG_BUFFER) {
+		fillUniforms(r);
+	}
+	return r->u[r->next++];
+}
+
+/***********************************************************************************
+ * Binomial(n, p) count. Small means are drawn by inversion from a single uniform,
+ * walking up the probabilities of 0, 1, 2... photons (BINV of Kachitvichyanukul and
+ * Schmeiser). Since (1 - p)^n >= 1 - n p, uniforms below 1 - n p give 0 photons
+ * without computing the power, which is the case of most molecules. Larger means,
+ * near the center of bright PSFs, are left to the GSL sampler.
+ ***********************************************************************************/
+
+static inline int rngBinomial(struct rng *r, double p, int n)
+{
+	int flip = p > 0.5, k = 0;
+	double u, f, s, a;
+
+	if (flip) {
+		p = 1 - p;
+	}
+	if (n * p >= RNG_INVERSION) {
+		return gsl_ran_binomial(r->gsl, flip ? 1 - p : p, n);
+	}
+	u = rngUniform(r);
+	if (u > 1 - n * p) {
+		s = p / (1 - p);
+		a = (n + 1) * s;
+		f = pow(1 - p, n);
+		while (u > f && k < n) {
+			u -= f;
+			k++;
+			f *= a / k - s;
+		}
+	}
+	return flip ? n - k : k;
+}
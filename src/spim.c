@@ -26,28 +26,26 @@
 * Spim mode emission routine
 ***********************************************************************************/
 
-int spimRoutine(config_t cfg, const char *filename, gsl_rng * r)
+int spimRoutine(struct args Args, struct rng *r)
 {
 	/* Parameters for simulation */
 	float x, y, z, prog;
-	FILE *fileIn;
+	struct trajectory *fileIn;
+	struct frame *frame;
+	struct writer *writer;
+	long nevals = 0, nskipped = 0;
 	TIFF *tif;
 	char *outname = (char *)malloc(30 * sizeof(char));
-	char *molname = (char *)malloc(10 * sizeof(char));
 
 	/* Opening input file */
-	fileIn = fopen(filename, "r");
-	if (fileIn == NULL) {
-		fprintf(stderr, "Error opening %s for reading.\n", filename);
-		exit(1);
-	}
+	fileIn = openTrajectory(Args.filename, Args.input);
 	//fprintf(stdout, "Check open input\n");
 
 	/* Get common parameters */
-	struct commonParms cParms = parseCommon(cfg, fileIn);
+	struct commonParms cParms = parseCommon(Args.cfg, fileIn);
 
 	/* Get spim mode parameters */
-	struct spimParms spParms = parseSpim(cfg);
+	struct spimParms spParms = parseSpim(Args.cfg);
 	//fprintf(stdout, "Check parse spim\n");
 
 	/* Alloc memory for big files */
@@ -58,7 +56,7 @@ int spimRoutine(config_t cfg, const char *filename, gsl_rng * r)
 	tif = TIFFOpen(outname, "w");
 	if (tif == NULL) {
 		fprintf(stderr, "Error opening %s for writing.\n", outname);
-		fclose(fileIn);
+		closeTrajectory(fileIn);
 		exit(1);
 	}
 
@@ -73,6 +71,15 @@ int spimRoutine(config_t cfg, const char *filename, gsl_rng * r)
 	}
 	//fprintf(stdout, "Check ccd allocation\n");
 
+	/* Expected photons of each pixel over a CCD frame, for aggregate sampling */
+	double **CCD_mean = NULL;
+	if (cParms.sampling == SAMPLING_AGGREGATE) {
+		CCD_mean = (double **)malloc(spParms.height * sizeof(double *));
+		for (int i = 0; i < spParms.height; i++) {
+			CCD_mean[i] = (double *)calloc(spParms.width, sizeof(double));
+		}
+	}
+
 	int nbin = round(spParms.frame_t / cParms.simu_dt);
 
 	/* CCD array initialization */
@@ -91,11 +98,17 @@ int spimRoutine(config_t cfg, const char *filename, gsl_rng * r)
 	double lx = (spParms.width * spParms.pixel) / 2;
 	double ly = (spParms.height * spParms.pixel) / 2;
 
+	/* Molecules further from the CCD than where the jitter density falls to the PSF
+	 * cutoff level, 2 sqrt(cutoff2) R, can not land on it and are dropped before
+	 * any draw. Without a cutoff the reach is infinite and none are. */
+	double reach = 2 * sqrt(cParms.cutoff2) * R;
+
 	/* Info about files */
 	printLogo();
 	printf("\n");
 	printf("%s %s starting in SPIM mode.\n", PROGNAME, VERSION);
-	printf("  Reading input file %s\n", filename);
+	printf("  Reading input file %s\n", Args.filename);
+	printf("  Random seed %lu\n", Args.seed);
 	printf("  Writing output file %s for channel 0\n", outname);
 	printf("\n");
 
@@ -112,48 +125,82 @@ int spimRoutine(config_t cfg, const char *filename, gsl_rng * r)
 	printf("\n");
 
 	/* SPIM routine */
-	//int count = 1;
-	while (fscanf(fileIn, "%s %f %f %f\n", molname, &x, &y, &z) != EOF) {
-		if (x == 100) {
-			prog = 100 * (y / z);
-			printf("Progress: %.1f%%\r", prog);
-			if (((int)y + 1) % nbin == 0) {
-
-				for (int i = 0; i < spParms.height; i++) {
-					TIFFWriteScanline(tif, CCD_buf[i], i, 0);
-				}
-
-				TIFFWriteDirectory(tif);
-				//fprintf(stdout, "wrote directory %d\n",count );
-				//count++;
-				writeImageTIFFtags(tif, spParms.width, spParms.height);
-				free(CCD_buf);
-				char **CCD_buf = (char **)malloc(spParms.height * sizeof(char *));
-				for (int i = 0; i < spParms.height; i++) {
-					CCD_buf[i] = (char *)malloc(spParms.width * sizeof(char));
-				}
-
-				for (int i = 0; i < spParms.height; i++) {
-					for (int j = 0; j < spParms.width; j++) {
-						CCD_buf[i][j] = 0;
-					}
-				}
+	writer = startWriter();
+	while ((frame = readFrame(fileIn)) != NULL) {
+		for (int m = 0; m < frame->nmols; m++) {
+			x = frame->x[m];
+			y = frame->y[m];
+			z = frame->z[m];
+
+			/* Molecules out of the light sheet cutoff or out of reach of the CCD emit no photons */
+			nevals++;
+			if (outsidePSF(0, 0, z, 1, spParms.waist, 0, 0, spParms.centerz, cParms.cutoff2)
+			    || fabs(x) > lx + reach || fabs(y) > ly + reach) {
+				nskipped++;
+				continue;
 			}
-		} else {
-			x += gsl_ran_gaussian(r, R);
-			y += gsl_ran_gaussian(r, R);
+
+			x += gsl_ran_gaussian(r->gsl, R);
+			y += gsl_ran_gaussian(r->gsl, R);
 
 			if ((x > -lx && x < lx) && (y > -ly && y < ly)) {
 				int idx_x = floor((x + lx) / spParms.pixel);
 				int idx_y = floor((y + ly) / spParms.pixel);
 
-				CCD_buf[idx_x][idx_y] +=
-				    spimPSF(z, spParms.waist, spParms.centerz,
-					    cParms.nevents, cParms.sChannel[0].q[0], r);
+				if (CCD_mean != NULL) {
+					CCD_mean[idx_y][idx_x] +=
+					    spimPSFMean(z, spParms.waist, spParms.centerz, cParms.nevents,
+							cParms.sChannel[0].q[0]);
+				} else {
+					CCD_buf[idx_y][idx_x] +=
+					    spimPSF(z, spParms.waist, spParms.centerz,
+						    cParms.nevents, cParms.sChannel[0].q[0], r);
+				}
 			} else {
 				continue;
 			}
 		}
+
+		/* Time step separator */
+		prog = 100 * (frame->iter / frame->total);
+		printf("Progress: %.1f%%\r", prog);
+		if (((int)frame->iter + 1) % nbin == 0) {
+			/* Photons of the whole CCD frame are drawn at once in aggregate sampling */
+			for (int i = 0; CCD_mean != NULL && i < spParms.height; i++) {
+				for (int j = 0; j < spParms.width; j++) {
+					CCD_buf[i][j] += samplePhotons(CCD_mean[i][j], r);
+					CCD_mean[i][j] = 0;
+				}
+			}
+
+			for (int i = 0; i < spParms.height; i++) {
+				queueScanline(writer, tif, CCD_buf[i], spParms.width, i);
+			}
+
+			queueDirectory(writer, tif, spParms.width, spParms.height);
+
+			for (int i = 0; i < spParms.height; i++) {
+				for (int j = 0; j < spParms.width; j++) {
+					CCD_buf[i][j] = 0;
+				}
+			}
+		}
 	}
+	printf("\n");
+	printCutoff(cParms.cutoff2, nskipped, nevals);
+
+	/* Closing files */
+	stopWriter(writer);
+	closeTrajectory(fileIn);
+	TIFFClose(tif);
+	for (int i = 0; i < spParms.height; i++) {
+		free(CCD_buf[i]);
+	}
+	free(CCD_buf);
+	for (int i = 0; CCD_mean != NULL && i < spParms.height; i++) {
+		free(CCD_mean[i]);
+	}
+	free(CCD_mean);
+
 	return 0;
 }
@@ -25,31 +25,31 @@
 /**********************************************************************************
 * Stack mode emission routine
 ***********************************************************************************/
-int stackRoutine(config_t cfg, const char *filename, gsl_rng * r)
+int stackRoutine(struct args Args, struct rng *r)
 {
 	/* Parameters for simulation */
-	float x, y, z, prog;
+	float prog;
 	int nphot[] = { 0, 0 };
 	int column = 0, row = 0, slice = 0;
-	FILE *fileIn;
+	struct trajectory *fileIn;
+	struct frame *frame;
+	struct imageWriter *images[2];
+	struct framePool *pool;
+	struct poolJob *job;
+	long nevals = 0, nskipped = 0;
 	TIFF *tif[2];
 	char *outname[] = { (char *)malloc(30 * sizeof(char)),
 		(char *)malloc(30 * sizeof(char))
 	};
-	char *molname = { (char *)malloc(10 * sizeof(char)) };
 
 	/* Opening input file */
-	fileIn = fopen(filename, "r");
-	if (fileIn == NULL) {
-		fprintf(stderr, "Error opening %s for reading.\n", filename);
-		exit(1);
-	}
+	fileIn = openTrajectory(Args.filename, Args.input);
 
 	/* Get common parameters */
-	struct commonParms cParms = parseCommon(cfg, fileIn);
+	struct commonParms cParms = parseCommon(Args.cfg, fileIn);
 
 	/* Get stack mode parameters */
-	struct stackParms sParms = parseStack(cfg);
+	struct stackParms sParms = parseStack(Args.cfg);
 
 	/* Open output files */
 	if (cParms.sChannel[0].status == 1) {
@@ -57,7 +57,7 @@ int stackRoutine(config_t cfg, const char *filename, gsl_rng * r)
 		tif[0] = TIFFOpen(outname[0], "w");
 		if (tif[0] == NULL) {
 			fprintf(stderr, "Error opening %s for writing.\n", outname[0]);
-			fclose(fileIn);
+			closeTrajectory(fileIn);
 			exit(1);
 		}
 	}
@@ -67,7 +67,7 @@ int stackRoutine(config_t cfg, const char *filename, gsl_rng * r)
 		tif[1] = TIFFOpen(outname[1], "w");
 		if (tif[1] == NULL) {
 			fprintf(stderr, "Error opening %s for writing.\n", outname[1]);
-			fclose(fileIn);
+			closeTrajectory(fileIn);
 			exit(1);
 		}
 	}
@@ -109,7 +109,8 @@ int stackRoutine(config_t cfg, const char *filename, gsl_rng * r)
 	printLogo();
 	printf("\n");
 	printf("%s %s starting in stack mode.\n", PROGNAME, VERSION);
-	printf("  Reading input file %s\n", filename);
+	printf("  Reading input file %s\n", Args.filename);
+	printf("  Emitting photons on %d threads, random seed %lu\n", Args.nthreads, Args.seed);
 	if (cParms.sChannel[0].status == 1) {
 		printf("  Writing output file %s for channel 0\n", outname[0]);
 	}
@@ -156,43 +157,43 @@ int stackRoutine(config_t cfg, const char *filename, gsl_rng * r)
 	}
 	printf("\n");
 
-	/* Photon emission routine */
-	char buf_row[2][sParms.width];
-	while ((fscanf(fileIn, "%s %f %f %f\n", molname, &x, &y, &z) != EOF)
-	       && y < Niters) {
-		if (x == 100) {
-			prog = 100 * (y / Niters);
-			printf("Progress: %0.1f%%\r", prog);
-			if ((int)y % ndummy < sParms.width) {
-				if (cParms.sChannel[0].status == 1) {
-					nphot[0] += noiseGenerator(nphot[0], cParms.noise, r);
-					buf_row[0][column] = nphot[0];
-					nphot[0] = 0;
-				}
-				if (cParms.sChannel[1].status == 1) {
-					nphot[1] += noiseGenerator(nphot[1], cParms.noise, r);
-					buf_row[1][column] = nphot[1];
-					nphot[1] = 0;
-				}
+	/* Photon emission routine, time steps are emitted on a pool of threads and come back in order */
+	for (int c = 0; c < NCHANNELS; c++) {
+		if (cParms.sChannel[c].status == 1) {
+			images[c] = startImageWriter(tif[c], sParms.width, sParms.height, Args.nimages);
+		}
+	}
+	stopAtIteration(fileIn, Niters);
+	pool = startFramePool(fileIn, &cParms, NULL, 0, Args.nthreads, r);
 
-				if (column == sParms.width - 1) {
-					if (cParms.sChannel[0].status == 1) {
-						TIFFWriteScanline(tif[0], buf_row[0], row, 0);
-					}
-					if (cParms.sChannel[1].status == 1) {
-						TIFFWriteScanline(tif[1], buf_row[1], row, 0);
+	for (;;) {
+		/* The scan moves on as time steps are submitted, each keeps its pixel */
+		while ((job = takeJob(pool)) != NULL) {
+			frame = job->frame;
+
+			/* Runs starting at a later time step resume the scan where it would be */
+			if (frame->index == Args.input.first && Args.input.first > 0) {
+				int scanline = (int)frame->iter / ndummy + ((int)frame->iter % ndummy >= sParms.width);
+				column = (int)frame->iter % ndummy < sParms.width ? (int)frame->iter % ndummy : 0;
+				row = scanline % sParms.height;
+				slice = scanline / sParms.height;
+				for (int c = 0; c < NCHANNELS; c++) {
+					if (cParms.sChannel[c].status == 1) {
+						firstImageRow(images[c], slice, row);
 					}
+				}
+			}
+			job->sx = centerx[column];
+			job->sy = centery[row];
+			job->sz = zpos[slice];
+			job->column = column;
+			job->row = row;
+			job->slice = slice;
+			submitJob(pool, job);
+			if ((int)frame->iter % ndummy < sParms.width) {
+				if (column == sParms.width - 1) {
 					column = 0;
-
 					if (row == sParms.height - 1) {
-						if (cParms.sChannel[0].status == 1) {
-							TIFFWriteDirectory(tif[0]);
-							writeImageTIFFtags(tif[0], sParms.width, sParms.height);
-						}
-						if (cParms.sChannel[1].status == 1) {
-							TIFFWriteDirectory(tif[1]);
-							writeImageTIFFtags(tif[1], sParms.width, sParms.height);
-						}
 						row = 0;
 						slice++;
 					} else {
@@ -201,52 +202,65 @@ int stackRoutine(config_t cfg, const char *filename, gsl_rng * r)
 				} else {
 					column++;
 				}
-			} else {
+			}
+		}
+		if ((job = finishedJob(pool)) == NULL) {
+			break;
+		}
+		frame = job->frame;
+
+		/* Photons of all molecules, those out of the PSF cutoff emit none */
+		nevals += frame->nmols;
+		nskipped += job->skipped;
+		nphot[0] += job->nphot[0][0];
+		nphot[1] += job->nphot[0][1];
+
+		/* Time step separator */
+		prog = 100 * (frame->iter / Niters);
+		printf("Progress: %0.1f%%\r", prog);
+		streamRng(r, frame->index, RNG_NOISE);
+		if ((int)frame->iter % ndummy < sParms.width) {
+			if (cParms.sChannel[0].status == 1) {
+				nphot[0] += noiseGenerator(nphot[0], cParms.noise, r);
+				imageRow(images[0], job->slice, job->row)[job->column] = nphot[0];
+				nphot[0] = 0;
+			}
+			if (cParms.sChannel[1].status == 1) {
+				nphot[1] += noiseGenerator(nphot[1], cParms.noise, r);
+				imageRow(images[1], job->slice, job->row)[job->column] = nphot[1];
+				nphot[1] = 0;
+			}
+
+			/* The image writers end each slice after its last row */
+			if (job->column == sParms.width - 1) {
 				if (cParms.sChannel[0].status == 1) {
-					nphot[0] = 0;
+					commitRow(images[0], job->slice, job->row);
 				}
 				if (cParms.sChannel[1].status == 1) {
-					nphot[1] = 0;
+					commitRow(images[1], job->slice, job->row);
 				}
 			}
 		} else {
 			if (cParms.sChannel[0].status == 1) {
-				for (int i = 0; i < cParms.sChannel[0].nmols; i++) {
-					if (!strcmp(molname, cParms.sChannel[0].mols[i])) {
-						nphot[0] +=
-						    gaussPSF(x, y, z,
-							     cParms.w_xy,
-							     cParms.w_z,
-							     centerx[column],
-							     centery[row],
-							     zpos[slice], cParms.nevents, cParms.sChannel[0].q[i], r);
-					}
-				}
+				nphot[0] = 0;
 			}
-
 			if (cParms.sChannel[1].status == 1) {
-				for (int i = 0; i < cParms.sChannel[1].nmols; i++) {
-					if (!strcmp(molname, cParms.sChannel[1].mols[i])) {
-						nphot[1] +=
-						    gaussPSF(x, y, z,
-							     cParms.w_xy,
-							     cParms.w_z,
-							     centerx[column],
-							     centery[row],
-							     zpos[slice], cParms.nevents, cParms.sChannel[1].q[i], r);
-					}
-				}
+				nphot[1] = 0;
 			}
 		}
 	}
 	printf("\n");
+	printCutoff(cParms.cutoff2, nskipped, nevals);
 
 	/* Closing files */
-	fclose(fileIn);
+	stopFramePool(pool);
+	closeTrajectory(fileIn);
 	if (cParms.sChannel[0].status == 1) {
+		stopImageWriter(images[0]);
 		TIFFClose(tif[0]);
 	}
 	if (cParms.sChannel[1].status == 1) {
+		stopImageWriter(images[1]);
 		TIFFClose(tif[1]);
 	}
 
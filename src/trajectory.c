@@ -0,0 +1,859 @@
+/***********************************************************************************
+ *                                                                                 *
+ * FERNET: Fluorescence Emission Recipes and NumErical routines Toolkit            *
+ * Developed by Juan F. Angiolini and Esteban Mocskos                              *
+ * Facultad de Ciencias Exactas y Naturales, UBA                                   *
+ *                                                                                 *
+ * This program is free software; you can redistribute it and/or                   *
+ * modify it under the terms of the GNU General Public License                     *
+ * as published by the Free Software Foundation; either version 2                  *
+ * of the License, or (at your option) any later version.                          *
+ *                                                                                 *
+ * This program is distributed in the hope that it will be useful,                 *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of                  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                   *
+ * GNU General Public License for more details.                                    *
+ *                                                                                 *
+ * You should have received a copy of the GNU General Public License               *
+ * along with this program; if not, write to the Free Software                     *
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. *
+ *                                                                                 *
+ ***********************************************************************************/
+
+#include "fernet.h"
+
+/***********************************************************************************
+ * Trajectory input. Text trajectories are MCell position dumps: a header line with
+ * simu_dt and mD, then one "name x y z" line per molecule and a separator line
+ * with x == 100, y == iteration and z == total iterations after each time step.
+ * Binary trajectories (see convertRoutine) hold the same data in frame blocks that
+ * are read in place from a memory map, or decoded from quantized positions (see
+ * quantize.c). Molecules after the last separator are
+ * discarded, as they never reach the output of any mode.
+ *
+ * A frame index (see indexRoutine) next to the trajectory gives the file offset
+ * of every time step, so runs starting at opts.first seek there directly instead
+ * of parsing everything before it. gzip and zstd compressed text trajectories are
+ * decompressed on the fly (see startDecompressor).
+ *
+ * Reading stops after the separator with iter == total, so pipes and files that
+ * MCell is still writing (opts.follow) end with the simulation. Pipes also end
+ * when MCell closes them, with a warning if that separator never came. A file name of
+ * "-" reads the trajectory from the standard input. A directory is read as MCell
+ * visualization output (see openVizData).
+ ***********************************************************************************/
+
+static void openBinary(struct trajectory *, const char *);
+static void loadIndex(struct trajectory *, const char *);
+static void keepSpecies(struct trajectory *, struct inputOptions);
+static void rehashSpecies(struct trajectory *, int);
+static struct frame *nextFrame(struct trajectory *);
+static struct frame *readTextFrame(struct trajectory *);
+static struct frame *readBinaryFrame(struct trajectory *);
+static void fillBuffer(struct trajectory *);
+static const char *nextLine(struct trajectory *, const char **);
+static const char *parseFloat(const char *, float *);
+
+struct trajectory *openTrajectory(const char *filename, struct inputOptions opts)
+{
+	struct trajectory *traj = (struct trajectory *)calloc(1, sizeof(struct trajectory));
+	const char *line, *eol, *p;
+	struct stat st;
+
+	if (opts.first < 0 || (opts.last >= 0 && opts.last < opts.first)) {
+		fprintf(stderr, "Invalid range of time steps: %ld to %ld.\n", opts.first, opts.last);
+		exit(1);
+	}
+	traj->next = opts.first;
+	traj->last = opts.last;
+	traj->stopiter = INFINITY;
+	traj->follow = opts.follow;
+
+	/* MCell visualization output, one file per time step */
+	if (stat(filename, &st) == 0 && S_ISDIR(st.st_mode)) {
+		if (traj->follow) {
+			fprintf(stderr, "Directories can not be followed, %s must be a text trajectory.\n", filename);
+			exit(1);
+		}
+		traj->fd = -1;
+		keepSpecies(traj, opts);
+		traj->viz = openVizData(filename, opts.first);
+		return traj;
+	}
+
+	traj->fd = strcmp(filename, "-") ? open(filename, O_RDONLY) : STDIN_FILENO;
+	if (traj->fd < 0) {
+		fprintf(stderr, "Error opening %s for reading.\n", filename);
+		exit(1);
+	}
+	/* Only growing regular files are polled, pipes end when every writer has closed them */
+	int regular = fstat(traj->fd, &st) == 0 && S_ISREG(st.st_mode);
+	traj->live = traj->follow || !regular;
+	traj->follow = traj->follow && regular;
+	traj->decompressor = startDecompressor(&traj->fd);
+	if (opts.follow && traj->decompressor != NULL) {
+		fprintf(stderr, "Compressed trajectories can not be followed, %s must be plain text.\n", filename);
+		exit(1);
+	}
+
+	/* Binary trajectories start with the file signature */
+	fillBuffer(traj);
+	if (traj->buflen >= sizeof(TRAJ_MAGIC) && !memcmp(traj->buf, TRAJ_MAGIC, sizeof(TRAJ_MAGIC))) {
+		if (traj->decompressor != NULL) {
+			fprintf(stderr, "Compressed binary trajectories are not supported, decompress %s first.\n",
+				filename);
+			exit(1);
+		}
+		if (opts.follow) {
+			fprintf(stderr, "Binary trajectories can not be followed, %s must be plain text.\n", filename);
+			exit(1);
+		}
+		openBinary(traj, filename);
+	} else {
+		/* Parse text file header */
+		line = nextLine(traj, &eol);
+		if (line == NULL || (p = parseFloat(line, &traj->simu_dt)) == NULL
+		    || parseFloat(p, &traj->mD) == NULL) {
+			fprintf(stderr, "Invalid header in %s.\n", filename);
+			exit(1);
+		}
+		keepSpecies(traj, opts);
+	}
+
+	/* Seek to the first time step through the index */
+	if (traj->decompressor == NULL && !traj->live) {
+		loadIndex(traj, filename);
+	}
+	if (opts.first > 0 && traj->nindex > 0) {
+		if (opts.first >= traj->nindex) {
+			fprintf(stderr, "First time step %ld is past the end of %s (%ld time steps).\n",
+				opts.first, filename, traj->nindex);
+			exit(1);
+		}
+		if (traj->quant != NULL) {
+			/* Quantized time steps are decoded from the keyframe before them */
+			long key = quantizedKeyframe(traj, opts.first);
+			traj->offset = traj->index[key].start;
+			for (long i = key; i < opts.first; i++) {
+				nextFrame(traj);
+			}
+		} else if (traj->binary) {
+			traj->offset = traj->index[opts.first].start;
+		} else {
+			traj->bufoffset = lseek(traj->fd, traj->index[opts.first].start, SEEK_SET);
+			if (traj->bufoffset < 0) {
+				fprintf(stderr, "Error seeking in %s.\n", filename);
+				exit(1);
+			}
+			traj->buflen = traj->bufpos = 0;
+			traj->eof = 0;
+		}
+	}
+
+	/* Regular files can be split in byte ranges parsed by several threads */
+	if (!traj->binary && opts.nthreads > 1) {
+		if (!traj->follow && fstat(traj->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+			traj->parser = startTextParser(traj->fd, traj->bufoffset + traj->bufpos, opts.nthreads,
+						       traj->filter ? traj : NULL);
+		} else {
+			printf("%s can not be split in byte ranges, parsing it on one thread.\n", filename);
+		}
+	}
+
+	/* Without index, time steps before the first one are read and dropped */
+	if (opts.first > 0 && traj->nindex == 0) {
+		if (!traj->binary && traj->decompressor == NULL) {
+			printf("No index for %s, reading %ld time steps to reach the first one.\n", filename, opts.first);
+			printf("Run 'fernet index %s' to seek directly.\n", filename);
+		}
+		for (long i = 0; i < opts.first; i++) {
+			if (nextFrame(traj) == NULL) {
+				fprintf(stderr, "First time step %ld is past the end of %s (%ld time steps).\n",
+					opts.first, filename, i);
+				exit(1);
+			}
+		}
+	}
+
+	return traj;
+}
+
+/***********************************************************************************
+ * Intern the species the run emits, so molecules of any other species can be
+ * dropped from text input as they are parsed (see parseTextLine). Binary frames
+ * are read in place and keep all their molecules.
+ ***********************************************************************************/
+
+static void keepSpecies(struct trajectory *traj, struct inputOptions opts)
+{
+	if (opts.nspecies == 0) {
+		return;
+	}
+	for (int i = 0; i < opts.nspecies; i++) {
+		internSpecies(traj, opts.species[i], strlen(opts.species[i]));
+	}
+	traj->filter = 1;
+}
+
+/***********************************************************************************
+ * Load the frame index of a trajectory, if there is an up to date one
+ ***********************************************************************************/
+
+static void loadIndex(struct trajectory *traj, const char *filename)
+{
+	struct indexHeader header;
+	struct stat st;
+	char idxname[strlen(filename) + sizeof(INDEX_SUFFIX)];
+	FILE *fileIdx;
+
+	/* Pipes and the standard input are read as they come */
+	if (fstat(traj->fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		return;
+	}
+
+	sprintf(idxname, "%s%s", filename, INDEX_SUFFIX);
+	fileIdx = fopen(idxname, "rb");
+	if (fileIdx == NULL) {
+		return;
+	}
+
+	if (fread(&header, sizeof(header), 1, fileIdx) != 1 || memcmp(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC))
+	    || header.version != INDEX_VERSION) {
+		fprintf(stderr, "Ignoring invalid frame index %s.\n", idxname);
+		fclose(fileIdx);
+		return;
+	}
+	if (header.size != (uint64_t) st.st_size) {
+		fprintf(stderr, "Ignoring frame index %s, %s has changed since it was indexed.\n", idxname, filename);
+		fclose(fileIdx);
+		return;
+	}
+
+	traj->index = (struct indexEntry *)malloc(header.nframes * sizeof(struct indexEntry));
+	if (fread(traj->index, sizeof(struct indexEntry), header.nframes, fileIdx) != header.nframes) {
+		fprintf(stderr, "Ignoring truncated frame index %s.\n", idxname);
+		free(traj->index);
+		traj->index = NULL;
+		fclose(fileIdx);
+		return;
+	}
+	traj->nindex = header.nframes;
+
+	fclose(fileIdx);
+}
+
+static void openBinary(struct trajectory *traj, const char *filename)
+{
+	struct stat st;
+	struct trajHeader *header;
+
+	free(traj->buf);
+	traj->buf = NULL;
+	traj->binary = 1;
+	if (fstat(traj->fd, &st) < 0) {
+		fprintf(stderr, "Error opening %s for reading.\n", filename);
+		exit(1);
+	}
+	traj->size = st.st_size;
+	if (traj->size < sizeof(struct trajHeader)) {
+		fprintf(stderr, "Truncated binary trajectory %s.\n", filename);
+		exit(1);
+	}
+
+	traj->map = (unsigned char *)mmap(NULL, traj->size, PROT_READ, MAP_SHARED, traj->fd, 0);
+	if (traj->map == MAP_FAILED) {
+		fprintf(stderr, "Error mapping %s into memory.\n", filename);
+		exit(1);
+	}
+	madvise(traj->map, traj->size, MADV_SEQUENTIAL);
+
+	/* Parse binary file header */
+	header = (struct trajHeader *)traj->map;
+	if (header->version != TRAJ_VERSION && header->version != TRAJ_QUANTIZED) {
+		fprintf(stderr, "Unsupported binary trajectory version %u in %s.\n", header->version, filename);
+		exit(1);
+	}
+	if (header->table < sizeof(struct trajHeader) || header->table > traj->size) {
+		fprintf(stderr, "Truncated binary trajectory %s.\n", filename);
+		exit(1);
+	}
+	traj->simu_dt = header->simu_dt;
+	traj->mD = header->mD;
+	traj->offset = sizeof(struct trajHeader);
+	traj->end = header->table;
+
+	/* Quantized positions are decoded into the frame buffers */
+	if (header->version == TRAJ_QUANTIZED) {
+		struct quantHeader *qheader = (struct quantHeader *)(traj->map + traj->offset);
+		if (traj->offset + sizeof(struct quantHeader) > traj->end || !(qheader->step > 0)) {
+			fprintf(stderr, "Invalid quantized trajectory %s.\n", filename);
+			exit(1);
+		}
+		traj->quant = newQuantState(qheader->step);
+		traj->offset += sizeof(struct quantHeader);
+	}
+
+	/* Species table: name length followed by the name, without terminator */
+	size_t pos = header->table;
+	traj->nspecies = header->nspecies;
+	traj->maxspecies = traj->nspecies;
+	traj->species = (char **)malloc(traj->maxspecies * sizeof(char *));
+	for (int i = 0; i < traj->nspecies; i++) {
+		uint16_t len;
+		if (pos + sizeof(len) > traj->size) {
+			fprintf(stderr, "Truncated species table in %s.\n", filename);
+			exit(1);
+		}
+		memcpy(&len, traj->map + pos, sizeof(len));
+		pos += sizeof(len);
+		if (pos + len > traj->size) {
+			fprintf(stderr, "Truncated species table in %s.\n", filename);
+			exit(1);
+		}
+		traj->species[i] = (char *)malloc((len + 1) * sizeof(char));
+		memcpy(traj->species[i], traj->map + pos, len);
+		traj->species[i][len] = '\0';
+		pos += len;
+	}
+	rehashSpecies(traj, 2 * traj->nspecies);
+}
+
+/***********************************************************************************
+ * Read next time step. The returned frame is valid until the next call. Time steps
+ * are read ahead on a background thread (see startReader), started on the first
+ * call so that the trajectory can still be set up after openTrajectory.
+ ***********************************************************************************/
+
+struct frame *readFrame(struct trajectory *traj)
+{
+	if (traj->reader == NULL) {
+		traj->reader = startReader(traj);
+	}
+
+	return readQueuedFrame(traj->reader);
+}
+
+/***********************************************************************************
+ * Read next time step while keeping the ones read before, up to the read-ahead of
+ * the trajectory. Frames stay valid until releaseFrame, which releases the oldest.
+ * A trajectory is read either with readFrame or with takeFrame, not both.
+ ***********************************************************************************/
+
+struct frame *takeFrame(struct trajectory *traj)
+{
+	if (traj->reader == NULL) {
+		traj->reader = startReader(traj);
+	}
+
+	return takeQueuedFrame(traj->reader);
+}
+
+void releaseFrame(struct trajectory *traj)
+{
+	releaseQueuedFrame(traj->reader);
+}
+
+/***********************************************************************************
+ * Read next time step on the calling thread, within the time step window
+ ***********************************************************************************/
+
+struct frame *fetchFrame(struct trajectory *traj)
+{
+	struct frame *frame;
+
+	if (traj->last >= 0 && traj->next > traj->last) {
+		return NULL;
+	}
+	frame = nextFrame(traj);
+	if (frame == NULL && traj->live) {
+		fprintf(stderr, "Warning: input ended before the separator of the last iteration (iter == total).\n");
+	}
+	if (frame == NULL || frame->iter >= traj->stopiter) {
+		traj->last = traj->next - 1;
+		return NULL;
+	}
+	frame->index = traj->next++;
+
+	/* Last time step of the simulation */
+	if (frame->total > 0 && frame->iter >= frame->total) {
+		traj->last = frame->index;
+	}
+
+	return frame;
+}
+
+/***********************************************************************************
+ * Stop reading at the first time step of iteration iter. With an index the last
+ * time step is known in advance, so nothing after it is read. Must be called
+ * before the first readFrame.
+ ***********************************************************************************/
+
+void stopAtIteration(struct trajectory *traj, float iter)
+{
+	long lo = traj->next, hi = traj->nindex;
+
+	traj->stopiter = iter;
+	if (traj->nindex == 0 || traj->next >= traj->nindex) {
+		return;
+	}
+
+	/* Iterations grow along the trajectory, search the first one reaching iter */
+	while (lo < hi) {
+		long mid = lo + (hi - lo) / 2;
+		if (traj->index[mid].iter < iter) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (traj->last < 0 || traj->last > lo - 1) {
+		traj->last = lo - 1;
+	}
+}
+
+static struct frame *nextFrame(struct trajectory *traj)
+{
+	if (traj->quant != NULL) {
+		return readQuantizedFrame(traj);
+	}
+	if (traj->binary) {
+		return readBinaryFrame(traj);
+	}
+	if (traj->parser != NULL) {
+		return readChunkedFrame(traj);
+	}
+	if (traj->viz != NULL) {
+		return readVizFrame(traj);
+	}
+	return readTextFrame(traj);
+}
+
+static struct frame *readTextFrame(struct trajectory *traj)
+{
+	struct frame *frame = &traj->frame;
+	const char *line, *eol, *name;
+	size_t len;
+	float x, y, z;
+
+	frame->nmols = 0;
+	frame->start = traj->bufoffset + traj->bufpos;
+	while ((line = nextLine(traj, &eol)) != NULL) {
+		switch (parseTextLine(traj->filter ? traj : NULL, line, &name, &len, &x, &y, &z)) {
+		case TEXT_SEPARATOR:
+			frame->separator = traj->bufoffset + (line - traj->buf);
+			frame->iter = y;
+			frame->total = z;
+			return frame;
+
+		case TEXT_MOLECULE:
+			if (frame->nmols == traj->capacity) {
+				growFrame(traj);
+			}
+			frame->species[frame->nmols] = internSpecies(traj, name, len);
+			frame->x[frame->nmols] = x;
+			frame->y[frame->nmols] = y;
+			frame->z[frame->nmols] = z;
+			frame->nmols++;
+			break;
+
+		case TEXT_INVALID:
+			fprintf(stderr, "Malformed line in trajectory: %.*s\n", (int)(eol - line), line);
+			exit(1);
+		}
+	}
+
+	return NULL;
+}
+
+/***********************************************************************************
+ * Double the molecules allocated in the frame of a trajectory
+ ***********************************************************************************/
+
+void growFrame(struct trajectory *traj)
+{
+	struct frame *frame = &traj->frame;
+
+	traj->capacity = traj->capacity ? 2 * traj->capacity : 1024;
+	frame->species = (uint16_t *)realloc(frame->species, traj->capacity * sizeof(uint16_t));
+	frame->x = (float *)realloc(frame->x, traj->capacity * sizeof(float));
+	frame->y = (float *)realloc(frame->y, traj->capacity * sizeof(float));
+	frame->z = (float *)realloc(frame->z, traj->capacity * sizeof(float));
+}
+
+/***********************************************************************************
+ * Parse one "name x y z" line, which must end with '\n'. Separator lines are
+ * recognised from the literal "100" in the x field before any float conversion,
+ * or from x == 100 when written otherwise ("100.0", "1e2"). With a filter
+ * trajectory, molecules of species it has not interned are dropped once their x
+ * shows they are not separators, before y and z are converted. This path is used
+ * by every reader, and by the re-alignment of parser chunks on separator lines.
+ ***********************************************************************************/
+
+#define IS_BLANK(c) ((c) == ' ' || (c) == '\t' || (c) == '\r')
+
+int parseTextLine(const struct trajectory *filter, const char *line, const char **name, size_t *len, float *x,
+		  float *y, float *z)
+{
+	const char *p = line;
+
+	/* Molecule name */
+	while (IS_BLANK(*p)) {
+		p++;
+	}
+	if (*p == '\n') {
+		return TEXT_BLANK;
+	}
+	*name = p;
+	while (!IS_BLANK(*p) && *p != '\n') {
+		p++;
+	}
+	*len = p - *name;
+	while (IS_BLANK(*p)) {
+		p++;
+	}
+
+	/* Time step separator, "100 iter total" */
+	if (p[0] == '1' && p[1] == '0' && p[2] == '0' && (IS_BLANK(p[3]) || p[3] == '\n')) {
+		*x = 100;
+		p += 3;
+	} else if ((p = parseFloat(p, x)) == NULL) {
+		return TEXT_INVALID;
+	} else if (*x != 100 && filter != NULL && findSpecies(filter, *name, *len) < 0) {
+		return TEXT_DROPPED;
+	}
+
+	if ((p = parseFloat(p, y)) == NULL || parseFloat(p, z) == NULL) {
+		return TEXT_INVALID;
+	}
+
+	return *x == 100 ? TEXT_SEPARATOR : TEXT_MOLECULE;
+}
+
+/***********************************************************************************
+ * Get next line from the text input buffer, refilling it as needed. The line ends
+ * at *eol, which always holds a '\n', so the parsers below stop there without
+ * bounds checks. Returns NULL at the end of file.
+ ***********************************************************************************/
+
+static const char *nextLine(struct trajectory *traj, const char **eol)
+{
+	char *line, *nl;
+
+	for (;;) {
+		line = traj->buf + traj->bufpos;
+		nl = traj->bufpos < traj->buflen ? (char *)memchr(line, '\n', traj->buflen - traj->bufpos) : NULL;
+		if (nl != NULL) {
+			traj->bufpos = nl + 1 - traj->buf;
+			*eol = nl;
+			return line;
+		}
+
+		if (traj->eof) {
+			if (traj->bufpos == traj->buflen) {
+				return NULL;
+			}
+			/* Last line without newline, the spare byte holds the terminator */
+			traj->buf[traj->buflen] = '\n';
+			traj->bufpos = traj->buflen;
+			*eol = traj->buf + traj->buflen;
+			return line;
+		}
+
+		fillBuffer(traj);
+	}
+}
+
+/***********************************************************************************
+ * Keep the unparsed bytes and read(2) the next block after them. One spare byte
+ * is always left at the end of the buffer for the last line terminator. Followed
+ * regular files never reach the end, reads are retried until the writer appends
+ * more. The end of a pipe is final.
+ ***********************************************************************************/
+
+static void fillBuffer(struct trajectory *traj)
+{
+	struct timespec pause = { 0, FOLLOW_INTERVAL * 1000000L };
+	ssize_t nread;
+
+	traj->buflen -= traj->bufpos;
+	if (traj->bufpos > 0) {
+		memmove(traj->buf, traj->buf + traj->bufpos, traj->buflen);
+		traj->bufoffset += traj->bufpos;
+		traj->bufpos = 0;
+	}
+	if (traj->bufsize - traj->buflen < READ_BLOCK + 1) {
+		traj->bufsize = traj->buflen + READ_BLOCK + 1;
+		traj->buf = (char *)realloc(traj->buf, traj->bufsize);
+	}
+
+	for (;;) {
+		nread = read(traj->fd, traj->buf + traj->buflen, traj->bufsize - traj->buflen - 1);
+		if (nread < 0) {
+			fprintf(stderr, "Error reading trajectory.\n");
+			exit(1);
+		}
+		if (nread > 0 || !traj->follow) {
+			break;
+		}
+		nanosleep(&pause, NULL);
+	}
+	if (nread == 0) {
+		traj->eof = 1;
+	}
+	traj->buflen += nread;
+}
+
+/***********************************************************************************
+ * Parse a decimal number at p, skipping leading blanks. Up to 7 significant digits
+ * with exponents within the exact powers of 10 in float are converted with a
+ * single correctly rounded float multiplication or division, as strtof would.
+ * Anything else is handed to strtof. Returns the end of the number, or NULL if
+ * the field is missing.
+ ***********************************************************************************/
+
+static const float exact10[] = {
+	1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f
+};
+
+static const char *parseFloat(const char *p, float *value)
+{
+	const char *start;
+	uint64_t mant = 0;
+	int ndigits = 0, exp10 = 0, seen = 0, neg = 0;
+	char *end;
+
+	while (IS_BLANK(*p)) {
+		p++;
+	}
+	start = p;
+	if (*p == '-' || *p == '+') {
+		neg = (*p == '-');
+		p++;
+	}
+
+	/* Integer and fractional digits, leading zeros are not significant */
+	for (; *p >= '0' && *p <= '9'; p++, seen = 1) {
+		if (mant != 0 || *p != '0') {
+			mant = 10 * mant + (*p - '0');
+			ndigits++;
+		}
+	}
+	if (*p == '.') {
+		for (p++; *p >= '0' && *p <= '9'; p++, seen = 1) {
+			if (mant != 0 || *p != '0') {
+				mant = 10 * mant + (*p - '0');
+				ndigits++;
+			}
+			exp10--;
+		}
+	}
+	if (!seen) {
+		goto slow;
+	}
+
+	/* Exponent */
+	if (*p == 'e' || *p == 'E') {
+		int eneg = 0, e = 0;
+		p++;
+		if (*p == '-' || *p == '+') {
+			eneg = (*p == '-');
+			p++;
+		}
+		if (*p < '0' || *p > '9') {
+			goto slow;
+		}
+		for (; *p >= '0' && *p <= '9' && e < 1000; p++) {
+			e = 10 * e + (*p - '0');
+		}
+		exp10 += eneg ? -e : e;
+	}
+
+	if (ndigits > 7 || exp10 < -10 || exp10 > 10 || !(IS_BLANK(*p) || *p == '\n')) {
+		goto slow;
+	}
+
+	float v = (float)mant;
+	v = exp10 < 0 ? v / exact10[-exp10] : v * exact10[exp10];
+	*value = neg ? -v : v;
+	return p;
+
+ slow:
+	if (*start == '\n') {
+		return NULL;
+	}
+	*value = strtof(start, &end);
+	if (end == start) {
+		return NULL;
+	}
+	return end;
+}
+
+static struct frame *readBinaryFrame(struct trajectory *traj)
+{
+	struct frame *frame = &traj->frame;
+	struct frameHeader *header;
+	size_t pos = traj->offset;
+
+	if (pos + sizeof(struct frameHeader) > traj->end) {
+		return NULL;
+	}
+	header = (struct frameHeader *)(traj->map + pos);
+	frame->start = frame->separator = pos;
+	pos += sizeof(struct frameHeader);
+
+	/* Blocks are 4-byte aligned, so positions are read in place */
+	frame->nmols = header->nmols;
+	frame->iter = header->iter;
+	frame->total = header->total;
+	frame->species = (uint16_t *)(traj->map + pos);
+	pos += (frame->nmols * sizeof(uint16_t) + 3) & ~(size_t) 3;
+	frame->x = (float *)(traj->map + pos);
+	pos += frame->nmols * sizeof(float);
+	frame->y = (float *)(traj->map + pos);
+	pos += frame->nmols * sizeof(float);
+	frame->z = (float *)(traj->map + pos);
+	pos += frame->nmols * sizeof(float);
+
+	if (pos > traj->end) {
+		fprintf(stderr, "Truncated frame in binary trajectory.\n");
+		exit(1);
+	}
+	traj->offset = pos;
+
+	return frame;
+}
+
+/***********************************************************************************
+ * Species IDs are found through an open addressing hash table of the names, with
+ * slots holding ID + 1 and 0 for empty slots. findSpecies does not modify the
+ * trajectory, so parser threads may call it while nothing is being interned.
+ ***********************************************************************************/
+
+unsigned int hashName(const char *name, size_t len)
+{
+	unsigned int h = 2166136261u;	// FNV-1a
+
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ (unsigned char)name[i]) * 16777619u;
+	}
+	return h;
+}
+
+int findSpecies(const struct trajectory *traj, const char *molname, size_t len)
+{
+	if (traj->nslots == 0) {
+		return -1;
+	}
+	for (unsigned int h = hashName(molname, len) & (traj->nslots - 1); traj->slots[h] != 0;
+	     h = (h + 1) & (traj->nslots - 1)) {
+		const char *species = traj->species[traj->slots[h] - 1];
+		if (!strncmp(molname, species, len) && species[len] == '\0') {
+			return traj->slots[h] - 1;
+		}
+	}
+	return -1;
+}
+
+static void rehashSpecies(struct trajectory *traj, int nslots)
+{
+	traj->nslots = 64;
+	while (traj->nslots < nslots) {
+		traj->nslots *= 2;
+	}
+	free(traj->slots);
+	traj->slots = (int *)calloc(traj->nslots, sizeof(int));
+	for (int i = 0; i < traj->nspecies; i++) {
+		unsigned int h = hashName(traj->species[i], strlen(traj->species[i])) & (traj->nslots - 1);
+		while (traj->slots[h] != 0) {
+			h = (h + 1) & (traj->nslots - 1);
+		}
+		traj->slots[h] = i + 1;
+	}
+}
+
+/***********************************************************************************
+ * Get species ID for a molecule name, adding it to the species table if needed
+ ***********************************************************************************/
+
+int internSpecies(struct trajectory *traj, const char *molname, size_t len)
+{
+	int id = findSpecies(traj, molname, len);
+
+	if (id >= 0) {
+		return id;
+	}
+
+	if (traj->nspecies > UINT16_MAX) {
+		fprintf(stderr, "Too many molecule species in trajectory.\n");
+		exit(1);
+	}
+	if (traj->nspecies == traj->maxspecies) {
+		traj->maxspecies = traj->maxspecies ? 2 * traj->maxspecies : 16;
+		traj->species = (char **)realloc(traj->species, traj->maxspecies * sizeof(char *));
+	}
+	traj->species[traj->nspecies] = (char *)malloc((len + 1) * sizeof(char));
+	memcpy(traj->species[traj->nspecies], molname, len);
+	traj->species[traj->nspecies][len] = '\0';
+	traj->nspecies++;
+
+	/* Keep the table at most half full */
+	if (2 * traj->nspecies > traj->nslots) {
+		rehashSpecies(traj, 2 * traj->nspecies);
+	} else {
+		unsigned int h = hashName(molname, len) & (traj->nslots - 1);
+		while (traj->slots[h] != 0) {
+			h = (h + 1) & (traj->nslots - 1);
+		}
+		traj->slots[h] = traj->nspecies;
+	}
+
+	return traj->nspecies - 1;
+}
+
+/***********************************************************************************
+ * Close trajectory and release buffers
+ ***********************************************************************************/
+
+void closeTrajectory(struct trajectory *traj)
+{
+	if (traj->reader != NULL) {
+		stopReader(traj->reader);
+	}
+	if (traj->binary) {
+		munmap(traj->map, traj->size);
+		if (traj->quant != NULL) {
+			freeQuantState(traj->quant);
+			free(traj->frame.species);
+			free(traj->frame.x);
+			free(traj->frame.y);
+			free(traj->frame.z);
+		}
+	} else {
+		free(traj->buf);
+		if (traj->parser != NULL) {
+			/* Frames point into the parser buffers */
+			stopTextParser(traj->parser);
+		} else {
+			free(traj->frame.species);
+			free(traj->frame.x);
+			free(traj->frame.y);
+			free(traj->frame.z);
+		}
+	}
+	if (traj->viz != NULL) {
+		closeVizData(traj->viz);
+	} else {
+		close(traj->fd);
+	}
+	if (traj->decompressor != NULL) {
+		stopDecompressor(traj->decompressor);
+	}
+	free(traj->index);
+	free(traj->slots);
+
+	for (int i = 0; i < traj->nspecies; i++) {
+		free(traj->species[i]);
+	}
+	free(traj->species);
+	free(traj);
+}
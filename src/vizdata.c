@@ -0,0 +1,372 @@
+/***********************************************************************************
+ *                                                                                 *
+ * FERNET: Fluorescence Emission Recipes and NumErical routines Toolkit            *
+ * Developed by Juan F. Angiolini and Esteban Mocskos                              *
+ * Facultad de Ciencias Exactas y Naturales, UBA                                   *
+ *                                                                                 *
+ * This program is free software; you can redistribute it and/or                   *
+ * modify it under the terms of the GNU General Public License                     *
+ * as published by the Free Software Foundation; either version 2                  *
+ * of the License, or (at your option) any later version.                          *
+ *                                                                                 *
+ * This program is distributed in the hope that it will be useful,                 *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of                  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                   *
+ * GNU General Public License for more details.                                    *
+ *                                                                                 *
+ * You should have received a copy of the GNU General Public License               *
+ * along with this program; if not, write to the Free Software                     *
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. *
+ *                                                                                 *
+ ***********************************************************************************/
+
+
+#include "fernet.h"
+
+/***********************************************************************************
+ * MCell visualization output. MCell writes the molecule positions of every
+ * iteration in its own file of a viz_data seed directory, either as ASCII
+ * (Scene.ascii.<iter>.dat, "name id x y z nx ny nz" lines) or as CellBlender
+ * binary (Scene.cellbin.<iter>.dat). The files are read in iteration order and
+ * each one becomes a time step, so no merged text trajectory is needed. These
+ * files carry neither simu_dt nor mD, which are taken from the configuration file
+ * instead (see parseCommon). Time steps are numbered by file, as MCell may write
+ * them only every few iterations.
+ ***********************************************************************************/
+
+enum viz_formats { VIZ_ASCII, VIZ_CELLBIN };
+
+struct vizFile {
+	char *name;
+	long iter;		// MCell iteration from the file name
+};
+
+struct vizData {
+	const char *dirname;
+	enum viz_formats format;
+	long nfiles, next;
+	struct vizFile *files;
+	char *buf;		// contents of the current file
+	size_t bufsize;
+};
+
+static int vizIteration(const char *, enum viz_formats *, long *);
+static int compareVizFiles(const void *, const void *);
+static size_t loadVizFile(struct vizData *, const char *);
+static void parseAscii(struct trajectory *, size_t, const char *);
+static void parseCellbin(struct trajectory *, size_t, const char *);
+
+/***********************************************************************************
+ * List the visualization files of a seed directory, starting at time step first
+ ***********************************************************************************/
+
+struct vizData *openVizData(const char *dirname, long first)
+{
+	struct vizData *viz = (struct vizData *)calloc(1, sizeof(struct vizData));
+	struct dirent *entry;
+	enum viz_formats format;
+	long iter, capacity = 0;
+	int nseeds = 0;
+	DIR *dir;
+
+	dir = opendir(dirname);
+	if (dir == NULL) {
+		fprintf(stderr, "Error opening directory %s.\n", dirname);
+		exit(1);
+	}
+	viz->dirname = dirname;
+
+	while ((entry = readdir(dir)) != NULL) {
+		if (!strncmp(entry->d_name, "seed_", 5)) {
+			nseeds++;
+		}
+		if (!vizIteration(entry->d_name, &format, &iter)) {
+			continue;
+		}
+		if (viz->nfiles > 0 && format != viz->format) {
+			fprintf(stderr, "%s holds both ASCII and binary visualization files.\n", dirname);
+			exit(1);
+		}
+		if (viz->nfiles == capacity) {
+			capacity = capacity ? 2 * capacity : 1024;
+			viz->files = (struct vizFile *)realloc(viz->files, capacity * sizeof(struct vizFile));
+		}
+		viz->format = format;
+		viz->files[viz->nfiles].name = strdup(entry->d_name);
+		viz->files[viz->nfiles].iter = iter;
+		viz->nfiles++;
+	}
+	closedir(dir);
+
+	if (viz->nfiles == 0) {
+		if (nseeds > 0) {
+			fprintf(stderr, "No visualization files in %s, give one of its seed_ directories instead.\n",
+				dirname);
+		} else {
+			fprintf(stderr, "No MCell visualization files in %s.\n", dirname);
+		}
+		exit(1);
+	}
+	if (first >= viz->nfiles) {
+		fprintf(stderr, "First time step %ld is past the end of %s (%ld time steps).\n",
+			first, dirname, viz->nfiles);
+		exit(1);
+	}
+
+	qsort(viz->files, viz->nfiles, sizeof(struct vizFile), compareVizFiles);
+	viz->next = first;
+
+	return viz;
+}
+
+/***********************************************************************************
+ * Get the format and iteration from a visualization file name, <prefix>.ascii.
+ * <iter>.dat or <prefix>.cellbin.<iter>.dat. Returns 0 for any other file.
+ ***********************************************************************************/
+
+static int vizIteration(const char *name, enum viz_formats *format, long *iter)
+{
+	size_t len = strlen(name);
+	const char *p;
+
+	if (len < 4 || strcmp(name + len - 4, ".dat")) {
+		return 0;
+	}
+	for (p = name + len - 4; p > name && p[-1] >= '0' && p[-1] <= '9'; p--) ;
+	if (p == name + len - 4 || p == name || p[-1] != '.') {
+		return 0;
+	}
+	*iter = strtol(p, NULL, 10);
+
+	if (p - name >= 7 && !strncmp(p - 7, ".ascii.", 7)) {
+		*format = VIZ_ASCII;
+	} else if (p - name >= 9 && !strncmp(p - 9, ".cellbin.", 9)) {
+		*format = VIZ_CELLBIN;
+	} else {
+		return 0;
+	}
+
+	return 1;
+}
+
+static int compareVizFiles(const void *a, const void *b)
+{
+	long ia = ((const struct vizFile *)a)->iter, ib = ((const struct vizFile *)b)->iter;
+
+	return (ia > ib) - (ia < ib);
+}
+
+/***********************************************************************************
+ * Read the next visualization file as one time step
+ ***********************************************************************************/
+
+struct frame *readVizFrame(struct trajectory *traj)
+{
+	struct vizData *viz = traj->viz;
+	struct frame *frame = &traj->frame;
+	const char *name;
+	size_t len;
+
+	if (viz->next == viz->nfiles) {
+		return NULL;
+	}
+	name = viz->files[viz->next].name;
+	len = loadVizFile(viz, name);
+
+	frame->nmols = 0;
+	if (viz->format == VIZ_ASCII) {
+		parseAscii(traj, len, name);
+	} else {
+		parseCellbin(traj, len, name);
+	}
+	frame->iter = viz->next;
+	frame->total = viz->nfiles - 1;
+	frame->start = frame->separator = 0;
+	viz->next++;
+
+	return frame;
+}
+
+/***********************************************************************************
+ * Read a whole file into the buffer, followed by a '\n' sentinel
+ ***********************************************************************************/
+
+static size_t loadVizFile(struct vizData *viz, const char *name)
+{
+	char path[strlen(viz->dirname) + strlen(name) + 2];
+	struct stat st;
+	size_t len = 0;
+	ssize_t nread;
+	int fd;
+
+	sprintf(path, "%s/%s", viz->dirname, name);
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "Error opening %s for reading.\n", path);
+		exit(1);
+	}
+	if (viz->bufsize < (size_t)st.st_size + 1) {
+		viz->bufsize = st.st_size + 1;
+		viz->buf = (char *)realloc(viz->buf, viz->bufsize);
+	}
+
+	while (len < (size_t)st.st_size && (nread = read(fd, viz->buf + len, st.st_size - len)) > 0) {
+		len += nread;
+	}
+	if (len != (size_t)st.st_size) {
+		fprintf(stderr, "Error reading %s.\n", path);
+		exit(1);
+	}
+	viz->buf[len] = '\n';
+	close(fd);
+
+	return len;
+}
+
+/***********************************************************************************
+ * ASCII visualization file: "name id x y z nx ny nz" per molecule. The id and the
+ * orientation of surface molecules are optional and ignored, so the position is
+ * told apart by the number of fields: 3 or 6 without id, 4 or 7 with it.
+ ***********************************************************************************/
+
+static void parseAscii(struct trajectory *traj, size_t len, const char *filename)
+{
+	struct frame *frame = &traj->frame;
+	char *line = traj->viz->buf, *end = traj->viz->buf + len, *eol, *p, *q;
+	float values[8];
+	int nvalues, xfield;
+
+	for (; line < end; line = eol + 1) {
+		eol = (char *)memchr(line, '\n', end + 1 - line);
+
+		/* Molecule name */
+		for (p = line; *p == ' ' || *p == '\t'; p++) ;
+		if (*p == '\n' || *p == '\r') {
+			continue;
+		}
+		for (q = p; *q != ' ' && *q != '\t' && *q != '\n'; q++) ;
+
+		/* Every field after the name, id and orientation included */
+		char *name = p;
+		size_t namelen = q - p;
+		if (traj->filter && findSpecies(traj, name, namelen) < 0) {
+			continue;
+		}
+		for (nvalues = 0, p = q; nvalues < 8; nvalues++, p = q) {
+			while (*p == ' ' || *p == '\t' || *p == '\r') {
+				p++;
+			}
+			if (p >= eol) {
+				break;
+			}
+			values[nvalues] = strtof(p, &q);
+			if (q == p) {
+				break;
+			}
+		}
+		while (*p == ' ' || *p == '\t' || *p == '\r') {
+			p++;
+		}
+		if (p < eol) {
+			nvalues = 0;	// text or more fields after the numbers
+		}
+		if (nvalues == 3 || nvalues == 6) {
+			xfield = 0;
+		} else if (nvalues == 4 || nvalues == 7) {
+			xfield = 1;
+		} else {
+			fprintf(stderr, "Malformed line in %s: %.*s\n", filename, (int)(eol - line), line);
+			exit(1);
+		}
+
+		if (frame->nmols == traj->capacity) {
+			growFrame(traj);
+		}
+		frame->species[frame->nmols] = internSpecies(traj, name, namelen);
+		frame->x[frame->nmols] = values[xfield];
+		frame->y[frame->nmols] = values[xfield + 1];
+		frame->z[frame->nmols] = values[xfield + 2];
+		frame->nmols++;
+	}
+}
+
+/***********************************************************************************
+ * CellBlender binary visualization file: a uint32 1, then one block per species
+ * with the name length (uint8), the name, the species type (uint8, 1 for surface
+ * molecules), the number of floats (uint32) and the x, y, z triplets. Surface
+ * molecule blocks are followed by as many orientation floats, which are skipped.
+ ***********************************************************************************/
+
+static void parseCellbin(struct trajectory *traj, size_t len, const char *filename)
+{
+	struct frame *frame = &traj->frame;
+	const unsigned char *buf = (const unsigned char *)traj->viz->buf;
+	size_t pos = sizeof(uint32_t);
+	uint32_t version, nfloats;
+	uint8_t namelen, type;
+	int id;
+
+	if (len < sizeof(version)) {
+		fprintf(stderr, "Invalid CellBlender binary file %s.\n", filename);
+		exit(1);
+	}
+	memcpy(&version, buf, sizeof(version));
+	if (version != 1) {
+		fprintf(stderr, "Invalid CellBlender binary file %s.\n", filename);
+		exit(1);
+	}
+
+	while (pos < len) {
+		/* Species block header */
+		namelen = buf[pos++];
+		if (pos + namelen + 1 + sizeof(nfloats) > len) {
+			fprintf(stderr, "Truncated CellBlender binary file %s.\n", filename);
+			exit(1);
+		}
+		id = traj->filter ? findSpecies(traj, (const char *)buf + pos, namelen)
+		    : internSpecies(traj, (const char *)buf + pos, namelen);
+		pos += namelen;
+		type = buf[pos++];
+		memcpy(&nfloats, buf + pos, sizeof(nfloats));
+		pos += sizeof(nfloats);
+		if (nfloats % 3 != 0 || pos + (type == 1 ? 2 : 1) * (size_t)nfloats * sizeof(float) > len) {
+			fprintf(stderr, "Truncated CellBlender binary file %s.\n", filename);
+			exit(1);
+		}
+		if (id < 0) {
+			/* No channel emits this species */
+			pos += (type == 1 ? 2 : 1) * (size_t)nfloats * sizeof(float);
+			continue;
+		}
+
+		/* Positions */
+		for (uint32_t i = 0; i < nfloats / 3; i++) {
+			if (frame->nmols == traj->capacity) {
+				growFrame(traj);
+			}
+			frame->species[frame->nmols] = id;
+			memcpy(&frame->x[frame->nmols], buf + pos, sizeof(float));
+			memcpy(&frame->y[frame->nmols], buf + pos + sizeof(float), sizeof(float));
+			memcpy(&frame->z[frame->nmols], buf + pos + 2 * sizeof(float), sizeof(float));
+			frame->nmols++;
+			pos += 3 * sizeof(float);
+		}
+		if (type == 1) {
+			pos += nfloats * sizeof(float);
+		}
+	}
+}
+
+/***********************************************************************************
+ * Release the file list and buffer
+ ***********************************************************************************/
+
+void closeVizData(struct vizData *viz)
+{
+	for (long i = 0; i < viz->nfiles; i++) {
+		free(viz->files[i].name);
+	}
+	free(viz->files);
+	free(viz->buf);
+	free(viz);
+}